@@ -47,22 +47,46 @@ struct mapping_table;
 int mapping_table_alloc(struct mapping_table **tablep, const char *name);
 
 
-struct mapping {
+/* entry of a timing wheel */
+struct wheel_ent {
 	struct le le;
-	struct tmr tmr;
-	enum pcp_opcode opcode;
-	struct sa int_addr;  /* ADDR-part and PORT from 'map' (duplicated) */
-	struct pcp_map map;
-	char *ext_ifname;    /* External Interface */
+	uint64_t expires;    /* [ticks] */
+};
 
-	/* extra for PEER: */
-	struct sa remote_addr;
+/* compact socket address, unused bytes are zero */
+struct maddr {
+	uint8_t addr[16];
+	uint16_t port;
+	uint8_t af;          /* 4, 6 or 0 if not set */
+};
 
-	uint32_t lifetime;
-	bool committed;
-	char *descr;
+void maddr_set(struct maddr *ma, const struct sa *sa);
+void maddr_get(const struct maddr *ma, struct sa *sa);
 
+enum {
+	MAPPING_REPLY_SZ = 80,  /* PCP header and PEER payload */
+};
+
+struct mapping {
+	struct wheel_ent we; /* expiry */
 	struct mapping_table *table;  /* parent */
+	struct le sle;       /* in the list of the subscriber */
+	struct subscriber *sub;
+	struct list replyl;  /* replies waiting for the backend commit */
+	struct maddr int_addr;
+	struct maddr ext_addr;
+	struct maddr remote_addr;     /* PEER only */
+	uint8_t nonce[PCP_NONCE_SZ];
+	uint8_t opcode;
+	uint8_t proto;
+	uint8_t ifidx;       /* External Interface, interned */
+	bool committed;
+	bool journaled;      /* in the journal, or in a snapshot */
+	bool ext_held;       /* external port is reserved */
+	uint32_t lifetime;
+	const char *descr;   /* interned */
+	uint8_t reply[MAPPING_REPLY_SZ];  /* encoded SUCCESS reply */
+	uint8_t reply_len;
 };
 
 int  mapping_create(struct mapping **mappingp, struct mapping_table *table,
@@ -73,12 +97,25 @@ int  mapping_create(struct mapping **mappingp, struct mapping_table *table,
 		    const struct sa *remote_addr,
 		    uint32_t lifetime, const uint8_t nonce[12],
 		    const char *descr);
+void mapping_delete(struct mapping *mapping);
 void mapping_refresh(struct mapping *mapping, uint32_t lifetime);
+int  mapping_reply(struct mapping *mapping, struct udp_sock *us,
+		   const struct sa *dst, struct mbuf *req, uint32_t lifetime);
 struct mapping *mapping_find(const struct mapping_table *table,
 			     int proto, const struct sa *int_addr);
 struct mapping *mapping_find_peer(const struct mapping_table *table,
 				  int proto, const struct sa *int_addr,
 				  const struct sa *remote_addr);
+struct mapping *mapping_find_ext(const struct mapping_table *table,
+				 int proto, const struct sa *ext_addr);
+uint32_t mapping_tuple_hash(int proto, const struct sa *int_addr,
+			    const struct sa *rem_addr);
+uint32_t mapping_subscriber_count(const struct mapping_table *table,
+				  const struct sa *int_addr);
+uint32_t mapping_subscriber_delete(struct mapping_table *table,
+				   const struct sa *int_addr);
+int mapping_table_debug(struct re_printf *pf,
+			const struct mapping_table *table);
 
 
 /*
@@ -94,18 +131,25 @@ enum {
 typedef bool (repcpd_pcp_msg_h)(struct udp_sock *us, const struct sa *src,
 				struct mbuf *mb, struct pcp_msg *msg);
 
+/* returns true if the request is for an existing mapping */
+typedef bool (repcpd_pcp_exist_h)(const struct pcp_msg *msg);
+
 struct repcpd_pcp {
 	struct le le;
 	repcpd_pcp_msg_h *reqh;
+	repcpd_pcp_exist_h *existh;   /* optional, for the rate limit */
 };
 
 void repcpd_register_handler(struct repcpd_pcp *pcp);
 void repcpd_unregister_handler(struct repcpd_pcp *pcp);
 int pcp_ereply(struct udp_sock *us, const struct sa *dst, struct mbuf *req,
 	       enum pcp_result result);
+struct pcp_option *repcpd_msg_option(const struct pcp_msg *msg,
+				     enum pcp_option_code code);
 bool pcp_nonce_cmp(const struct pcp_msg *msg,
 		   const uint8_t nonce[PCP_NONCE_SZ]);
 uint32_t pcp_lifetime_calculate(uint32_t lifetime);
+void repcpd_subscriber(struct sa *sub, const struct sa *int_addr);
 
 
 /* udp */
@@ -121,7 +165,13 @@ void repcpd_udp_apply(repcpd_udp_apply_h *h, void *arg);
 int  repcpd_extaddr_init(void);
 void repcpd_extaddr_close(void);
 bool repcpd_extaddr_exist(const struct sa *addr);
-int  repcpd_extaddr_assign(struct sa *ext_addr, uint16_t int_port, int af);
+bool repcpd_extaddr_pooled(void);
+int  repcpd_extaddr_assign(struct sa *ext_addr, int proto,
+			   uint16_t suggested, const struct sa *int_addr,
+			   int af);
+int  repcpd_extaddr_reserve(const struct sa *ext_addr, int proto,
+			    const struct sa *int_addr);
+void repcpd_extaddr_release(const struct sa *ext_addr, int proto);
 char *repcpd_extaddr_ifname_find(int af);
 struct sa *repcpd_extaddr_find(int af);
 
@@ -132,6 +182,21 @@ struct sa *repcpd_extaddr_find(int af);
 
 typedef int  (backend_new_h)(const char *name);
 typedef void (backend_flush_h)(const char *name);
+typedef int  (backend_begin_h)(const char *name);
+typedef int  (backend_commit_h)(const char *name);
+
+/*
+ * Existing rule found by dump. For DNAT rules only the port of ext_addr
+ * is known. Return true to keep the rule, false to have it deleted.
+ */
+typedef bool (backend_rule_h)(enum pcp_opcode opcode, int proto,
+			      const struct sa *ext_addr,
+			      const char *ext_ifname,
+			      const struct sa *int_addr,
+			      const struct sa *remote_addr,
+			      const char *descr, void *arg);
+typedef int  (backend_dump_h)(const char *name, backend_rule_h *rh,
+			      void *arg);
 typedef int  (backend_append_dnat_h)(const char *name, int proto,
 				     const struct sa *ext_addr,
 				     const char *ext_ifname,
@@ -163,12 +228,27 @@ struct backend {
 	backend_delete_dnat_h *delete;
 	backend_append_snat_h *append_snat;
 	backend_delete_snat_h *delete_snat;
+
+	/* optional: rules between begin and commit form one transaction */
+	backend_begin_h *begin;
+	backend_commit_h *commit;
+
+	/* optional: list existing rules, ENOENT if the table is missing */
+	backend_dump_h *dump;
 };
 
 void backend_register(struct backend *be);
 void backend_unregister(struct backend *be);
 struct backend *backend_get(void);
 
+typedef int  (backend_work_h)(void *arg);
+typedef void (backend_done_h)(int err, void *arg);
+
+int  backend_work(backend_work_h *workh, backend_done_h *doneh, void *arg);
+void backend_sync(void);
+void backend_lock(void);
+void backend_unlock(void);
+
 
 /* div */
 
@@ -0,0 +1,551 @@
+/**
+ * @file ebpf.c  PCP address translation with a tc BPF program
+ *
+ * Copyright (C) 2010 - 2016 Creytiv.com
+ */
+
+#define _DEFAULT_SOURCE 1
+#include <string.h>
+#include <net/if.h>
+#include <bpf/libbpf.h>
+#include <bpf/bpf.h>
+#include <re.h>
+#include <repcpd.h>
+#include "ebpf.h"
+
+
+/*
+ * NOTE: the BPF program in "ebpf_tc.o" is attached to tc ingress and
+ *       egress of the IPv4 external interface and translates addresses
+ *       using two BPF hash maps, see tc.bpf.c. Adding or deleting a
+ *       mapping is a single map update, there is no rule set to rebuild
+ *       and no netfilter chain to walk per packet.
+ *
+ *       The maps are shared by all mapping tables. The entries of each
+ *       table are also kept here, hashed with mapping_tuple_hash() like
+ *       the mapping tables, so that a table can be flushed.
+ *
+ *       IPv6 is not supported: the map keys hold 32-bit addresses and
+ *       the program only parses IPv4 headers. Appending a mapping with
+ *       an IPv6 internal, external or remote address fails with
+ *       EAFNOSUPPORT, so the client gets a NO_RESOURCES reply. Use the
+ *       iptables or nftables module for IPv6 mappings.
+ *
+ *       The module does not need netfilter. test.sh in this directory
+ *       runs repcpd with it in a network namespace with a veth pair and
+ *       checks that a PCP MAP request installs the map entries.
+ */
+
+
+struct table {
+	struct le le;
+	char *name;
+	struct hash *entries;
+};
+
+struct entry {
+	struct le le;
+	struct ebpf_key in;   /* key in "nat_in" */
+	struct ebpf_key out;  /* key in "nat_out" */
+	struct ebpf_nat nat_in;
+	struct ebpf_nat nat_out;
+};
+
+
+static struct {
+	struct bpf_object *obj;
+	struct bpf_tc_hook hook;
+	struct bpf_tc_opts ingress;
+	struct bpf_tc_opts egress;
+	bool hook_created;
+	int fd_in;
+	int fd_out;
+	struct list tablel;
+} ebpf = {
+	.fd_in  = -1,
+	.fd_out = -1,
+};
+
+
+static void key_set(struct ebpf_key *k, int proto, const struct sa *addr,
+		    const struct sa *rem_addr)
+{
+	memset(k, 0, sizeof(*k));
+
+	k->proto = proto;
+	k->addr  = htonl(sa_in(addr));
+	k->port  = htons(sa_port(addr));
+
+	if (sa_isset(rem_addr, SA_ALL)) {
+		k->raddr = htonl(sa_in(rem_addr));
+		k->rport = htons(sa_port(rem_addr));
+	}
+}
+
+
+static void nat_set(struct ebpf_nat *nat, const struct sa *addr)
+{
+	memset(nat, 0, sizeof(*nat));
+
+	nat->addr = htonl(sa_in(addr));
+	nat->port = htons(sa_port(addr));
+}
+
+
+static void entry_destructor(void *arg)
+{
+	struct entry *e = arg;
+
+	hash_unlink(&e->le);
+}
+
+
+/* delete a map element, if it still has the value of the entry */
+static void map_delete(int fd, const struct ebpf_key *k,
+		       const struct ebpf_nat *nat)
+{
+	struct ebpf_nat cur;
+
+	if (bpf_map_lookup_elem(fd, k, &cur))
+		return;
+
+	if (cur.addr != nat->addr || cur.port != nat->port)
+		return;
+
+	(void)bpf_map_delete_elem(fd, k);
+}
+
+
+/*
+ * Remove the entry from the maps, and free it. "nat_in" is keyed on
+ * the external endpoint only, so its element may belong to another
+ * mapping by now, e.g. one that got the port after this one expired.
+ */
+static void entry_remove(struct entry *e)
+{
+	map_delete(ebpf.fd_in, &e->in, &e->nat_in);
+	map_delete(ebpf.fd_out, &e->out, &e->nat_out);
+
+	mem_deref(e);
+}
+
+
+static bool entry_cmp_handler(struct le *le, void *arg)
+{
+	const struct entry *e = le->data;
+
+	return 0 == memcmp(&e->out, arg, sizeof(e->out));
+}
+
+
+static struct entry *entry_find(const struct table *table, int proto,
+				const struct sa *int_addr,
+				const struct sa *rem_addr)
+{
+	struct ebpf_key out;
+
+	key_set(&out, proto, int_addr, rem_addr);
+
+	return list_ledata(hash_lookup(table->entries,
+				       mapping_tuple_hash(proto, int_addr,
+							  rem_addr),
+				       entry_cmp_handler, &out));
+}
+
+
+static bool flush_handler(struct le *le, void *arg)
+{
+	(void)arg;
+
+	entry_remove(le->data);
+
+	return false;
+}
+
+
+static void table_destructor(void *arg)
+{
+	struct table *table = arg;
+
+	list_unlink(&table->le);
+	hash_flush(table->entries);
+	mem_deref(table->entries);
+	mem_deref(table->name);
+}
+
+
+static struct table *table_find(const char *name)
+{
+	struct le *le;
+
+	for (le = ebpf.tablel.head; le; le = le->next) {
+
+		struct table *table = le->data;
+
+		if (0 == str_cmp(table->name, name))
+			return table;
+	}
+
+	return NULL;
+}
+
+
+static int entry_add(const char *name, int proto,
+		     const struct sa *ext_addr, const struct sa *int_addr,
+		     const struct sa *rem_addr)
+{
+	struct table *table;
+	struct entry *e;
+	int err;
+
+	/* IPv4 only, see the note at the top */
+	if (sa_af(ext_addr) != AF_INET || sa_af(int_addr) != AF_INET)
+		return EAFNOSUPPORT;
+
+	if (sa_isset(rem_addr, SA_ADDR) && sa_af(rem_addr) != AF_INET)
+		return EAFNOSUPPORT;
+
+	table = table_find(name);
+	if (!table)
+		return ENOENT;
+
+	/* an existing entry for the tuple is replaced */
+	e = entry_find(table, proto, int_addr, rem_addr);
+	if (e)
+		entry_remove(e);
+
+	e = mem_zalloc(sizeof(*e), entry_destructor);
+	if (!e)
+		return ENOMEM;
+
+	key_set(&e->in, proto, ext_addr, rem_addr);
+	key_set(&e->out, proto, int_addr, rem_addr);
+	nat_set(&e->nat_in, int_addr);
+	nat_set(&e->nat_out, ext_addr);
+
+	if (bpf_map_update_elem(ebpf.fd_in, &e->in, &e->nat_in, BPF_ANY)) {
+		err = errno;
+		goto error;
+	}
+
+	if (bpf_map_update_elem(ebpf.fd_out, &e->out, &e->nat_out,
+				BPF_ANY)) {
+		err = errno;
+		(void)bpf_map_delete_elem(ebpf.fd_in, &e->in);
+		goto error;
+	}
+
+	hash_append(table->entries,
+		    mapping_tuple_hash(proto, int_addr, rem_addr),
+		    &e->le, e);
+
+	return 0;
+
+ error:
+	warning("ebpf: map update failed (%m)\n", err);
+	mem_deref(e);
+
+	return err;
+}
+
+
+static void entry_del(const char *name, int proto,
+		      const struct sa *int_addr, const struct sa *rem_addr)
+{
+	struct table *table;
+	struct entry *e;
+
+	table = table_find(name);
+	if (!table)
+		return;
+
+	e = entry_find(table, proto, int_addr, rem_addr);
+	if (e)
+		entry_remove(e);
+}
+
+
+static int backend_new(const char *name)
+{
+	struct table *table;
+	int err;
+
+	if (table_find(name))
+		return EALREADY;
+
+	table = mem_zalloc(sizeof(*table), table_destructor);
+	if (!table)
+		return ENOMEM;
+
+	err = str_dup(&table->name, name);
+	if (err)
+		goto out;
+
+	err = hash_alloc(&table->entries, 256);
+	if (err)
+		goto out;
+
+	list_append(&ebpf.tablel, &table->le, table);
+
+ out:
+	if (err)
+		mem_deref(table);
+
+	return err;
+}
+
+
+static void backend_flush(const char *name)
+{
+	struct table *table;
+
+	table = table_find(name);
+	if (!table)
+		return;
+
+	(void)hash_apply(table->entries, flush_handler, NULL);
+	mem_deref(table);
+}
+
+
+static int backend_append(const char *name, int proto,
+			  const struct sa *ext_addr,
+			  const char *ext_ifname,
+			  const struct sa *int_addr,
+			  const char *descr)
+{
+	(void)ext_ifname;
+	(void)descr;
+
+	return entry_add(name, proto, ext_addr, int_addr, NULL);
+}
+
+
+static void backend_delete(const char *name, int proto,
+			   const struct sa *ext_addr,
+			   const char *ext_ifname,
+			   const struct sa *int_addr,
+			   const char *descr)
+{
+	(void)ext_addr;
+	(void)ext_ifname;
+	(void)descr;
+
+	entry_del(name, proto, int_addr, NULL);
+}
+
+
+static int backend_append_snat(const char *name, int proto,
+			       const struct sa *ext_addr,
+			       const char *ext_ifname,
+			       const struct sa *int_addr,
+			       const struct sa *peer_addr,
+			       const char *descr)
+{
+	(void)ext_ifname;
+	(void)descr;
+
+	return entry_add(name, proto, ext_addr, int_addr, peer_addr);
+}
+
+
+static void backend_delete_snat(const char *name, int proto,
+				const struct sa *ext_addr,
+				const char *ext_ifname,
+				const struct sa *int_addr,
+				const struct sa *peer_addr,
+				const char *descr)
+{
+	(void)ext_addr;
+	(void)ext_ifname;
+	(void)descr;
+
+	entry_del(name, proto, int_addr, peer_addr);
+}
+
+
+static struct backend be = {
+	.new    = backend_new,
+	.flush  = backend_flush,
+	.append = backend_append,
+	.delete = backend_delete,
+	.append_snat = backend_append_snat,
+	.delete_snat = backend_delete_snat,
+};
+
+
+static int prog_attach(struct bpf_tc_opts *opts, enum bpf_tc_attach_point ap,
+		       const char *prog)
+{
+	struct bpf_program *p;
+	int err;
+
+	p = bpf_object__find_program_by_name(ebpf.obj, prog);
+	if (!p)
+		return ENOENT;
+
+	memset(opts, 0, sizeof(*opts));
+	opts->sz       = sizeof(*opts);
+	opts->handle   = 1;
+	opts->priority = 1;
+	opts->prog_fd  = bpf_program__fd(p);
+
+	/* replaces the program of an instance that did not exit cleanly */
+	opts->flags    = BPF_TC_F_REPLACE;
+
+	ebpf.hook.attach_point = ap;
+
+	err = bpf_tc_attach(&ebpf.hook, opts);
+	if (err)
+		return -err;
+
+	return 0;
+}
+
+
+static void prog_detach(struct bpf_tc_opts *opts,
+			enum bpf_tc_attach_point ap)
+{
+	if (!opts->prog_id)
+		return;
+
+	opts->prog_fd = 0;
+	opts->prog_id = 0;
+	opts->flags   = 0;
+
+	ebpf.hook.attach_point = ap;
+
+	(void)bpf_tc_detach(&ebpf.hook, opts);
+}
+
+
+static void ebpf_close(void)
+{
+	list_flush(&ebpf.tablel);
+
+	prog_detach(&ebpf.ingress, BPF_TC_INGRESS);
+	prog_detach(&ebpf.egress, BPF_TC_EGRESS);
+
+	if (ebpf.hook_created) {
+		ebpf.hook.attach_point = BPF_TC_INGRESS | BPF_TC_EGRESS;
+		(void)bpf_tc_hook_destroy(&ebpf.hook);
+		ebpf.hook_created = false;
+	}
+
+	if (ebpf.obj) {
+		bpf_object__close(ebpf.obj);
+		ebpf.obj = NULL;
+	}
+
+	ebpf.fd_in  = -1;
+	ebpf.fd_out = -1;
+}
+
+
+static int module_init(void)
+{
+	char path[256];
+	const char *ifname;
+	struct pl pl;
+	int ifindex;
+	int err;
+
+	if (conf_get_str(_conf(), "ebpf_object", path, sizeof(path))) {
+
+		if (conf_get(_conf(), "module_path", &pl))
+			pl_set_str(&pl, ".");
+
+		re_snprintf(path, sizeof(path), "%r/ebpf_tc.o", &pl);
+	}
+
+	ifname = repcpd_extaddr_ifname_find(AF_INET);
+	if (!ifname) {
+		warning("ebpf: no IPv4 external interface\n");
+		return EAFNOSUPPORT;
+	}
+
+	if (repcpd_extaddr_ifname_find(AF_INET6))
+		warning("ebpf: IPv6 mappings are not supported\n");
+
+	ifindex = if_nametoindex(ifname);
+	if (!ifindex) {
+		err = errno;
+		warning("ebpf: %s: %m\n", ifname, err);
+		return err;
+	}
+
+	ebpf.obj = bpf_object__open_file(path, NULL);
+	if (!ebpf.obj) {
+		err = errno;
+		warning("ebpf: could not open `%s' (%m)\n", path, err);
+		return err;
+	}
+
+	err = bpf_object__load(ebpf.obj);
+	if (err) {
+		err = -err;
+		warning("ebpf: could not load `%s' (%m)\n", path, err);
+		goto out;
+	}
+
+	ebpf.fd_in  = bpf_object__find_map_fd_by_name(ebpf.obj, "nat_in");
+	ebpf.fd_out = bpf_object__find_map_fd_by_name(ebpf.obj, "nat_out");
+	if (ebpf.fd_in < 0 || ebpf.fd_out < 0) {
+		err = ENOENT;
+		goto out;
+	}
+
+	memset(&ebpf.hook, 0, sizeof(ebpf.hook));
+	ebpf.hook.sz           = sizeof(ebpf.hook);
+	ebpf.hook.ifindex      = ifindex;
+	ebpf.hook.attach_point = BPF_TC_INGRESS | BPF_TC_EGRESS;
+
+	/* the clsact qdisc might exist already */
+	err = bpf_tc_hook_create(&ebpf.hook);
+	if (err && err != -EEXIST) {
+		err = -err;
+		goto out;
+	}
+
+	ebpf.hook_created = !err;
+
+	err = prog_attach(&ebpf.ingress, BPF_TC_INGRESS, "repcpd_ingress");
+	if (err)
+		goto out;
+
+	err = prog_attach(&ebpf.egress, BPF_TC_EGRESS, "repcpd_egress");
+	if (err)
+		goto out;
+
+	backend_register(&be);
+
+	debug("ebpf: module loaded (%s, ifindex %d)\n", ifname, ifindex);
+
+ out:
+	if (err) {
+		warning("ebpf: could not attach to %s (%m)\n", ifname, err);
+		ebpf_close();
+	}
+
+	return err;
+}
+
+
+static int module_close(void)
+{
+	backend_unregister(&be);
+
+	ebpf_close();
+
+	debug("ebpf: module closed\n");
+
+	return 0;
+}
+
+
+const struct mod_export exports = {
+	.name  = "ebpf",
+	.type  = "pcp",
+	.init  = module_init,
+	.close = module_close,
+};
@@ -0,0 +1,37 @@
+/**
+ * @file ebpf.h  PCP mapping tables shared with the tc BPF program
+ *
+ * Copyright (C) 2010 - 2016 Creytiv.com
+ */
+
+#include <linux/types.h>
+
+
+enum {
+	EBPF_MAP_SIZE = 65536,
+};
+
+
+/*
+ * Both maps are keyed by the tuple of one side of a mapping, in network
+ * byte order. "nat_in" is keyed by the external address and port and is
+ * used on ingress, "nat_out" is keyed by the internal address and port
+ * and is used on egress. The remote address and port are only set for
+ * PEER mappings, MAP mappings match any remote endpoint. The addresses
+ * are IPv4 only.
+ */
+struct ebpf_key {
+	__u32 addr;
+	__u32 raddr;
+	__u16 port;
+	__u16 rport;
+	__u8  proto;
+	__u8  pad[3];
+};
+
+/* address and port that the packet is rewritten to */
+struct ebpf_nat {
+	__u32 addr;
+	__u16 port;
+	__u16 pad;
+};
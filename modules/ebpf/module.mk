@@ -0,0 +1,20 @@
+#
+# module.mk
+#
+# Copyright (C) 2010 Creytiv.com
+#
+
+MOD		:= ebpf
+$(MOD)_SRCS	+= ebpf.c
+$(MOD)_LFLAGS	+= -lbpf
+
+# the tc program is loaded at runtime from the module path
+MOD_DATA	+= ebpf_tc.o
+
+BPF_CC		?= clang
+
+ebpf_tc.o: modules/ebpf/tc.bpf.c modules/ebpf/ebpf.h modules/ebpf/module.mk
+	@echo "  BPF     $@"
+	@$(BPF_CC) -O2 -g -target bpf -Imodules/ebpf -c $< -o $@
+
+include mk/mod.mk
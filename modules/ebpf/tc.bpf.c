@@ -0,0 +1,163 @@
+/**
+ * @file tc.bpf.c  PCP address translation in a tc BPF program
+ *
+ * Copyright (C) 2010 - 2016 Creytiv.com
+ */
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <linux/bpf.h>
+#include <linux/pkt_cls.h>
+#include <linux/if_ether.h>
+#include <linux/in.h>
+#include <linux/ip.h>
+#include <linux/tcp.h>
+#include <linux/udp.h>
+#include <bpf/bpf_helpers.h>
+#include <bpf/bpf_endian.h>
+#include "ebpf.h"
+
+
+/*
+ * Stateless NAT for IPv4 on the external interface. On ingress the
+ * destination of a packet is looked up in "nat_in" and rewritten to the
+ * internal endpoint, on egress the source is looked up in "nat_out" and
+ * rewritten to the external endpoint. A PEER entry matching the remote
+ * endpoint takes precedence over a MAP entry.
+ *
+ * Packets with IP options, fragments and other protocols are passed on
+ * unchanged.
+ */
+
+
+struct {
+	__uint(type, BPF_MAP_TYPE_HASH);
+	__uint(max_entries, EBPF_MAP_SIZE);
+	__type(key, struct ebpf_key);
+	__type(value, struct ebpf_nat);
+} nat_in SEC(".maps");
+
+struct {
+	__uint(type, BPF_MAP_TYPE_HASH);
+	__uint(max_entries, EBPF_MAP_SIZE);
+	__type(key, struct ebpf_key);
+	__type(value, struct ebpf_nat);
+} nat_out SEC(".maps");
+
+
+#define IP_OFF   sizeof(struct ethhdr)
+#define L4_OFF   (IP_OFF + sizeof(struct iphdr))
+
+
+static __always_inline int nat(struct __sk_buff *skb, void *map,
+			       bool ingress)
+{
+	void *data = (void *)(long)skb->data;
+	void *end  = (void *)(long)skb->data_end;
+	struct ethhdr *eth = data;
+	struct ebpf_key key = {0};
+	struct ebpf_nat *nat;
+	struct iphdr *ip;
+	__u16 *ports;
+	__u32 csum_off, flags = 0;
+	__u32 addr_off, port_off;
+	__u32 old_addr;
+	__u16 old_port;
+
+	if ((void *)(eth + 1) > end || eth->h_proto != bpf_htons(ETH_P_IP))
+		return TC_ACT_OK;
+
+	ip = (void *)(eth + 1);
+	if ((void *)(ip + 1) > end || ip->ihl != 5)
+		return TC_ACT_OK;
+
+	if (ip->frag_off & bpf_htons(0x3fff))
+		return TC_ACT_OK;
+
+	/* source and destination port are first in both headers */
+	ports = (void *)(ip + 1);
+	if ((void *)(ports + 2) > end)
+		return TC_ACT_OK;
+
+	switch (ip->protocol) {
+
+	case IPPROTO_TCP:
+		csum_off = L4_OFF + offsetof(struct tcphdr, check);
+		break;
+
+	case IPPROTO_UDP:
+		csum_off = L4_OFF + offsetof(struct udphdr, check);
+		flags = BPF_F_MARK_MANGLED_0;
+		break;
+
+	default:
+		return TC_ACT_OK;
+	}
+
+	key.proto = ip->protocol;
+
+	if (ingress) {
+		key.addr  = ip->daddr;
+		key.port  = ports[1];
+		key.raddr = ip->saddr;
+		key.rport = ports[0];
+		addr_off  = IP_OFF + offsetof(struct iphdr, daddr);
+		port_off  = L4_OFF + sizeof(__u16);
+	}
+	else {
+		key.addr  = ip->saddr;
+		key.port  = ports[0];
+		key.raddr = ip->daddr;
+		key.rport = ports[1];
+		addr_off  = IP_OFF + offsetof(struct iphdr, saddr);
+		port_off  = L4_OFF;
+	}
+
+	nat = bpf_map_lookup_elem(map, &key);
+	if (!nat) {
+		key.raddr = 0;
+		key.rport = 0;
+		nat = bpf_map_lookup_elem(map, &key);
+	}
+	if (!nat)
+		return TC_ACT_OK;
+
+	old_addr = key.addr;
+	old_port = key.port;
+
+	if (old_addr != nat->addr) {
+		bpf_l4_csum_replace(skb, csum_off, old_addr, nat->addr,
+				    flags | BPF_F_PSEUDO_HDR | sizeof(__u32));
+		bpf_l3_csum_replace(skb,
+				    IP_OFF + offsetof(struct iphdr, check),
+				    old_addr, nat->addr, sizeof(__u32));
+		bpf_skb_store_bytes(skb, addr_off, &nat->addr,
+				    sizeof(__u32), 0);
+	}
+
+	if (old_port != nat->port) {
+		bpf_l4_csum_replace(skb, csum_off, old_port, nat->port,
+				    flags | sizeof(__u16));
+		bpf_skb_store_bytes(skb, port_off, &nat->port,
+				    sizeof(__u16), 0);
+	}
+
+	return TC_ACT_OK;
+}
+
+
+SEC("tc")
+int repcpd_ingress(struct __sk_buff *skb)
+{
+	return nat(skb, &nat_in, true);
+}
+
+
+SEC("tc")
+int repcpd_egress(struct __sk_buff *skb)
+{
+	return nat(skb, &nat_out, false);
+}
+
+
+char _license[] SEC("license") = "Dual BSD/GPL";
@@ -0,0 +1,118 @@
+#!/bin/sh
+#
+# test.sh  Run the ebpf module in a network namespace
+#
+# Copyright (C) 2010 - 2016 Creytiv.com
+#
+# Must be run as root from the top of the source tree after "make", with
+# ip(8) and python3 installed. The namespace "pcp" gets the external
+# interface ext1 (10.0.0.2), its veth peer ext0 (10.0.0.1) stays in the
+# current namespace, and a dummy interface int0 (192.168.0.1) plays the
+# PCP client. The test then
+#
+#   1. sends a PCP MAP request for UDP 192.168.0.1:5000,
+#   2. sends a datagram from 10.0.0.1 to the assigned external endpoint
+#      and checks that it arrives at the internal endpoint,
+#   3. answers it and checks that the answer comes from the external
+#      endpoint.
+#
+# REPCPD and MODULE_PATH select the binary and the modules.
+#
+
+set -e
+
+REPCPD=${REPCPD:-./repcpd}
+MODULE_PATH=${MODULE_PATH:-.}
+NS=pcp
+DIR=$(mktemp -d)
+
+cleanup() {
+	[ -f $DIR/pid ] && kill $(cat $DIR/pid) 2>/dev/null || true
+	ip netns del $NS 2>/dev/null || true
+	ip link del ext0 2>/dev/null || true
+	rm -rf $DIR
+}
+trap cleanup EXIT
+
+ip netns add $NS
+ip link add ext0 type veth peer name ext1 netns $NS
+ip addr add 10.0.0.1/24 dev ext0
+ip link set ext0 up
+
+ip -n $NS link set lo up
+ip -n $NS addr add 10.0.0.2/24 dev ext1
+ip -n $NS link set ext1 up
+ip -n $NS link add int0 type dummy
+ip -n $NS addr add 192.168.0.1/24 dev int0
+ip -n $NS link set int0 up
+
+cat > $DIR/repcpd.conf <<EOF
+daemon			no
+udp_listen		127.0.0.1:5351
+lifetime		120-3600
+external_interface	ext1
+module_path		$MODULE_PATH
+module			ebpf.so
+ebpf_object		$MODULE_PATH/ebpf_tc.o
+module			map.so
+EOF
+
+ip netns exec $NS $REPCPD -n -f $DIR/repcpd.conf > $DIR/log 2>&1 &
+echo $! > $DIR/pid
+sleep 1
+
+# 1. MAP request, prints the assigned external port
+port=$(ip netns exec $NS python3 - <<'EOF'
+import os, socket, struct, sys
+
+s = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+s.bind(("192.168.0.1", 0))
+s.settimeout(2)
+
+client = b"\0" * 10 + b"\xff\xff" + socket.inet_aton("192.168.0.1")
+req = struct.pack("!BBHI16s", 2, 1, 0, 600, client)
+req += os.urandom(12) + struct.pack("!B3xHH16s", 17, 5000, 0, b"\0" * 16)
+
+s.sendto(req, ("127.0.0.1", 5351))
+rsp = s.recv(1100)
+
+if len(rsp) < 60 or rsp[1] != 0x81 or rsp[3] != 0:
+	sys.exit("MAP failed: %s" % rsp[:4].hex())
+
+print(struct.unpack("!H", rsp[42:44])[0])
+EOF
+)
+echo "MAP 192.168.0.1:5000 <---> 10.0.0.2:$port"
+
+# 2. and 3. inbound datagram and its answer
+ip netns exec $NS python3 - <<'EOF' &
+import socket
+
+s = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+s.bind(("192.168.0.1", 5000))
+s.settimeout(4)
+
+data, src = s.recvfrom(64)
+s.sendto(data, src)
+EOF
+echo $! > $DIR/echo
+sleep 0.5
+
+python3 - "$port" <<'EOF'
+import socket, sys
+
+ext = ("10.0.0.2", int(sys.argv[1]))
+
+s = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+s.bind(("10.0.0.1", 0))
+s.settimeout(2)
+
+s.sendto(b"ping", ext)
+data, src = s.recvfrom(64)
+
+if data != b"ping" or src != ext:
+	sys.exit("unexpected answer from %s:%d" % src)
+EOF
+wait $(cat $DIR/echo)
+
+echo "ok"
@@ -8,6 +8,13 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <signal.h>
+#include <pthread.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/wait.h>
 #include <re.h>
 #include <repcpd.h>
 
@@ -17,9 +24,81 @@
  *       currently using the system() api. it would probably be better
  *       to use libnetfilter instead. we should use that API to lookup
  *       existing mappings...
+ *
+ *       Rules are applied by a long-lived "iptables-restore --noflush"
+ *       child, which is fed over a pipe. Rules added between begin and
+ *       commit go to the child as one transaction, a single rule outside
+ *       of a batch is a transaction of its own. After every transaction
+ *       a comment line is written, which the child echoes when the
+ *       commit has been applied. If a commit fails, iptables-restore
+ *       exits; the child is then started again for the next commit. A
+ *       child that does not answer within IPT_TIMEOUT is killed, so
+ *       that it can not stall the backend thread.
+ *
+ *       Existing rules are listed with "iptables -S" and parsed, this
+ *       only understands the rules that were created by this module.
+ *
+ *       With "iptables_chains N" the rules of a table are spread over N
+ *       sub-chains "<name>-<i>", so that a packet only traverses a part
+ *       of them. N is rounded down to a power of two. The sub-chains are
+ *       the leaves of a binary tree of goto rules: the parent chain is
+ *       the root, the other nodes are the chains "<name>-n<k>", numbered
+ *       like a heap. Every node halves the shards that are left, with at
+ *       most three rules, so a packet takes about 3 * log2(N) rules plus
+ *       those of one sub-chain. DNAT rules are sharded by external port
+ *       range, SNAT rules by the low bits of the internal address --
+ *       iptables can not match on a hash -- and like the rest of this
+ *       module, only IPv4 is supported. The tree is installed when the
+ *       first rule is added, and tells what kind of rules a table holds.
  */
 
 
+enum {
+	SHARDS_MAX  = 256,
+	IPT_TIMEOUT = 10000,      /* [ms] for one commit */
+};
+
+enum kind {
+	KIND_NONE = 0,
+	KIND_DNAT,
+	KIND_SNAT,
+};
+
+/* the jumps from a parent chain to its sub-chains */
+struct tree {
+	struct le le;
+	char *name;
+	enum kind kind;
+	bool pending;        /* jumps are in the open batch */
+};
+
+
+/* the iptables-restore child process */
+struct coproc {
+	pid_t pid;
+	int in;              /* stdin of the child, non-blocking */
+	int out;             /* stdout of the child */
+	char rbuf[512];      /* output of the child, not yet read */
+	size_t rlen;
+	uint32_t seq;        /* sequence number of the commit marker */
+};
+
+
+static struct {
+	struct coproc cp;
+	struct mbuf *batch;  /* iptables-restore input, during a batch */
+	uint32_t rulec;
+	struct list treel;
+	uint32_t shards;     /* number of sub-chains, 1 means none */
+} ipt = {
+	.cp = {
+		.in  = -1,
+		.out = -1,
+	},
+	.shards = 1,
+};
+
+
 static int print_comment(struct re_printf *pf, const char *comment)
 {
 	if (!comment)
@@ -44,14 +123,591 @@ static int iptables_cmd(const char *fmt, ...)
 }
 
 
+static void coproc_stop(struct coproc *cp)
+{
+	int status;
+
+	/* the child exits when it sees the end of its input */
+	if (cp->in >= 0)
+		(void)close(cp->in);
+	if (cp->out >= 0)
+		(void)close(cp->out);
+
+	cp->in   = -1;
+	cp->out  = -1;
+	cp->rlen = 0;
+
+	if (cp->pid > 0 && waitpid(cp->pid, &status, 0) == cp->pid) {
+
+		if (WIFSIGNALED(status)) {
+			warning("iptables: iptables-restore killed"
+				" by signal %d\n", WTERMSIG(status));
+		}
+		else if (WEXITSTATUS(status)) {
+			warning("iptables: iptables-restore exited"
+				" (status %d)\n", WEXITSTATUS(status));
+		}
+	}
+
+	cp->pid = 0;
+}
+
+
+static int coproc_start(struct coproc *cp)
+{
+	int in[2], out[2];
+	pid_t pid;
+	int err;
+
+	if (pipe(in))
+		return errno;
+
+	if (pipe(out)) {
+		err = errno;
+		(void)close(in[0]);
+		(void)close(in[1]);
+		return err;
+	}
+
+	/* keep the pipes away from other children, e.g. system() */
+	(void)fcntl(in[0],  F_SETFD, FD_CLOEXEC);
+	(void)fcntl(in[1],  F_SETFD, FD_CLOEXEC);
+	(void)fcntl(out[0], F_SETFD, FD_CLOEXEC);
+	(void)fcntl(out[1], F_SETFD, FD_CLOEXEC);
+
+	/* a full pipe must not block the writer past the deadline */
+	(void)fcntl(in[1], F_SETFL, O_NONBLOCK);
+
+	pid = fork();
+	if (pid < 0) {
+		err = errno;
+		(void)close(in[0]);
+		(void)close(in[1]);
+		(void)close(out[0]);
+		(void)close(out[1]);
+		return err;
+	}
+
+	if (pid == 0) {
+		(void)dup2(in[0], STDIN_FILENO);
+		(void)dup2(out[1], STDOUT_FILENO);
+
+		execlp("iptables-restore", "iptables-restore",
+		       "--noflush", "--verbose", (char *)NULL);
+		_exit(127);
+	}
+
+	(void)close(in[0]);
+	(void)close(out[1]);
+
+	cp->pid  = pid;
+	cp->in   = in[1];
+	cp->out  = out[0];
+	cp->rlen = 0;
+
+	debug("iptables: started iptables-restore (pid %d)\n", pid);
+
+	return 0;
+}
+
+
+/* a child that does not answer is killed, and started again */
+static void coproc_restart(struct coproc *cp)
+{
+	int err;
+
+	if (cp->pid > 0)
+		(void)kill(cp->pid, SIGKILL);
+
+	coproc_stop(cp);
+
+	err = coproc_start(cp);
+	if (err)
+		warning("iptables: could not run iptables-restore (%m)\n",
+			err);
+}
+
+
+/* wait until the file descriptor is ready, or the deadline [ms] */
+static int fd_wait(int fd, short events, uint64_t deadline)
+{
+	struct pollfd pfd;
+	uint64_t now;
+	int n;
+
+	for (;;) {
+
+		now = tmr_jiffies();
+		if (now >= deadline)
+			return ETIMEDOUT;
+
+		pfd.fd      = fd;
+		pfd.events  = events;
+		pfd.revents = 0;
+
+		n = poll(&pfd, 1, (int)min(deadline - now, INT32_MAX));
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return errno;
+		}
+
+		/* an error or a hangup shows with the read or the write */
+		if (n > 0)
+			return 0;
+	}
+}
+
+
+/*
+ * Write to the child, without a SIGPIPE when it has gone away. The
+ * signal is blocked in the calling thread only, and a SIGPIPE of the
+ * write is taken before it is unblocked again.
+ */
+static ssize_t write_nosig(int fd, const uint8_t *buf, size_t len)
+{
+	const struct timespec ts = {0, 0};
+	sigset_t set, old;
+	ssize_t n;
+	int err;
+
+	(void)sigemptyset(&set);
+	(void)sigaddset(&set, SIGPIPE);
+	(void)pthread_sigmask(SIG_BLOCK, &set, &old);
+
+	n = write(fd, buf, len);
+	err = errno;
+
+	if (n < 0 && err == EPIPE)
+		(void)sigtimedwait(&set, NULL, &ts);
+
+	(void)pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+	errno = err;
+
+	return n;
+}
+
+
+static int coproc_send(struct coproc *cp, const uint8_t *buf, size_t len,
+		       uint64_t deadline)
+{
+	while (len) {
+
+		ssize_t n;
+		int err;
+
+		err = fd_wait(cp->in, POLLOUT, deadline);
+		if (err)
+			return err;
+
+		n = write_nosig(cp->in, buf, len);
+		if (n < 0) {
+			if (errno == EINTR || errno == EAGAIN)
+				continue;
+			return errno;
+		}
+
+		buf += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+
+/* read one line of output, a long line is cut */
+static int coproc_readline(struct coproc *cp, char *line, size_t sz,
+			   uint64_t deadline)
+{
+	for (;;) {
+
+		char *nl = memchr(cp->rbuf, '\n', cp->rlen);
+		ssize_t n;
+		int err;
+
+		if (nl || cp->rlen == sizeof(cp->rbuf)) {
+
+			size_t len = nl ? (size_t)(nl - cp->rbuf) + 1
+				: cp->rlen;
+			size_t c = min(len, sz - 1);
+
+			memcpy(line, cp->rbuf, c);
+			line[c] = '\0';
+
+			cp->rlen -= len;
+			memmove(cp->rbuf, cp->rbuf + len, cp->rlen);
+
+			return 0;
+		}
+
+		err = fd_wait(cp->out, POLLIN, deadline);
+		if (err)
+			return err;
+
+		n = read(cp->out, cp->rbuf + cp->rlen,
+			 sizeof(cp->rbuf) - cp->rlen);
+		if (n < 0) {
+			if (errno == EINTR || errno == EAGAIN)
+				continue;
+			return errno;
+		}
+
+		/* the child has exited */
+		if (n == 0)
+			return EPIPE;
+
+		cp->rlen += n;
+	}
+}
+
+
+/*
+ * Write one transaction to the child and wait until it is applied.
+ * A child that has gone away while idle is restarted once.
+ */
+static int coproc_commit(struct coproc *cp, const struct mbuf *mb)
+{
+	char line[256], mark[32];
+	uint64_t deadline;
+	bool retry = true;
+	int err;
+
+ again:
+	if (!cp->pid) {
+		err = coproc_start(cp);
+		if (err) {
+			warning("iptables: could not run iptables-restore"
+				" (%m)\n", err);
+			return err;
+		}
+	}
+
+	deadline = tmr_jiffies() + IPT_TIMEOUT;
+
+	(void)re_snprintf(mark, sizeof(mark), "# repcpd %u\n", ++cp->seq);
+
+	err = coproc_send(cp, mb->buf, mb->end, deadline);
+	if (!err)
+		err = coproc_send(cp, (uint8_t *)mark, str_len(mark),
+				  deadline);
+	if (err == ETIMEDOUT)
+		goto timeout;
+	if (err) {
+		coproc_stop(cp);
+
+		if (retry) {
+			retry = false;
+			goto again;
+		}
+
+		return EPIPE;
+	}
+
+	while (!(err = coproc_readline(cp, line, sizeof(line), deadline))) {
+
+		if (0 == strcmp(line, mark))
+			return 0;
+
+		debug("iptables: iptables-restore: %s", line);
+	}
+
+	if (err == ETIMEDOUT)
+		goto timeout;
+
+	/* iptables-restore exits when a commit fails */
+	coproc_stop(cp);
+
+	return EPROTO;
+
+ timeout:
+	warning("iptables: iptables-restore did not answer within %u ms,"
+		" restarted\n", IPT_TIMEOUT);
+
+	coproc_restart(cp);
+
+	return ETIMEDOUT;
+}
+
+
+/* op is "-A" or "-D" */
+static int iptables_rule(const char *op, const char *name,
+			 const char *fmt, ...)
+{
+	char rule[512];
+	struct mbuf *mb;
+	va_list ap;
+	int err;
+
+	va_start(ap, fmt);
+	err = re_vsnprintf(rule, sizeof(rule), fmt, ap) < 0 ? ENOMEM : 0;
+	va_end(ap);
+
+	/* a partial line would fail the whole transaction */
+	if (err) {
+		warning("iptables: rule too long\n");
+		return err;
+	}
+
+	if (ipt.batch) {
+		++ipt.rulec;
+		return mbuf_printf(ipt.batch, "%s %s %s\n", op, name, rule);
+	}
+
+	mb = mbuf_alloc(1024);
+	if (!mb)
+		return ENOMEM;
+
+	debug("iptables: rule [%s %s %s]\n", op, name, rule);
+
+	err = mbuf_printf(mb, "*nat\n%s %s %s\nCOMMIT\n", op, name, rule);
+	if (!err)
+		err = coproc_commit(&ipt.cp, mb);
+
+	mem_deref(mb);
+
+	return err;
+}
+
+
+static void tree_destructor(void *arg)
+{
+	struct tree *tree = arg;
+
+	list_unlink(&tree->le);
+	mem_deref(tree->name);
+}
+
+
+static struct tree *tree_find(const char *name)
+{
+	struct le *le;
+
+	for (le = ipt.treel.head; le; le = le->next) {
+
+		struct tree *tree = le->data;
+
+		if (0 == str_cmp(tree->name, name))
+			return tree;
+	}
+
+	return NULL;
+}
+
+
+static int tree_get(struct tree **treep, const char *name)
+{
+	struct tree *tree;
+	int err;
+
+	tree = tree_find(name);
+	if (tree)
+		goto out;
+
+	tree = mem_zalloc(sizeof(*tree), tree_destructor);
+	if (!tree)
+		return ENOMEM;
+
+	err = str_dup(&tree->name, name);
+	if (err) {
+		mem_deref(tree);
+		return err;
+	}
+
+	list_append(&ipt.treel, &tree->le, tree);
+
+ out:
+	*treep = tree;
+
+	return 0;
+}
+
+
+/* number of tree levels below the root */
+static uint32_t tree_depth(void)
+{
+	uint32_t d = 0;
+
+	while ((1u << d) < ipt.shards)
+		++d;
+
+	return d;
+}
+
+
+/* lowest port of a DNAT shard */
+static uint32_t port_lo(uint32_t i)
+{
+	return i * 65536 / ipt.shards;
+}
+
+
+static uint32_t shard_dnat(uint16_t port)
+{
+	return (uint32_t)port * ipt.shards / 65536;
+}
+
+
+/* the tree tests the address bits from the lowest, in reverse order */
+static uint32_t shard_snat(const struct sa *int_addr)
+{
+	const uint32_t depth = tree_depth();
+	uint32_t addr = sa_in(int_addr), i, shard = 0;
+
+	for (i = 0; i < depth; i++)
+		shard |= ((addr >> i) & 1) << (depth - 1 - i);
+
+	return shard;
+}
+
+
+static void chain_name(char *buf, size_t sz, const char *name,
+		       uint32_t shard)
+{
+	if (ipt.shards > 1)
+		re_snprintf(buf, sz, "%s-%u", name, shard);
+	else
+		str_ncpy(buf, name, sz);
+}
+
+
+/* the chain of tree node "k": the root, a node or a sub-chain */
+static void node_name(char *buf, size_t sz, const char *name, uint32_t k)
+{
+	if (k == 1)
+		str_ncpy(buf, name, sz);
+	else if (k >= ipt.shards)
+		chain_name(buf, sz, name, k - ipt.shards);
+	else
+		re_snprintf(buf, sz, "%s-n%u", name, k);
+}
+
+
+/* the rules of node "k" at "depth", which go to its two children */
+static int tree_node(const char *op, const char *name, enum kind kind,
+		     uint32_t k, uint32_t depth)
+{
+	const uint32_t levels = tree_depth() - depth;
+	char chain[64], left[64], right[64];
+	int err;
+
+	node_name(chain, sizeof(chain), name, k);
+	node_name(left,  sizeof(left),  name, 2 * k);
+	node_name(right, sizeof(right), name, 2 * k + 1);
+
+	if (kind == KIND_DNAT) {
+		/* the left half of the shards below the node */
+		uint32_t a  = (k << levels) - ipt.shards;
+		uint32_t lo = port_lo(a);
+		uint32_t hi = port_lo(a + (1u << (levels - 1))) - 1;
+
+		err  = iptables_rule(op, chain, "-p tcp -m tcp"
+				     " --dport %u:%u -g %s", lo, hi, left);
+		err |= iptables_rule(op, chain, "-p udp -m udp"
+				     " --dport %u:%u -g %s", lo, hi, left);
+		err |= iptables_rule(op, chain, "-g %s", right);
+	}
+	else {
+		uint32_t bit = 1u << depth;
+
+		err  = iptables_rule(op, chain, "-s 0.0.0.%u/0.0.0.%u"
+				     " -g %s", bit, bit, right);
+		err |= iptables_rule(op, chain, "-g %s", left);
+	}
+
+	return err;
+}
+
+
+static int tree_jumps(const char *op, const char *name, enum kind kind)
+{
+	uint32_t k, depth = 0;
+	int err = 0;
+
+	for (k = 1; k < ipt.shards && !err; k++) {
+
+		if (k == 2u << depth)
+			++depth;
+
+		err = tree_node(op, name, kind, k, depth);
+	}
+
+	return err;
+}
+
+
+/* install the jumps of a table, when the first rule is added */
+static int tree_prepare(const char *name, enum kind kind)
+{
+	struct tree *tree;
+	int err;
+
+	if (ipt.shards <= 1)
+		return 0;
+
+	err = tree_get(&tree, name);
+	if (err)
+		return err;
+
+	if (tree->kind == kind)
+		return 0;
+
+	if (tree->kind != KIND_NONE) {
+		warning("iptables: `%s' cannot hold both DNAT and SNAT\n",
+			name);
+		return EPROTO;
+	}
+
+	err = tree_jumps("-A", name, kind);
+	if (err)
+		return err;
+
+	tree->kind    = kind;
+	tree->pending = ipt.batch != NULL;
+
+	return 0;
+}
+
+
+/* jumps of a failed batch were not installed */
+static void tree_commit(const char *name, int err)
+{
+	struct tree *tree = tree_find(name);
+
+	if (!tree || !tree->pending)
+		return;
+
+	if (err)
+		tree->kind = KIND_NONE;
+
+	tree->pending = false;
+}
+
+
 static int backend_new(const char *name)
 {
+	uint32_t i;
 	int err;
 
 	err = iptables_cmd("iptables -t nat -N %s", name);
 	if (err)
 		return err;
 
+	for (i = 0; ipt.shards > 1 && i < ipt.shards; i++) {
+
+		err = iptables_cmd("iptables -t nat -N %s-%u", name, i);
+		if (err)
+			return err;
+	}
+
+	/* the nodes of the tree, the parent chain is the root */
+	for (i = 2; i < ipt.shards; i++) {
+
+		err = iptables_cmd("iptables -t nat -N %s-n%u", name, i);
+		if (err)
+			return err;
+	}
+
 #if 0
 	/* todo: needed for openwrt ? */
 	/* jump from the INPUT chain to our new custom chain */
@@ -62,11 +718,83 @@ static int backend_new(const char *name)
 }
 
 
+/*
+ * Is "chain" the parent chain (0), a sub-chain (1), a node of the tree
+ * (2) or another chain (-1)
+ */
+static int chain_parse(const char *name, const char *chain, uint32_t *shard)
+{
+	size_t len = str_len(name);
+	const char *p, *num;
+
+	if (strncmp(chain, name, len))
+		return -1;
+
+	if (!chain[len])
+		return 0;
+
+	if (chain[len] != '-')
+		return -1;
+
+	num = chain + len + 1;
+	if (*num == 'n')
+		++num;
+
+	if (!*num)
+		return -1;
+
+	for (p = num; *p; p++) {
+		if (*p < '0' || *p > '9')
+			return -1;
+	}
+
+	*shard = atoi(num);
+
+	return num == chain + len + 1 ? 1 : 2;
+}
+
+
 static void backend_flush(const char *name)
 {
+	static const char *opv[] = {"-F", "-X"};
+	char line[256];
+	struct tree *tree;
+	uint32_t shard;
+	size_t i;
+	FILE *f;
+
 	info("flush\n");
+
+	/* the parent first, that removes the jumps */
 	iptables_cmd("iptables -t nat -F %s 2>/dev/null", name);
 	iptables_cmd("iptables -t nat -X %s 2>/dev/null", name);
+
+	/*
+	 * All sub-chains and nodes, also those of another
+	 * "iptables_chains". The nodes refer to each other, so all of them
+	 * are flushed before the first one is deleted.
+	 */
+	for (i = 0; i < ARRAY_SIZE(opv); i++) {
+
+		f = popen("iptables -t nat -S 2>/dev/null", "r");
+		while (f && fgets(line, sizeof(line), f)) {
+
+			line[strcspn(line, "\n")] = '\0';
+
+			if (strncmp(line, "-N ", 3) ||
+			    chain_parse(name, line + 3, &shard) < 1)
+				continue;
+
+			iptables_cmd("iptables -t nat %s %s 2>/dev/null",
+				     opv[i], line + 3);
+		}
+
+		if (f)
+			(void)pclose(f);
+	}
+
+	tree = tree_find(name);
+	mem_deref(tree);
 }
 
 
@@ -75,13 +803,21 @@ static int backend_append(const char *name, int proto,
 			  const struct sa *int_addr,
 			  const char *descr)
 {
+	char chain[64];
+	int err;
+
+	err = tree_prepare(name, KIND_DNAT);
+	if (err)
+		return err;
+
+	chain_name(chain, sizeof(chain), name, shard_dnat(sa_port(ext_addr)));
 
-	return iptables_cmd("iptables -t nat -A %s -p %s -i %s --dport %u"
-			    " -j DNAT --to %J"
-			    "%H",
-			    name, pcp_proto_name(proto), ext_ifname,
-			    sa_port(ext_addr), int_addr,
-			    print_comment, descr);
+	return iptables_rule("-A", chain, "-p %s -i %s --dport %u"
+			     " -j DNAT --to %J"
+			     "%H",
+			     pcp_proto_name(proto), ext_ifname,
+			     sa_port(ext_addr), int_addr,
+			     print_comment, descr);
 }
 
 
@@ -90,12 +826,16 @@ static void backend_delete(const char *name, int proto,
 			   const struct sa *int_addr,
 			   const char *descr)
 {
-	iptables_cmd("iptables -t nat -D %s -p %s -i %s --dport %u"
-		     " -j DNAT --to %J"
-		     "%H",
-		     name, pcp_proto_name(proto), ext_ifname,
-		     sa_port(ext_addr), int_addr,
-		     print_comment, descr);
+	char chain[64];
+
+	chain_name(chain, sizeof(chain), name, shard_dnat(sa_port(ext_addr)));
+
+	iptables_rule("-D", chain, "-p %s -i %s --dport %u"
+		      " -j DNAT --to %J"
+		      "%H",
+		      pcp_proto_name(proto), ext_ifname,
+		      sa_port(ext_addr), int_addr,
+		      print_comment, descr);
 }
 
 
@@ -106,18 +846,27 @@ static int backend_append_snat(const char *name, int proto,
 			       const struct sa *remote_addr,
 			       const char *descr)
 {
+	char chain[64];
+	int err;
+
+	err = tree_prepare(name, KIND_SNAT);
+	if (err)
+		return err;
+
+	chain_name(chain, sizeof(chain), name, shard_snat(int_addr));
+
 	/* --to is what it should be re-written _TO_ */
 
-	return iptables_cmd("iptables -t nat -A %s -p %s -i %s"
-			    " --source %j --sport %u"
-			    " --dst %j --dport %u"
-			    " -j SNAT --to %J"
-			    "%H",
-			    name, pcp_proto_name(proto), ext_ifname,
-			    int_addr, sa_port(int_addr),
-			    remote_addr, sa_port(remote_addr),
-			    ext_addr,
-			    print_comment, descr);
+	return iptables_rule("-A", chain, "-p %s -i %s"
+			     " --source %j --sport %u"
+			     " --dst %j --dport %u"
+			     " -j SNAT --to %J"
+			     "%H",
+			     pcp_proto_name(proto), ext_ifname,
+			     int_addr, sa_port(int_addr),
+			     remote_addr, sa_port(remote_addr),
+			     ext_addr,
+			     print_comment, descr);
 }
 
 
@@ -128,16 +877,417 @@ static void backend_delete_snat(const char *name, int proto,
 				const struct sa *peer_addr,
 				const char *descr)
 {
-	iptables_cmd("iptables -t nat -D %s -p %s -i %s"
-		     " --source %j --sport %u"
-		     " --dst %j --dport %u"
-		     " -j SNAT --to %J"
-		     "%H",
-		     name, pcp_proto_name(proto), ext_ifname,
-		     int_addr, sa_port(int_addr),
-		     peer_addr, sa_port(peer_addr),
-		     ext_addr,
-		     print_comment, descr);
+	char chain[64];
+
+	chain_name(chain, sizeof(chain), name, shard_snat(int_addr));
+
+	iptables_rule("-D", chain, "-p %s -i %s"
+		      " --source %j --sport %u"
+		      " --dst %j --dport %u"
+		      " -j SNAT --to %J"
+		      "%H",
+		      pcp_proto_name(proto), ext_ifname,
+		      int_addr, sa_port(int_addr),
+		      peer_addr, sa_port(peer_addr),
+		      ext_addr,
+		      print_comment, descr);
+}
+
+
+static int backend_begin(const char *name)
+{
+	(void)name;
+
+	if (ipt.batch)
+		return EALREADY;
+
+	ipt.batch = mbuf_alloc(4096);
+	if (!ipt.batch)
+		return ENOMEM;
+
+	ipt.rulec = 0;
+
+	return mbuf_write_str(ipt.batch, "*nat\n");
+}
+
+
+static int backend_commit(const char *name)
+{
+	struct mbuf *mb = ipt.batch;
+	int err = 0;
+
+	if (!mb)
+		return EINVAL;
+
+	ipt.batch = NULL;
+
+	if (!ipt.rulec)
+		goto out;
+
+	err = mbuf_write_str(mb, "COMMIT\n");
+	if (err)
+		goto out;
+
+	debug("iptables: restore %u rules in `%s'\n", ipt.rulec, name);
+
+	err = coproc_commit(&ipt.cp, mb);
+	if (err) {
+		warning("iptables: commit of `%s' failed (%m)\n",
+			name, err);
+	}
+
+ out:
+	tree_commit(name, err);
+	mem_deref(mb);
+
+	return err;
+}
+
+
+/* split off the next word, honouring quotes and backslash escapes */
+static char *token(char **p)
+{
+	char *s = *p, *tok, *d;
+	bool quoted = false;
+
+	while (*s == ' ')
+		++s;
+
+	if (!*s)
+		return NULL;
+
+	tok = d = s;
+
+	for (; *s; ++s) {
+
+		if (*s == '\\' && s[1]) {
+			*d++ = *++s;
+			continue;
+		}
+
+		if (*s == '"') {
+			quoted = !quoted;
+			continue;
+		}
+
+		if (*s == ' ' && !quoted) {
+			++s;
+			break;
+		}
+
+		*d++ = *s;
+	}
+
+	*d = '\0';
+	*p = s;
+
+	return tok;
+}
+
+
+struct ipt_rule {
+	enum pcp_opcode opcode;
+	int proto;
+	struct sa ext_addr;
+	struct sa int_addr;
+	struct sa remote_addr;
+	const char *ifname;
+	const char *comment;
+};
+
+
+static int addr_decode(struct sa *sa, char *str, uint16_t port)
+{
+	char *mask = strchr(str, '/');
+
+	if (mask) {
+		if (str_cmp(mask, "/32"))
+			return EINVAL;
+
+		*mask = '\0';
+	}
+
+	return sa_set_str(sa, str, port);
+}
+
+
+/* decode one "-A" line, as printed by "iptables -S" */
+static bool rule_decode(struct ipt_rule *r, char *p)
+{
+	char *src = NULL, *dst = NULL, *to = NULL, *target = NULL;
+	uint32_t sport = 0, dport = 0;
+	char *opt, *val;
+
+	memset(r, 0, sizeof(*r));
+
+	while ((opt = token(&p))) {
+
+		val = token(&p);
+		if (!val)
+			return false;
+
+		if (!str_cmp(opt, "-A") || !str_cmp(opt, "-m"))
+			continue;
+		else if (!str_cmp(opt, "-s"))
+			src = val;
+		else if (!str_cmp(opt, "-d"))
+			dst = val;
+		else if (!str_cmp(opt, "-i"))
+			r->ifname = val;
+		else if (!str_cmp(opt, "--sport"))
+			sport = atoi(val);
+		else if (!str_cmp(opt, "--dport"))
+			dport = atoi(val);
+		else if (!str_cmp(opt, "--comment"))
+			r->comment = val;
+		else if (!str_cmp(opt, "-j"))
+			target = val;
+		else if (!str_cmp(opt, "--to-destination") ||
+			 !str_cmp(opt, "--to-source"))
+			to = val;
+		else if (!str_cmp(opt, "-p")) {
+			if (!str_cmp(val, "tcp"))
+				r->proto = IPPROTO_TCP;
+			else if (!str_cmp(val, "udp"))
+				r->proto = IPPROTO_UDP;
+			else
+				return false;
+		}
+		else
+			return false;
+	}
+
+	if (!r->proto || !r->ifname || !target || !to ||
+	    sport > 65535 || dport > 65535)
+		return false;
+
+	if (!str_cmp(target, "DNAT")) {
+
+		if (src || dst || !dport)
+			return false;
+
+		r->opcode = PCP_MAP;
+		sa_init(&r->ext_addr, AF_INET);
+		sa_set_port(&r->ext_addr, dport);
+
+		return 0 == sa_decode(&r->int_addr, to, strlen(to));
+	}
+	else if (!str_cmp(target, "SNAT")) {
+
+		if (!src || !dst || !sport || !dport)
+			return false;
+
+		r->opcode = PCP_PEER;
+
+		return 0 == addr_decode(&r->int_addr, src, sport) &&
+			0 == addr_decode(&r->remote_addr, dst, dport) &&
+			0 == sa_decode(&r->ext_addr, to, strlen(to));
+	}
+
+	return false;
+}
+
+
+static enum kind opcode_kind(enum pcp_opcode opcode)
+{
+	return opcode == PCP_MAP ? KIND_DNAT : KIND_SNAT;
+}
+
+
+/* does a rule of the parent chain go to a sub-chain or a node */
+static bool jump_parse(const char *name, const char *line)
+{
+	static const char *targetv[] = {" -j ", " -g "};
+	const char *p;
+	char chain[64];
+	uint32_t shard;
+	size_t i;
+
+	for (i = 0; i < ARRAY_SIZE(targetv); i++) {
+
+		p = strstr(line, targetv[i]);
+		if (!p)
+			continue;
+
+		str_ncpy(chain, p + 4, sizeof(chain));
+		chain[strcspn(chain, " ")] = '\0';
+
+		if (chain_parse(name, chain, &shard) > 0)
+			return true;
+	}
+
+	return false;
+}
+
+
+/* the chain where rule_decode() result "r" belongs */
+static void rule_chain(char *buf, size_t sz, const char *name,
+		       const struct ipt_rule *r)
+{
+	if (r->opcode == PCP_MAP)
+		chain_name(buf, sz, name, shard_dnat(sa_port(&r->ext_addr)));
+	else
+		chain_name(buf, sz, name, shard_snat(&r->int_addr));
+}
+
+
+static int backend_dump(const char *name, backend_rule_h *rh, void *arg)
+{
+	char line[1024], buf[1024], chain[64], want[64];
+	bool have[SHARDS_MAX], have_node[SHARDS_MAX];
+	enum kind kept = KIND_NONE;
+	struct mbuf *dels;
+	struct tree *tree;
+	bool found = false;
+	uint32_t i, shard, ndel = 0;
+	FILE *f;
+	int err = 0;
+
+	if (!rh)
+		return EINVAL;
+
+	dels = mbuf_alloc(4096);
+	if (!dels)
+		return ENOMEM;
+
+	memset(have, 0, sizeof(have));
+	memset(have_node, 0, sizeof(have_node));
+
+	debug("iptables: listing rules of `%s'\n", name);
+
+	f = popen("iptables -t nat -S 2>/dev/null", "r");
+	if (!f) {
+		err = errno;
+		goto out;
+	}
+
+	while (fgets(line, sizeof(line), f)) {
+
+		struct ipt_rule r;
+		int type;
+
+		line[strcspn(line, "\n")] = '\0';
+
+		if (0 == strncmp(line, "-N ", 3)) {
+
+			type = chain_parse(name, line + 3, &shard);
+			if (type == 0)
+				found = true;
+			else if (type == 1 && shard < SHARDS_MAX)
+				have[shard] = true;
+			else if (type == 2 && shard < SHARDS_MAX)
+				have_node[shard] = true;
+
+			continue;
+		}
+
+		if (strncmp(line, "-A ", 3))
+			continue;
+
+		str_ncpy(chain, line + 3, sizeof(chain));
+		chain[strcspn(chain, " ")] = '\0';
+
+		type = chain_parse(name, chain, &shard);
+		if (type < 0)
+			continue;
+
+		/* the tree is installed again below */
+		if (type == 2 || (type == 0 && jump_parse(name, line)))
+			goto del;
+
+		str_ncpy(buf, line, sizeof(buf));
+
+		if (!rule_decode(&r, buf))
+			goto del;
+
+		/* a rule in the wrong chain could never be deleted */
+		rule_chain(want, sizeof(want), name, &r);
+		if (str_cmp(chain, want))
+			goto del;
+
+		if (kept != KIND_NONE && kept != opcode_kind(r.opcode))
+			goto del;
+
+		if (!rh(r.opcode, r.proto, &r.ext_addr, r.ifname,
+			&r.int_addr, &r.remote_addr, r.comment, arg))
+			goto del;
+
+		kept = opcode_kind(r.opcode);
+		continue;
+
+	del:
+		debug("iptables: deleting rule [%s]\n", line);
+
+		++ndel;
+		err = mbuf_printf(dels, "-D%s\n", line + 2);
+		if (err)
+			break;
+	}
+
+	(void)pclose(f);
+
+	if (err)
+		goto out;
+
+	if (!found) {
+		err = ENOENT;
+		goto out;
+	}
+
+	/* rules that are not kept are deleted in one batch */
+	err = backend_begin(name);
+	if (err)
+		goto out;
+
+	for (i = 0; ipt.shards > 1 && i < ipt.shards; i++) {
+
+		if (have[i])
+			continue;
+
+		++ipt.rulec;
+		err |= mbuf_printf(ipt.batch, "-N %s-%u\n", name, i);
+	}
+
+	for (i = 2; i < ipt.shards; i++) {
+
+		if (have_node[i])
+			continue;
+
+		++ipt.rulec;
+		err |= mbuf_printf(ipt.batch, "-N %s-n%u\n", name, i);
+	}
+
+	if (ndel) {
+		ipt.rulec += ndel;
+		err |= mbuf_write_mem(ipt.batch, dels->buf, dels->end);
+	}
+
+	if (err) {
+		ipt.batch = mem_deref(ipt.batch);
+		goto out;
+	}
+
+	if (kept != KIND_NONE)
+		err = tree_prepare(name, kept);
+
+	if (err) {
+		ipt.batch = mem_deref(ipt.batch);
+		tree_commit(name, err);
+		goto out;
+	}
+
+	err = backend_commit(name);
+
+ out:
+	mem_deref(dels);
+
+	/* a failed dump leaves no tree behind */
+	if (err) {
+		tree = tree_find(name);
+		mem_deref(tree);
+	}
+
+	return err;
 }
 
 
@@ -148,11 +1298,23 @@ static struct backend be = {
 	.delete = backend_delete,
 	.append_snat = backend_append_snat,
 	.delete_snat = backend_delete_snat,
+	.begin  = backend_begin,
+	.commit = backend_commit,
+	.dump   = backend_dump,
 };
 
 
 static int module_init(void)
 {
+	uint32_t n = 1;
+
+	(void)conf_get_u32(_conf(), "iptables_chains", &n);
+	n = min(max(n, 1), SHARDS_MAX);
+
+	/* the leaves of a binary tree */
+	while (ipt.shards * 2 <= n)
+		ipt.shards *= 2;
+
 	backend_register(&be);
 
 	debug("iptables: module loaded\n");
@@ -165,6 +1327,10 @@ static int module_close(void)
 {
 	backend_unregister(&be);
 
+	ipt.batch = mem_deref(ipt.batch);
+	list_flush(&ipt.treel);
+	coproc_stop(&ipt.cp);
+
 	debug("iptables: module closed\n");
 
 	return 0;
@@ -40,35 +40,47 @@ static bool request_handler(struct udp_sock *us, const struct sa *src,
 	mapping = mapping_find(table, map->proto, &msg->hdr.cli_addr);
 	if (mapping) {
 		/* Simple Threat Model, verify nonce */
-		if (!pcp_nonce_cmp(msg, mapping->map.nonce)) {
+		if (!pcp_nonce_cmp(msg, mapping->nonce)) {
 			warning("map: request NONCE does not match"
 				" existing mapping\n");
 			result = PCP_NOT_AUTHORIZED;
 			goto error;
 		}
 
-		map->ext_addr = mapping->map.ext_addr;
+		maddr_get(&mapping->ext_addr, &map->ext_addr);
 		mapping_refresh(mapping, msg->hdr.lifetime);
 	}
 	else {
-		if (!repcpd_extaddr_exist(&map->ext_addr)) {
+		const bool prefer = repcpd_msg_option(msg,
+					      PCP_OPTION_PREFER_FAILURE);
+		const struct sa suggested = map->ext_addr;
+		uint16_t port = map->int_port;
+
+		if (repcpd_extaddr_exist(&suggested)) {
+			if (sa_port(&suggested))
+				port = sa_port(&suggested);
+		}
+		else if (prefer) {
+			result = PCP_CANNOT_PROVIDE_EXTERNAL;
+			goto error;
+		}
 
-			if (pcp_msg_option(msg, PCP_OPTION_PREFER_FAILURE)) {
+		err = repcpd_extaddr_assign(&map->ext_addr, map->proto, port,
+					    &msg->hdr.cli_addr, sa_af(src));
+		if (err) {
+			warning("map: failed to assign"
+				" a valid extaddr (%m)\n", err);
 
-				result = PCP_CANNOT_PROVIDE_EXTERNAL;
-				goto error;
-			}
+			result = PCP_CANNOT_PROVIDE_EXTERNAL;
+			goto error;
+		}
 
-			err = repcpd_extaddr_assign(&map->ext_addr,
-						    map->int_port,
-						    sa_af(src));
-			if (err) {
-				warning("map: failed to assign"
-					" a valid extaddr\n");
+		/* the suggested port is taken */
+		if (prefer && sa_port(&suggested) &&
+		    sa_port(&map->ext_addr) != sa_port(&suggested)) {
 
-				result = PCP_CANNOT_PROVIDE_EXTERNAL;
-				goto error;
-			}
+			result = PCP_CANNOT_PROVIDE_EXTERNAL;
+			goto error;
 		}
 	}
 
@@ -85,7 +97,7 @@ static bool request_handler(struct udp_sock *us, const struct sa *src,
 				warning("map: external interface not found\n");
 			}
 
-			opt = pcp_msg_option(msg, PCP_OPTION_DESCRIPTION);
+			opt = repcpd_msg_option(msg, PCP_OPTION_DESCRIPTION);
 
 			err = mapping_create(&mapping, table, PCP_MAP,
 					     map->proto,
@@ -96,18 +108,25 @@ static bool request_handler(struct udp_sock *us, const struct sa *src,
 					     opt ? opt->u.description : NULL);
 			if (err) {
 				warning("mapping_create: %m\n", err);
+				if (err == EDQUOT)
+					result = PCP_USER_EX_QUOTA;
 				goto error;
 			}
 		}
 	}
 	else {
-		mapping = mem_deref(mapping);
+		mapping_delete(mapping);
+		mapping = NULL;
 	}
 
-	/* reply SUCCESS */
-	err = pcp_reply(us, src, mb, msg->hdr.opcode, PCP_SUCCESS,
-			msg->hdr.lifetime, repcpd_epoch_time(),
-			mapping ? &mapping->map : map);
+	/* reply SUCCESS, when the mapping is committed */
+	if (mapping) {
+		err = mapping_reply(mapping, us, src, mb, msg->hdr.lifetime);
+	}
+	else {
+		err = pcp_reply(us, src, mb, msg->hdr.opcode, PCP_SUCCESS,
+				msg->hdr.lifetime, repcpd_epoch_time(), map);
+	}
 	if (err) {
 		warning("map: pcp_reply_map() failed (%m)\n", err);
 		goto error;
@@ -123,8 +142,24 @@ static bool request_handler(struct udp_sock *us, const struct sa *src,
 }
 
 
+static bool exist_handler(const struct pcp_msg *msg)
+{
+	const struct pcp_map *map = &msg->pld.map;
+	struct sa int_addr;
+
+	if (msg->hdr.opcode != PCP_MAP)
+		return false;
+
+	int_addr = msg->hdr.cli_addr;
+	sa_set_port(&int_addr, map->int_port);
+
+	return mapping_find(table, map->proto, &int_addr) != NULL;
+}
+
+
 static struct repcpd_pcp map = {
-	.reqh = request_handler,
+	.reqh   = request_handler,
+	.existh = exist_handler,
 };
 
 
@@ -0,0 +1,11 @@
+#
+# module.mk
+#
+# Copyright (C) 2010 Creytiv.com
+#
+
+MOD		:= nftables
+$(MOD)_SRCS	+= nftables.c
+$(MOD)_LFLAGS	+= -lnftnl -lmnl
+
+include mk/mod.mk
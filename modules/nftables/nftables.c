@@ -0,0 +1,2135 @@
+/**
+ * @file nftables.c  PCP netfilter manipulation using nf_tables netlink
+ *
+ * Copyright (C) 2010 - 2016 Creytiv.com
+ */
+
+#define _DEFAULT_SOURCE 1
+#include <string.h>
+#include <time.h>
+#include <sys/time.h>
+#include <net/if.h>
+#include <arpa/inet.h>
+#include <linux/netfilter.h>
+#include <linux/netfilter/nfnetlink.h>
+#include <linux/netfilter/nf_tables.h>
+#include <libmnl/libmnl.h>
+#include <libnftnl/table.h>
+#include <libnftnl/chain.h>
+#include <libnftnl/rule.h>
+#include <libnftnl/set.h>
+#include <libnftnl/expr.h>
+#include <libnftnl/udata.h>
+#include <re.h>
+#include <repcpd.h>
+
+
+/*
+ * NOTE: every backend table is an nf_tables table of family "inet" with
+ *       the same name, holding two NAT base chains. DNAT rules (MAP) are
+ *       appended to "prerouting" and SNAT rules (PEER) to "postrouting".
+ *
+ *       All changes are sent as nfnetlink batches on one netlink socket,
+ *       and we wait for the kernel ACK of every message. Rules are
+ *       deleted by their kernel handle, which we learn from the echo
+ *       of the NEWRULE message, or from the rule dump at startup.
+ *
+ *       With "nftables_maps yes" every chain instead holds one rule per
+ *       address family, that looks up the packet in a map:
+ *
+ *         prerouting:  iifname . l4proto . dport  :  daddr . dport
+ *         postrouting: oifname . l4proto . saddr . sport . daddr . dport
+ *                                                 :  saddr . sport
+ *
+ *       and a mapping is an element of that map. The per-packet cost is
+ *       then independent of the number of mappings.
+ */
+
+
+enum {
+	NFT_PRIO_DSTNAT = -100,
+	NFT_PRIO_SRCNAT =  100,
+	NFT_MSG_MAXSZ   = 2048,
+	NFT_RCV_TIMEOUT = 1,      /* seconds */
+	NFT_KEY_MAXLEN  = 64,     /* NFT_DATA_VALUE_MAXLEN */
+};
+
+/* nft userspace datatypes, only used for listing the maps */
+enum {
+	TYPE_BITS          = 6,
+	TYPE_IPADDR        = 7,
+	TYPE_IP6ADDR       = 8,
+	TYPE_INET_PROTOCOL = 12,
+	TYPE_INET_SERVICE  = 13,
+	TYPE_IFNAME        = 41,
+};
+
+static const char *chain_dnat = "prerouting";
+static const char *chain_snat = "postrouting";
+
+
+struct rule {
+	struct le le;
+	struct le tle;            /* in a transaction */
+	char *table;
+	enum pcp_opcode opcode;
+	int proto;
+	struct sa ext_addr;
+	struct sa int_addr;
+	struct sa rem_addr;       /* PEER only */
+	char ifname[IFNAMSIZ];    /* map key */
+	uint64_t handle;
+	uint32_t seq;
+};
+
+struct txn {
+	struct mbuf *mb;
+	struct list addl;         /* rules being added */
+	struct list dell;         /* rules being deleted */
+	uint32_t seq_first;
+	uint32_t acks;            /* outstanding ACKs */
+};
+
+
+static struct {
+	struct mnl_socket *nl;
+	uint32_t portid;
+	uint32_t seq;
+	struct hash *rules;
+	struct txn txn;           /* open batch, if any */
+	bool batch;
+	bool maps;                /* mappings are map elements */
+} nft;
+
+
+static void rule_destructor(void *arg)
+{
+	struct rule *rule = arg;
+
+	hash_unlink(&rule->le);
+	list_unlink(&rule->tle);
+	mem_deref(rule->table);
+}
+
+
+static uint32_t rule_key(const char *table, int proto,
+			 const struct sa *int_addr,
+			 const struct sa *rem_addr)
+{
+	uint32_t v;
+
+	v = hash_joaat_str(table) + proto + sa_hash(int_addr, SA_ALL);
+
+	if (rem_addr && sa_isset(rem_addr, SA_ALL))
+		v += sa_hash(rem_addr, SA_ALL);
+
+	return v;
+}
+
+
+struct rule_match {
+	const char *table;
+	enum pcp_opcode opcode;
+	int proto;
+	const struct sa *ext_addr;
+	const struct sa *int_addr;
+	const struct sa *rem_addr;
+};
+
+
+static bool rule_cmp_handler(struct le *le, void *arg)
+{
+	const struct rule *rule = le->data;
+	const struct rule_match *m = arg;
+
+	if (rule->opcode != m->opcode || rule->proto != m->proto)
+		return false;
+
+	if (0 != str_cmp(rule->table, m->table))
+		return false;
+
+	/* a DNAT rule only matches the external port */
+	if (!sa_cmp(&rule->ext_addr, m->ext_addr,
+		    rule->opcode == PCP_MAP ? SA_PORT : SA_ALL) ||
+	    !sa_cmp(&rule->int_addr, m->int_addr, SA_ALL))
+		return false;
+
+	if (m->rem_addr && !sa_cmp(&rule->rem_addr, m->rem_addr, SA_ALL))
+		return false;
+
+	return true;
+}
+
+
+static struct rule *rule_find(const struct rule_match *m)
+{
+	return list_ledata(hash_lookup(nft.rules,
+				       rule_key(m->table, m->proto,
+						m->int_addr, m->rem_addr),
+				       rule_cmp_handler, (void *)m));
+}
+
+
+static const void *sa_addr(const struct sa *sa, uint32_t *len)
+{
+	switch (sa_af(sa)) {
+
+	case AF_INET:
+		*len = 4;
+		return &sa->u.in.sin_addr;
+
+	case AF_INET6:
+		*len = 16;
+		return &sa->u.in6.sin6_addr;
+
+	default:
+		return NULL;
+	}
+}
+
+
+static uint8_t sa_nfproto(const struct sa *sa)
+{
+	return sa_af(sa) == AF_INET6 ? NFPROTO_IPV6 : NFPROTO_IPV4;
+}
+
+
+/*
+ * Transactions
+ */
+
+static void txn_reset(struct txn *txn)
+{
+	struct le *le;
+
+	while ((le = list_head(&txn->addl)))
+		mem_deref(le->data);
+
+	while ((le = list_head(&txn->dell)))
+		mem_deref(le->data);
+
+	txn->mb = mem_deref(txn->mb);
+}
+
+
+/* the rules of a failed transaction are still in the kernel */
+static void txn_restore(struct txn *txn)
+{
+	struct le *le;
+
+	while ((le = list_head(&txn->dell))) {
+
+		struct rule *rule = le->data;
+
+		list_unlink(&rule->tle);
+		hash_append(nft.rules, rule_key(rule->table, rule->proto,
+						&rule->int_addr,
+						&rule->rem_addr),
+			    &rule->le, rule);
+	}
+}
+
+
+static int txn_begin(struct txn *txn)
+{
+	struct nlmsghdr *nlh;
+
+	memset(txn, 0, sizeof(*txn));
+
+	txn->mb = mbuf_alloc(4 * NFT_MSG_MAXSZ);
+	if (!txn->mb)
+		return ENOMEM;
+
+	txn->seq_first = nft.seq;
+
+	nlh = nftnl_batch_begin((char *)mbuf_buf(txn->mb), nft.seq++);
+	txn->mb->pos += NLMSG_ALIGN(nlh->nlmsg_len);
+	txn->mb->end  = txn->mb->pos;
+
+	return 0;
+}
+
+
+static struct nlmsghdr *txn_msg(struct txn *txn, uint16_t type,
+				uint16_t flags)
+{
+	if (mbuf_get_space(txn->mb) < NFT_MSG_MAXSZ) {
+
+		if (mbuf_resize(txn->mb, txn->mb->size * 2))
+			return NULL;
+	}
+
+	++txn->acks;
+
+	return nftnl_nlmsg_build_hdr((char *)mbuf_buf(txn->mb), type,
+				     NFPROTO_INET, flags | NLM_F_ACK,
+				     nft.seq++);
+}
+
+
+static void txn_push(struct txn *txn, const struct nlmsghdr *nlh)
+{
+	txn->mb->pos += NLMSG_ALIGN(nlh->nlmsg_len);
+	txn->mb->end  = txn->mb->pos;
+}
+
+
+static void handle_echo(struct txn *txn, const struct nlmsghdr *nlh)
+{
+	struct nftnl_rule *r;
+	struct le *le;
+
+	for (le = txn->addl.head; le; le = le->next) {
+
+		struct rule *rule = le->data;
+
+		if (rule->seq != nlh->nlmsg_seq)
+			continue;
+
+		r = nftnl_rule_alloc();
+		if (!r)
+			return;
+
+		if (nftnl_rule_nlmsg_parse(nlh, r) >= 0) {
+			rule->handle = nftnl_rule_get_u64(r,
+							  NFTNL_RULE_HANDLE);
+		}
+
+		nftnl_rule_free(r);
+		return;
+	}
+}
+
+
+static int txn_commit(struct txn *txn)
+{
+	uint8_t buf[MNL_SOCKET_BUFFER_SIZE];
+	struct nlmsghdr *nlh;
+	struct le *le;
+	int err = 0;
+
+	nlh = nftnl_batch_end((char *)mbuf_buf(txn->mb), nft.seq++);
+	txn_push(txn, nlh);
+
+	if (mnl_socket_sendto(nft.nl, txn->mb->buf, txn->mb->end) < 0) {
+		err = errno;
+		goto out;
+	}
+
+	while (txn->acks) {
+
+		ssize_t n;
+		int len;
+
+		n = mnl_socket_recvfrom(nft.nl, buf, sizeof(buf));
+		if (n < 0) {
+			if (!err)
+				err = errno;
+			break;
+		}
+
+		len = (int)n;
+
+		for (nlh = (struct nlmsghdr *)buf; NLMSG_OK(nlh, len);
+		     nlh = NLMSG_NEXT(nlh, len)) {
+
+			const struct nlmsgerr *e;
+
+			/* stale reply from an earlier transaction */
+			if (nlh->nlmsg_seq < txn->seq_first)
+				continue;
+
+			if (nlh->nlmsg_type != NLMSG_ERROR) {
+
+				if (NFNL_MSG_TYPE(nlh->nlmsg_type) ==
+				    NFT_MSG_NEWRULE)
+					handle_echo(txn, nlh);
+
+				continue;
+			}
+
+			e = mnl_nlmsg_get_payload(nlh);
+			if (e->error && !err)
+				err = -e->error;
+
+			if (txn->acks)
+				--txn->acks;
+		}
+	}
+
+	/* added rules are tracked by their handle from now on */
+	while (!err && (le = list_head(&txn->addl))) {
+
+		struct rule *rule = le->data;
+
+		list_unlink(&rule->tle);
+
+		if (!rule->handle && !nft.maps) {
+			warning("nftables: no handle for new rule in `%s'\n",
+				rule->table);
+			mem_deref(rule);
+			continue;
+		}
+
+		hash_append(nft.rules, rule_key(rule->table, rule->proto,
+						&rule->int_addr,
+						&rule->rem_addr),
+			    &rule->le, rule);
+	}
+
+ out:
+	if (err)
+		txn_restore(txn);
+
+	txn_reset(txn);
+
+	return err;
+}
+
+
+/*
+ * Rule expressions
+ */
+
+static int add_meta(struct nftnl_rule *r, uint32_t key, uint32_t dreg)
+{
+	struct nftnl_expr *e = nftnl_expr_alloc("meta");
+	if (!e)
+		return ENOMEM;
+
+	nftnl_expr_set_u32(e, NFTNL_EXPR_META_KEY, key);
+	nftnl_expr_set_u32(e, NFTNL_EXPR_META_DREG, dreg);
+	nftnl_rule_add_expr(r, e);
+
+	return 0;
+}
+
+
+static int add_payload(struct nftnl_rule *r, uint32_t base,
+		       uint32_t offset, uint32_t len, uint32_t dreg)
+{
+	struct nftnl_expr *e = nftnl_expr_alloc("payload");
+	if (!e)
+		return ENOMEM;
+
+	nftnl_expr_set_u32(e, NFTNL_EXPR_PAYLOAD_BASE, base);
+	nftnl_expr_set_u32(e, NFTNL_EXPR_PAYLOAD_OFFSET, offset);
+	nftnl_expr_set_u32(e, NFTNL_EXPR_PAYLOAD_LEN, len);
+	nftnl_expr_set_u32(e, NFTNL_EXPR_PAYLOAD_DREG, dreg);
+	nftnl_rule_add_expr(r, e);
+
+	return 0;
+}
+
+
+static int add_cmp(struct nftnl_rule *r, uint32_t sreg,
+		   const void *data, uint32_t len)
+{
+	struct nftnl_expr *e = nftnl_expr_alloc("cmp");
+	if (!e)
+		return ENOMEM;
+
+	nftnl_expr_set_u32(e, NFTNL_EXPR_CMP_SREG, sreg);
+	nftnl_expr_set_u32(e, NFTNL_EXPR_CMP_OP, NFT_CMP_EQ);
+	nftnl_expr_set(e, NFTNL_EXPR_CMP_DATA, data, len);
+	nftnl_rule_add_expr(r, e);
+
+	return 0;
+}
+
+
+static int add_imm(struct nftnl_rule *r, uint32_t dreg,
+		   const void *data, uint32_t len)
+{
+	struct nftnl_expr *e = nftnl_expr_alloc("immediate");
+	if (!e)
+		return ENOMEM;
+
+	nftnl_expr_set_u32(e, NFTNL_EXPR_IMM_DREG, dreg);
+	nftnl_expr_set(e, NFTNL_EXPR_IMM_DATA, data, len);
+	nftnl_rule_add_expr(r, e);
+
+	return 0;
+}
+
+
+static int match_ifname(struct nftnl_rule *r, uint32_t key,
+			const char *ifname)
+{
+	char name[IFNAMSIZ];
+	int err;
+
+	if (!ifname)
+		return 0;
+
+	memset(name, 0, sizeof(name));
+	str_ncpy(name, ifname, sizeof(name));
+
+	err  = add_meta(r, key, NFT_REG_1);
+	err |= add_cmp(r, NFT_REG_1, name, sizeof(name));
+
+	return err;
+}
+
+
+static int match_proto(struct nftnl_rule *r, const struct sa *addr,
+		       int proto)
+{
+	uint8_t nfproto = sa_nfproto(addr);
+	uint8_t l4proto = proto;
+	int err;
+
+	err  = add_meta(r, NFT_META_NFPROTO, NFT_REG_1);
+	err |= add_cmp(r, NFT_REG_1, &nfproto, sizeof(nfproto));
+	err |= add_meta(r, NFT_META_L4PROTO, NFT_REG_1);
+	err |= add_cmp(r, NFT_REG_1, &l4proto, sizeof(l4proto));
+
+	return err;
+}
+
+
+/* match an IP-address in the network header (saddr or daddr) */
+static int match_addr(struct nftnl_rule *r, const struct sa *addr,
+		      bool src)
+{
+	const void *p;
+	uint32_t len, offset;
+	int err;
+
+	p = sa_addr(addr, &len);
+	if (!p)
+		return EAFNOSUPPORT;
+
+	if (sa_af(addr) == AF_INET)
+		offset = src ? 12 : 16;
+	else
+		offset = src ?  8 : 24;
+
+	err  = add_payload(r, NFT_PAYLOAD_NETWORK_HEADER, offset, len,
+			   NFT_REG_1);
+	err |= add_cmp(r, NFT_REG_1, p, len);
+
+	return err;
+}
+
+
+/* match a port in the transport header (sport or dport) */
+static int match_port(struct nftnl_rule *r, uint16_t port, bool src)
+{
+	uint16_t nport = htons(port);
+	int err;
+
+	err  = add_payload(r, NFT_PAYLOAD_TRANSPORT_HEADER, src ? 0 : 2,
+			   sizeof(nport), NFT_REG_1);
+	err |= add_cmp(r, NFT_REG_1, &nport, sizeof(nport));
+
+	return err;
+}
+
+
+static int add_nat(struct nftnl_rule *r, uint32_t type,
+		   const struct sa *to)
+{
+	struct nftnl_expr *e;
+	uint16_t nport = htons(sa_port(to));
+	const void *p;
+	uint32_t len;
+	int err;
+
+	p = sa_addr(to, &len);
+	if (!p)
+		return EAFNOSUPPORT;
+
+	err = add_imm(r, NFT_REG_1, p, len);
+	if (nport)
+		err |= add_imm(r, NFT_REG_2, &nport, sizeof(nport));
+	if (err)
+		return err;
+
+	e = nftnl_expr_alloc("nat");
+	if (!e)
+		return ENOMEM;
+
+	nftnl_expr_set_u32(e, NFTNL_EXPR_NAT_TYPE, type);
+	nftnl_expr_set_u32(e, NFTNL_EXPR_NAT_FAMILY, sa_nfproto(to));
+	nftnl_expr_set_u32(e, NFTNL_EXPR_NAT_REG_ADDR_MIN, NFT_REG_1);
+	if (nport)
+		nftnl_expr_set_u32(e, NFTNL_EXPR_NAT_REG_PROTO_MIN,
+				   NFT_REG_2);
+	nftnl_rule_add_expr(r, e);
+
+	return 0;
+}
+
+
+static struct nftnl_udata_buf *comment_alloc(uint8_t type,
+					      const char *descr)
+{
+	struct nftnl_udata_buf *udbuf;
+
+	udbuf = nftnl_udata_buf_alloc(NFT_USERDATA_MAXLEN);
+	if (!udbuf)
+		return NULL;
+
+	if (!nftnl_udata_put_strz(udbuf, type, descr)) {
+		nftnl_udata_buf_free(udbuf);
+		return NULL;
+	}
+
+	return udbuf;
+}
+
+
+static int set_comment(struct nftnl_rule *r, const char *descr)
+{
+	struct nftnl_udata_buf *udbuf;
+
+	if (!descr)
+		return 0;
+
+	udbuf = comment_alloc(NFTNL_UDATA_RULE_COMMENT, descr);
+	if (!udbuf)
+		return 0;
+
+	nftnl_rule_set_data(r, NFTNL_RULE_USERDATA,
+			    nftnl_udata_buf_data(udbuf),
+			    nftnl_udata_buf_len(udbuf));
+
+	nftnl_udata_buf_free(udbuf);
+
+	return 0;
+}
+
+
+static int rule_encode(struct nftnl_rule *r, const struct rule *rule,
+		       const char *ext_ifname, const char *descr)
+{
+	int err;
+
+	nftnl_rule_set_str(r, NFTNL_RULE_TABLE, rule->table);
+
+	switch (rule->opcode) {
+
+	case PCP_MAP:
+		nftnl_rule_set_str(r, NFTNL_RULE_CHAIN, chain_dnat);
+
+		err  = match_proto(r, &rule->ext_addr, rule->proto);
+		err |= match_ifname(r, NFT_META_IIFNAME, ext_ifname);
+		err |= match_port(r, sa_port(&rule->ext_addr), false);
+		if (err)
+			return err;
+
+		err = add_nat(r, NFT_NAT_DNAT, &rule->int_addr);
+		break;
+
+	case PCP_PEER:
+		nftnl_rule_set_str(r, NFTNL_RULE_CHAIN, chain_snat);
+
+		err  = match_proto(r, &rule->int_addr, rule->proto);
+		err |= match_ifname(r, NFT_META_OIFNAME, ext_ifname);
+		err |= match_addr(r, &rule->int_addr, true);
+		err |= match_port(r, sa_port(&rule->int_addr), true);
+		err |= match_addr(r, &rule->rem_addr, false);
+		err |= match_port(r, sa_port(&rule->rem_addr), false);
+		if (err)
+			return err;
+
+		err = add_nat(r, NFT_NAT_SNAT, &rule->ext_addr);
+		break;
+
+	default:
+		return EPROTO;
+	}
+
+	if (err)
+		return err;
+
+	return set_comment(r, descr);
+}
+
+
+/*
+ * Maps
+ */
+
+/* map keys and data are concatenations of 32-bit register aligned fields */
+struct blob {
+	uint8_t b[NFT_KEY_MAXLEN];
+	uint32_t len;
+};
+
+
+static void blob_put(struct blob *bl, const void *p, uint32_t len)
+{
+	memcpy(bl->b + bl->len, p, len);
+	bl->len += (len + 3) & ~3u;
+}
+
+
+static const char *set_name(enum pcp_opcode opcode, int af)
+{
+	if (opcode == PCP_MAP)
+		return af == AF_INET6 ? "map6" : "map4";
+	else
+		return af == AF_INET6 ? "peer6" : "peer4";
+}
+
+
+static uint32_t addr_len(int af)
+{
+	return af == AF_INET6 ? 16 : 4;
+}
+
+
+static uint32_t concat_type(uint32_t type, uint32_t sub)
+{
+	return type << TYPE_BITS | sub;
+}
+
+
+static uint32_t key_layout(enum pcp_opcode opcode, int af, uint32_t *type)
+{
+	uint32_t atype = af == AF_INET6 ? TYPE_IP6ADDR : TYPE_IPADDR;
+	uint32_t t;
+
+	t = concat_type(TYPE_IFNAME, TYPE_INET_PROTOCOL);
+
+	if (opcode == PCP_PEER) {
+		t = concat_type(t, atype);
+		t = concat_type(t, TYPE_INET_SERVICE);
+		t = concat_type(t, atype);
+		t = concat_type(t, TYPE_INET_SERVICE);
+		*type = t;
+
+		return IFNAMSIZ + 4 + 2 * (addr_len(af) + 4);
+	}
+
+	*type = concat_type(t, TYPE_INET_SERVICE);
+
+	return IFNAMSIZ + 4 + 4;
+}
+
+
+static uint32_t data_layout(int af, uint32_t *type)
+{
+	*type = concat_type(af == AF_INET6 ? TYPE_IP6ADDR : TYPE_IPADDR,
+			    TYPE_INET_SERVICE);
+
+	return addr_len(af) + 4;
+}
+
+
+static int blob_addr(struct blob *bl, const struct sa *sa, bool port)
+{
+	uint16_t nport = htons(sa_port(sa));
+	const void *p;
+	uint32_t len;
+
+	p = sa_addr(sa, &len);
+	if (!p)
+		return EAFNOSUPPORT;
+
+	blob_put(bl, p, len);
+	if (port)
+		blob_put(bl, &nport, sizeof(nport));
+
+	return 0;
+}
+
+
+static int elem_key(struct blob *key, const struct rule *rule)
+{
+	uint8_t l4proto = rule->proto;
+	uint16_t nport;
+	int err;
+
+	memset(key, 0, sizeof(*key));
+
+	blob_put(key, rule->ifname, IFNAMSIZ);
+	blob_put(key, &l4proto, sizeof(l4proto));
+
+	if (rule->opcode == PCP_PEER) {
+		err  = blob_addr(key, &rule->int_addr, true);
+		err |= blob_addr(key, &rule->rem_addr, true);
+		return err ? EAFNOSUPPORT : 0;
+	}
+
+	nport = htons(sa_port(&rule->ext_addr));
+	blob_put(key, &nport, sizeof(nport));
+
+	return 0;
+}
+
+
+static int txn_elem(struct txn *txn, const struct rule *rule, uint16_t type,
+		    const char *descr)
+{
+	struct nftnl_udata_buf *udbuf;
+	struct nftnl_set_elem *e;
+	struct nftnl_set *s;
+	struct nlmsghdr *nlh;
+	struct blob key, data;
+	int err;
+
+	err = elem_key(&key, rule);
+	if (err)
+		return err;
+
+	memset(&data, 0, sizeof(data));
+	err = blob_addr(&data, rule->opcode == PCP_MAP ? &rule->int_addr :
+			&rule->ext_addr, true);
+	if (err)
+		return err;
+
+	s = nftnl_set_alloc();
+	if (!s)
+		return ENOMEM;
+
+	e = nftnl_set_elem_alloc();
+	if (!e) {
+		nftnl_set_free(s);
+		return ENOMEM;
+	}
+
+	nftnl_set_set_str(s, NFTNL_SET_TABLE, rule->table);
+	nftnl_set_set_str(s, NFTNL_SET_NAME,
+			  set_name(rule->opcode, sa_af(&rule->int_addr)));
+
+	nftnl_set_elem_set(e, NFTNL_SET_ELEM_KEY, key.b, key.len);
+
+	if (type == NFT_MSG_NEWSETELEM) {
+
+		nftnl_set_elem_set(e, NFTNL_SET_ELEM_DATA, data.b, data.len);
+
+		udbuf = descr ? comment_alloc(NFTNL_UDATA_SET_ELEM_COMMENT,
+					      descr) : NULL;
+		if (udbuf) {
+			nftnl_set_elem_set(e, NFTNL_SET_ELEM_USERDATA,
+					   nftnl_udata_buf_data(udbuf),
+					   nftnl_udata_buf_len(udbuf));
+			nftnl_udata_buf_free(udbuf);
+		}
+	}
+
+	/* the set owns the element */
+	nftnl_set_elem_add(s, e);
+
+	nlh = txn_msg(txn, type,
+		      type == NFT_MSG_NEWSETELEM ? NLM_F_CREATE : 0);
+	if (nlh) {
+		nftnl_set_elems_nlmsg_build_payload(nlh, s);
+		txn_push(txn, nlh);
+	}
+
+	nftnl_set_free(s);
+
+	return nlh ? 0 : ENOMEM;
+}
+
+
+static int add_set(struct txn *txn, const char *table,
+		   enum pcp_opcode opcode, int af, uint32_t id)
+{
+	struct nftnl_set *s;
+	struct nlmsghdr *nlh;
+	uint32_t type;
+
+	s = nftnl_set_alloc();
+	if (!s)
+		return ENOMEM;
+
+	nftnl_set_set_str(s, NFTNL_SET_TABLE, table);
+	nftnl_set_set_str(s, NFTNL_SET_NAME, set_name(opcode, af));
+	nftnl_set_set_u32(s, NFTNL_SET_FAMILY, NFPROTO_INET);
+	nftnl_set_set_u32(s, NFTNL_SET_ID, id);
+	nftnl_set_set_u32(s, NFTNL_SET_FLAGS, NFT_SET_MAP);
+	nftnl_set_set_u32(s, NFTNL_SET_KEY_LEN, key_layout(opcode, af, &type));
+	nftnl_set_set_u32(s, NFTNL_SET_KEY_TYPE, type);
+	nftnl_set_set_u32(s, NFTNL_SET_DATA_LEN, data_layout(af, &type));
+	nftnl_set_set_u32(s, NFTNL_SET_DATA_TYPE, type);
+
+	nlh = txn_msg(txn, NFT_MSG_NEWSET, NLM_F_CREATE);
+	if (nlh) {
+		nftnl_set_nlmsg_build_payload(nlh, s);
+		txn_push(txn, nlh);
+	}
+
+	nftnl_set_free(s);
+
+	return nlh ? 0 : ENOMEM;
+}
+
+
+/* load a key field into the next 32-bit register(s) */
+static int load_meta(struct nftnl_rule *r, uint32_t key, uint32_t len,
+		     uint32_t *reg)
+{
+	int err = add_meta(r, key, NFT_REG32_00 + *reg);
+
+	*reg += (len + 3) / 4;
+
+	return err;
+}
+
+
+static int load_payload(struct nftnl_rule *r, uint32_t base,
+			uint32_t offset, uint32_t len, uint32_t *reg)
+{
+	int err = add_payload(r, base, offset, len, NFT_REG32_00 + *reg);
+
+	*reg += (len + 3) / 4;
+
+	return err;
+}
+
+
+static int add_map_rule(struct txn *txn, const char *table,
+			enum pcp_opcode opcode, int af, uint32_t set_id)
+{
+	const bool dnat = opcode == PCP_MAP;
+	const uint32_t alen = addr_len(af);
+	uint8_t nfproto = af == AF_INET6 ? NFPROTO_IPV6 : NFPROTO_IPV4;
+	struct nftnl_rule *r;
+	struct nftnl_expr *e;
+	struct nlmsghdr *nlh;
+	uint32_t reg = 0;
+	int err;
+
+	r = nftnl_rule_alloc();
+	if (!r)
+		return ENOMEM;
+
+	nftnl_rule_set_str(r, NFTNL_RULE_TABLE, table);
+	nftnl_rule_set_str(r, NFTNL_RULE_CHAIN,
+			   dnat ? chain_dnat : chain_snat);
+
+	err  = add_meta(r, NFT_META_NFPROTO, NFT_REG_1);
+	err |= add_cmp(r, NFT_REG_1, &nfproto, sizeof(nfproto));
+
+	err |= load_meta(r, dnat ? NFT_META_IIFNAME : NFT_META_OIFNAME,
+			 IFNAMSIZ, &reg);
+	err |= load_meta(r, NFT_META_L4PROTO, 1, &reg);
+
+	if (!dnat) {
+		err |= load_payload(r, NFT_PAYLOAD_NETWORK_HEADER,
+				    af == AF_INET6 ? 8 : 12, alen, &reg);
+		err |= load_payload(r, NFT_PAYLOAD_TRANSPORT_HEADER, 0, 2,
+				    &reg);
+		err |= load_payload(r, NFT_PAYLOAD_NETWORK_HEADER,
+				    af == AF_INET6 ? 24 : 16, alen, &reg);
+	}
+
+	err |= load_payload(r, NFT_PAYLOAD_TRANSPORT_HEADER, 2, 2, &reg);
+	if (err)
+		goto out;
+
+	e = nftnl_expr_alloc("lookup");
+	if (!e) {
+		err = ENOMEM;
+		goto out;
+	}
+
+	nftnl_expr_set_u32(e, NFTNL_EXPR_LOOKUP_SREG, NFT_REG32_00);
+	nftnl_expr_set_u32(e, NFTNL_EXPR_LOOKUP_DREG, NFT_REG32_00);
+	nftnl_expr_set_str(e, NFTNL_EXPR_LOOKUP_SET, set_name(opcode, af));
+	nftnl_expr_set_u32(e, NFTNL_EXPR_LOOKUP_SET_ID, set_id);
+	nftnl_rule_add_expr(r, e);
+
+	e = nftnl_expr_alloc("nat");
+	if (!e) {
+		err = ENOMEM;
+		goto out;
+	}
+
+	nftnl_expr_set_u32(e, NFTNL_EXPR_NAT_TYPE,
+			   dnat ? NFT_NAT_DNAT : NFT_NAT_SNAT);
+	nftnl_expr_set_u32(e, NFTNL_EXPR_NAT_FAMILY, nfproto);
+	nftnl_expr_set_u32(e, NFTNL_EXPR_NAT_REG_ADDR_MIN, NFT_REG32_00);
+	nftnl_expr_set_u32(e, NFTNL_EXPR_NAT_REG_PROTO_MIN,
+			   NFT_REG32_00 + alen / 4);
+	nftnl_rule_add_expr(r, e);
+
+	nlh = txn_msg(txn, NFT_MSG_NEWRULE, NLM_F_CREATE | NLM_F_APPEND);
+	if (!nlh) {
+		err = ENOMEM;
+		goto out;
+	}
+
+	nftnl_rule_nlmsg_build_payload(nlh, r);
+	txn_push(txn, nlh);
+
+ out:
+	nftnl_rule_free(r);
+
+	return err;
+}
+
+
+static const struct {
+	enum pcp_opcode opcode;
+	int af;
+} setv[] = {
+	{PCP_MAP,  AF_INET},
+	{PCP_MAP,  AF_INET6},
+	{PCP_PEER, AF_INET},
+	{PCP_PEER, AF_INET6},
+};
+
+
+/* the maps, and the rules that look them up */
+static int add_maps(struct txn *txn, const char *table)
+{
+	size_t i;
+	int err = 0;
+
+	for (i = 0; i < ARRAY_SIZE(setv) && !err; i++) {
+
+		err = add_set(txn, table, setv[i].opcode, setv[i].af,
+			      (uint32_t)i + 1);
+		if (!err)
+			err = add_map_rule(txn, table, setv[i].opcode,
+					   setv[i].af, (uint32_t)i + 1);
+	}
+
+	return err;
+}
+
+
+/*
+ * Backend API
+ */
+
+static int add_chain(struct txn *txn, const char *table, const char *name,
+		     uint32_t hooknum, int32_t prio)
+{
+	struct nftnl_chain *c;
+	struct nlmsghdr *nlh;
+
+	c = nftnl_chain_alloc();
+	if (!c)
+		return ENOMEM;
+
+	nftnl_chain_set_str(c, NFTNL_CHAIN_TABLE, table);
+	nftnl_chain_set_str(c, NFTNL_CHAIN_NAME, name);
+	nftnl_chain_set_str(c, NFTNL_CHAIN_TYPE, "nat");
+	nftnl_chain_set_u32(c, NFTNL_CHAIN_HOOKNUM, hooknum);
+	nftnl_chain_set_s32(c, NFTNL_CHAIN_PRIO, prio);
+
+	nlh = txn_msg(txn, NFT_MSG_NEWCHAIN, NLM_F_CREATE);
+	if (nlh) {
+		nftnl_chain_nlmsg_build_payload(nlh, c);
+		txn_push(txn, nlh);
+	}
+
+	nftnl_chain_free(c);
+
+	return nlh ? 0 : ENOMEM;
+}
+
+
+static int backend_new(const char *name)
+{
+	struct nftnl_table *t;
+	struct nlmsghdr *nlh;
+	struct txn txn;
+	int err;
+
+	err = txn_begin(&txn);
+	if (err)
+		return err;
+
+	t = nftnl_table_alloc();
+	if (!t) {
+		err = ENOMEM;
+		goto out;
+	}
+
+	nftnl_table_set_str(t, NFTNL_TABLE_NAME, name);
+
+	nlh = txn_msg(&txn, NFT_MSG_NEWTABLE, NLM_F_CREATE);
+	if (nlh) {
+		nftnl_table_nlmsg_build_payload(nlh, t);
+		txn_push(&txn, nlh);
+	}
+
+	nftnl_table_free(t);
+
+	if (!nlh) {
+		err = ENOMEM;
+		goto out;
+	}
+
+	err  = add_chain(&txn, name, chain_dnat, NF_INET_PRE_ROUTING,
+			 NFT_PRIO_DSTNAT);
+	err |= add_chain(&txn, name, chain_snat, NF_INET_POST_ROUTING,
+			 NFT_PRIO_SRCNAT);
+	if (err)
+		goto out;
+
+	if (nft.maps) {
+		err = add_maps(&txn, name);
+		if (err)
+			goto out;
+	}
+
+	return txn_commit(&txn);
+
+ out:
+	txn_reset(&txn);
+	return err;
+}
+
+
+static bool flush_handler(struct le *le, void *arg)
+{
+	struct rule *rule = le->data;
+
+	if (0 == str_cmp(rule->table, arg))
+		mem_deref(rule);
+
+	return false;
+}
+
+
+static void backend_flush(const char *name)
+{
+	struct nftnl_table *t;
+	struct nlmsghdr *nlh;
+	struct txn txn;
+	int err;
+
+	hash_apply(nft.rules, flush_handler, (void *)name);
+
+	if (txn_begin(&txn))
+		return;
+
+	t = nftnl_table_alloc();
+	if (!t) {
+		txn_reset(&txn);
+		return;
+	}
+
+	nftnl_table_set_str(t, NFTNL_TABLE_NAME, name);
+
+	nlh = txn_msg(&txn, NFT_MSG_DELTABLE, 0);
+	if (nlh) {
+		nftnl_table_nlmsg_build_payload(nlh, t);
+		txn_push(&txn, nlh);
+	}
+
+	nftnl_table_free(t);
+
+	if (!nlh) {
+		txn_reset(&txn);
+		return;
+	}
+
+	err = txn_commit(&txn);
+	if (err && err != ENOENT)
+		warning("nftables: flush table `%s' failed (%m)\n", name, err);
+}
+
+
+static int rule_alloc(struct rule **rulep, const char *name,
+		      enum pcp_opcode opcode, int proto,
+		      const struct sa *ext_addr, const struct sa *int_addr,
+		      const struct sa *rem_addr)
+{
+	struct rule *rule;
+	int err;
+
+	rule = mem_zalloc(sizeof(*rule), rule_destructor);
+	if (!rule)
+		return ENOMEM;
+
+	err = str_dup(&rule->table, name);
+	if (err) {
+		mem_deref(rule);
+		return err;
+	}
+
+	rule->opcode   = opcode;
+	rule->proto    = proto;
+	rule->ext_addr = *ext_addr;
+	rule->int_addr = *int_addr;
+	if (rem_addr)
+		rule->rem_addr = *rem_addr;
+
+	*rulep = rule;
+
+	return 0;
+}
+
+
+/* note: the transaction takes over the rule */
+static int txn_add_rule(struct txn *txn, struct rule *rule,
+			const char *ext_ifname, const char *descr)
+{
+	struct nftnl_rule *r;
+	struct nlmsghdr *nlh;
+	int err;
+
+	list_append(&txn->addl, &rule->tle, rule);
+
+	if (ext_ifname)
+		str_ncpy(rule->ifname, ext_ifname, sizeof(rule->ifname));
+
+	if (nft.maps) {
+		err = txn_elem(txn, rule, NFT_MSG_NEWSETELEM, descr);
+		if (err)
+			mem_deref(rule);
+		return err;
+	}
+
+	r = nftnl_rule_alloc();
+	if (!r) {
+		mem_deref(rule);
+		return ENOMEM;
+	}
+
+	err = rule_encode(r, rule, ext_ifname, descr);
+	if (err)
+		goto out;
+
+	nlh = txn_msg(txn, NFT_MSG_NEWRULE,
+		      NLM_F_CREATE | NLM_F_APPEND | NLM_F_ECHO);
+	if (!nlh) {
+		err = ENOMEM;
+		goto out;
+	}
+
+	nftnl_rule_nlmsg_build_payload(nlh, r);
+	rule->seq = nlh->nlmsg_seq;
+	txn_push(txn, nlh);
+
+ out:
+	nftnl_rule_free(r);
+	if (err)
+		mem_deref(rule);
+
+	return err;
+}
+
+
+static int txn_del_rule(struct txn *txn, struct rule *rule)
+{
+	struct nftnl_rule *r;
+	struct nlmsghdr *nlh;
+
+	/* the rule is released when the transaction is done */
+	hash_unlink(&rule->le);
+	list_append(&txn->dell, &rule->tle, rule);
+
+	if (nft.maps)
+		return txn_elem(txn, rule, NFT_MSG_DELSETELEM, NULL);
+
+	r = nftnl_rule_alloc();
+	if (!r)
+		return ENOMEM;
+
+	nftnl_rule_set_str(r, NFTNL_RULE_TABLE, rule->table);
+	nftnl_rule_set_str(r, NFTNL_RULE_CHAIN,
+			   rule->opcode == PCP_MAP ? chain_dnat : chain_snat);
+	nftnl_rule_set_u64(r, NFTNL_RULE_HANDLE, rule->handle);
+
+	nlh = txn_msg(txn, NFT_MSG_DELRULE, 0);
+	if (nlh) {
+		nftnl_rule_nlmsg_build_payload(nlh, r);
+		txn_push(txn, nlh);
+	}
+
+	nftnl_rule_free(r);
+
+	return nlh ? 0 : ENOMEM;
+}
+
+
+static int rule_append(struct rule *rule, const char *ext_ifname,
+		       const char *descr)
+{
+	struct txn txn;
+	int err;
+
+	if (nft.batch)
+		return txn_add_rule(&nft.txn, rule, ext_ifname, descr);
+
+	err = txn_begin(&txn);
+	if (err) {
+		mem_deref(rule);
+		return err;
+	}
+
+	err = txn_add_rule(&txn, rule, ext_ifname, descr);
+	if (err) {
+		txn_reset(&txn);
+		return err;
+	}
+
+	return txn_commit(&txn);
+}
+
+
+static void rule_delete(const struct rule_match *m)
+{
+	struct rule *rule;
+	struct txn txn;
+	int err;
+
+	rule = rule_find(m);
+	if (!rule) {
+		warning("nftables: delete: no such rule in `%s'\n", m->table);
+		return;
+	}
+
+	if (nft.batch) {
+		(void)txn_del_rule(&nft.txn, rule);
+		return;
+	}
+
+	if (txn_begin(&txn)) {
+		mem_deref(rule);
+		return;
+	}
+
+	err = txn_del_rule(&txn, rule);
+	if (!err) {
+		err = txn_commit(&txn);
+	}
+	else {
+		txn_restore(&txn);
+		txn_reset(&txn);
+	}
+
+	if (err && err != ENOENT) {
+		warning("nftables: delete rule in `%s' failed (%m)\n",
+			m->table, err);
+	}
+}
+
+
+static int backend_append(const char *name, int proto,
+			  const struct sa *ext_addr, const char *ext_ifname,
+			  const struct sa *int_addr,
+			  const char *descr)
+{
+	struct rule *rule;
+	int err;
+
+	err = rule_alloc(&rule, name, PCP_MAP, proto, ext_addr, int_addr,
+			 NULL);
+	if (err)
+		return err;
+
+	return rule_append(rule, ext_ifname, descr);
+}
+
+
+static void backend_delete(const char *name, int proto,
+			   const struct sa *ext_addr, const char *ext_ifname,
+			   const struct sa *int_addr,
+			   const char *descr)
+{
+	struct rule_match m = {
+		.table    = name,
+		.opcode   = PCP_MAP,
+		.proto    = proto,
+		.ext_addr = ext_addr,
+		.int_addr = int_addr,
+	};
+	(void)ext_ifname;
+	(void)descr;
+
+	rule_delete(&m);
+}
+
+
+static int backend_append_snat(const char *name, int proto,
+			       const struct sa *ext_addr,
+			       const char *ext_ifname,
+			       const struct sa *int_addr,
+			       const struct sa *remote_addr,
+			       const char *descr)
+{
+	struct rule *rule;
+	int err;
+
+	if (!remote_addr)
+		return EINVAL;
+
+	err = rule_alloc(&rule, name, PCP_PEER, proto, ext_addr, int_addr,
+			 remote_addr);
+	if (err)
+		return err;
+
+	return rule_append(rule, ext_ifname, descr);
+}
+
+
+static void backend_delete_snat(const char *name, int proto,
+				const struct sa *ext_addr,
+				const char *ext_ifname,
+				const struct sa *int_addr,
+				const struct sa *peer_addr,
+				const char *descr)
+{
+	struct rule_match m = {
+		.table    = name,
+		.opcode   = PCP_PEER,
+		.proto    = proto,
+		.ext_addr = ext_addr,
+		.int_addr = int_addr,
+		.rem_addr = peer_addr,
+	};
+	(void)ext_ifname;
+	(void)descr;
+
+	rule_delete(&m);
+}
+
+
+static int backend_begin(const char *name)
+{
+	int err;
+	(void)name;
+
+	if (nft.batch)
+		return EALREADY;
+
+	err = txn_begin(&nft.txn);
+	if (err)
+		return err;
+
+	nft.batch = true;
+
+	return 0;
+}
+
+
+static int backend_commit(const char *name)
+{
+	(void)name;
+
+	if (!nft.batch)
+		return EINVAL;
+
+	nft.batch = false;
+
+	return txn_commit(&nft.txn);
+}
+
+
+/*
+ * Rule decoding, the inverse of rule_encode()
+ */
+
+enum load {
+	LOAD_NONE = 0,
+	LOAD_NFPROTO,
+	LOAD_L4PROTO,
+	LOAD_IFNAME,
+	LOAD_SADDR,
+	LOAD_DADDR,
+	LOAD_SPORT,
+	LOAD_DPORT,
+};
+
+struct decode {
+	enum load load;           /* what is in NFT_REG_1 */
+	uint8_t nfproto;
+	uint8_t l4proto;
+	char ifname[IFNAMSIZ];
+	uint8_t saddr[16], daddr[16], naddr[16];
+	uint32_t saddr_len, daddr_len, naddr_len;
+	uint16_t sport, dport, nport;   /* network byte order */
+	uint32_t nat;
+	bool has_nat;
+	bool invalid;
+};
+
+
+static enum load payload_load(uint32_t base, uint32_t offset)
+{
+	if (base == NFT_PAYLOAD_NETWORK_HEADER) {
+
+		switch (offset) {
+
+		case 8:
+		case 12: return LOAD_SADDR;
+		case 16:
+		case 24: return LOAD_DADDR;
+		default: return LOAD_NONE;
+		}
+	}
+	else if (base == NFT_PAYLOAD_TRANSPORT_HEADER) {
+
+		switch (offset) {
+
+		case 0:  return LOAD_SPORT;
+		case 2:  return LOAD_DPORT;
+		default: return LOAD_NONE;
+		}
+	}
+
+	return LOAD_NONE;
+}
+
+
+static void decode_cmp(struct decode *d, const void *data, uint32_t len)
+{
+	switch (d->load) {
+
+	case LOAD_NFPROTO:
+		if (len != 1)
+			break;
+		d->nfproto = *(const uint8_t *)data;
+		return;
+
+	case LOAD_L4PROTO:
+		if (len != 1)
+			break;
+		d->l4proto = *(const uint8_t *)data;
+		return;
+
+	case LOAD_IFNAME:
+		if (len != IFNAMSIZ)
+			break;
+		memcpy(d->ifname, data, len);
+		d->ifname[IFNAMSIZ-1] = '\0';
+		return;
+
+	case LOAD_SADDR:
+		if (len != 4 && len != 16)
+			break;
+		memcpy(d->saddr, data, len);
+		d->saddr_len = len;
+		return;
+
+	case LOAD_DADDR:
+		if (len != 4 && len != 16)
+			break;
+		memcpy(d->daddr, data, len);
+		d->daddr_len = len;
+		return;
+
+	case LOAD_SPORT:
+		if (len != 2)
+			break;
+		memcpy(&d->sport, data, len);
+		return;
+
+	case LOAD_DPORT:
+		if (len != 2)
+			break;
+		memcpy(&d->dport, data, len);
+		return;
+
+	default:
+		break;
+	}
+
+	d->invalid = true;
+}
+
+
+static int expr_handler(struct nftnl_expr *e, void *arg)
+{
+	struct decode *d = arg;
+	const char *name = nftnl_expr_get_str(e, NFTNL_EXPR_NAME);
+	const void *data;
+	uint32_t len = 0;
+
+	if (!str_cmp(name, "meta")) {
+
+		switch (nftnl_expr_get_u32(e, NFTNL_EXPR_META_KEY)) {
+
+		case NFT_META_NFPROTO: d->load = LOAD_NFPROTO; break;
+		case NFT_META_L4PROTO: d->load = LOAD_L4PROTO; break;
+		case NFT_META_IIFNAME:
+		case NFT_META_OIFNAME: d->load = LOAD_IFNAME;  break;
+		default:               d->invalid = true;      break;
+		}
+	}
+	else if (!str_cmp(name, "payload")) {
+
+		d->load = payload_load(
+			nftnl_expr_get_u32(e, NFTNL_EXPR_PAYLOAD_BASE),
+			nftnl_expr_get_u32(e, NFTNL_EXPR_PAYLOAD_OFFSET));
+		if (d->load == LOAD_NONE)
+			d->invalid = true;
+	}
+	else if (!str_cmp(name, "cmp")) {
+
+		if (nftnl_expr_get_u32(e, NFTNL_EXPR_CMP_OP) != NFT_CMP_EQ) {
+			d->invalid = true;
+			return 0;
+		}
+
+		data = nftnl_expr_get(e, NFTNL_EXPR_CMP_DATA, &len);
+		if (data)
+			decode_cmp(d, data, len);
+		else
+			d->invalid = true;
+
+		d->load = LOAD_NONE;
+	}
+	else if (!str_cmp(name, "immediate")) {
+
+		data = nftnl_expr_get(e, NFTNL_EXPR_IMM_DATA, &len);
+
+		if (data && nftnl_expr_get_u32(e, NFTNL_EXPR_IMM_DREG) ==
+		    NFT_REG_1 && (len == 4 || len == 16)) {
+			memcpy(d->naddr, data, len);
+			d->naddr_len = len;
+		}
+		else if (data && nftnl_expr_get_u32(e, NFTNL_EXPR_IMM_DREG) ==
+			 NFT_REG_2 && len == 2) {
+			memcpy(&d->nport, data, len);
+		}
+		else
+			d->invalid = true;
+	}
+	else if (!str_cmp(name, "nat")) {
+
+		d->nat     = nftnl_expr_get_u32(e, NFTNL_EXPR_NAT_TYPE);
+		d->has_nat = true;
+	}
+	else {
+		d->invalid = true;
+	}
+
+	return 0;
+}
+
+
+static int sa_from_raw(struct sa *sa, const uint8_t *addr, uint32_t len,
+		       uint16_t nport)
+{
+	uint32_t v4;
+
+	switch (len) {
+
+	case 4:
+		memcpy(&v4, addr, 4);
+		sa_set_in(sa, ntohl(v4), ntohs(nport));
+		return 0;
+
+	case 16:
+		sa_set_in6(sa, addr, ntohs(nport));
+		return 0;
+
+	default:
+		return EAFNOSUPPORT;
+	}
+}
+
+
+static int udata_handler(const struct nftnl_udata *attr, void *arg)
+{
+	const char **comment = arg;
+	const char *str = nftnl_udata_get(attr);
+	uint8_t len = nftnl_udata_len(attr);
+
+	if (nftnl_udata_type(attr) == NFTNL_UDATA_RULE_COMMENT &&
+	    len && str[len-1] == '\0')
+		*comment = str;
+
+	return 0;
+}
+
+
+/* decode a rule that was created by rule_encode() */
+static bool rule_decode(struct rule *rule, struct decode *d,
+			const char **comment, struct nftnl_rule *r)
+{
+	const void *udata;
+	uint32_t len;
+	int af;
+
+	memset(d, 0, sizeof(*d));
+
+	nftnl_expr_foreach(r, expr_handler, d);
+
+	if (d->invalid || !d->has_nat || !d->l4proto)
+		return false;
+
+	rule->proto = d->l4proto;
+
+	if (d->nfproto == NFPROTO_IPV4)
+		af = AF_INET;
+	else if (d->nfproto == NFPROTO_IPV6)
+		af = AF_INET6;
+	else
+		return false;
+
+	udata = nftnl_rule_get_data(r, NFTNL_RULE_USERDATA, &len);
+	if (udata)
+		nftnl_udata_parse(udata, len, udata_handler, comment);
+
+	switch (rule->opcode) {
+
+	case PCP_MAP:
+		if (d->nat != NFT_NAT_DNAT || !d->dport || d->saddr_len ||
+		    d->daddr_len || d->sport)
+			return false;
+
+		sa_init(&rule->ext_addr, af);
+		sa_set_port(&rule->ext_addr, ntohs(d->dport));
+
+		return 0 == sa_from_raw(&rule->int_addr, d->naddr,
+					d->naddr_len, d->nport);
+
+	case PCP_PEER:
+		if (d->nat != NFT_NAT_SNAT || !d->sport || !d->dport)
+			return false;
+
+		return 0 == sa_from_raw(&rule->int_addr, d->saddr,
+					d->saddr_len, d->sport) &&
+			0 == sa_from_raw(&rule->rem_addr, d->daddr,
+					 d->daddr_len, d->dport) &&
+			0 == sa_from_raw(&rule->ext_addr, d->naddr,
+					 d->naddr_len, d->nport);
+
+	default:
+		return false;
+	}
+}
+
+
+struct dump {
+	struct txn txn;           /* deletes the rules that are not kept */
+	const char *name;
+	backend_rule_h *rh;
+	void *arg;
+	enum pcp_opcode opcode;   /* of the map being dumped */
+	int af;
+	int err;
+};
+
+typedef int (dump_h)(const struct nlmsghdr *nlh, struct dump *d);
+
+
+static void dump_result(struct dump *d, struct rule *rule, bool keep)
+{
+	if (keep) {
+		hash_append(nft.rules, rule_key(rule->table, rule->proto,
+						&rule->int_addr,
+						&rule->rem_addr),
+			    &rule->le, rule);
+		return;
+	}
+
+	debug("nftables: deleting stale mapping in `%s'\n", d->name);
+
+	if (!d->err)
+		d->err = txn_del_rule(&d->txn, rule);
+	else
+		mem_deref(rule);
+}
+
+
+static struct rule *dump_rule(struct dump *d)
+{
+	struct rule *rule;
+
+	rule = mem_zalloc(sizeof(*rule), rule_destructor);
+	if (!rule)
+		return NULL;
+
+	if (str_dup(&rule->table, d->name))
+		return mem_deref(rule);
+
+	return rule;
+}
+
+
+static int rule_handler(const struct nlmsghdr *nlh, struct dump *d)
+{
+	const char *comment = NULL, *chain;
+	struct nftnl_rule *r;
+	struct rule *rule;
+	struct decode dec;
+	bool keep;
+
+	if (NFNL_MSG_TYPE(nlh->nlmsg_type) != NFT_MSG_NEWRULE)
+		return 0;
+
+	r = nftnl_rule_alloc();
+	if (!r)
+		return ENOMEM;
+
+	if (nftnl_rule_nlmsg_parse(nlh, r) < 0)
+		goto out;
+
+	rule = dump_rule(d);
+	if (!rule) {
+		nftnl_rule_free(r);
+		return ENOMEM;
+	}
+
+	rule->handle = nftnl_rule_get_u64(r, NFTNL_RULE_HANDLE);
+
+	/* the opcode is implied by the chain */
+	chain = nftnl_rule_get_str(r, NFTNL_RULE_CHAIN);
+	if (!str_cmp(chain, chain_dnat)) {
+		rule->opcode = PCP_MAP;
+	}
+	else if (!str_cmp(chain, chain_snat)) {
+		rule->opcode = PCP_PEER;
+	}
+	else {
+		/* not ours */
+		mem_deref(rule);
+		goto out;
+	}
+
+	keep = rule_decode(rule, &dec, &comment, r);
+	if (keep) {
+		str_ncpy(rule->ifname, dec.ifname, sizeof(rule->ifname));
+
+		keep = d->rh(rule->opcode, rule->proto, &rule->ext_addr,
+			     dec.ifname[0] ? dec.ifname : NULL,
+			     &rule->int_addr, &rule->rem_addr, comment,
+			     d->arg);
+	}
+
+	dump_result(d, rule, keep);
+
+ out:
+	nftnl_rule_free(r);
+
+	return d->err;
+}
+
+
+/* decode a map element, the inverse of elem_key() and txn_elem() */
+static bool elem_decode(struct rule *rule, const char **comment,
+			struct nftnl_set_elem *e, int af)
+{
+	const uint32_t alen = addr_len(af);
+	const uint8_t *key, *data, *p;
+	uint32_t klen = 0, dlen = 0, ulen = 0, type;
+	uint16_t nport;
+	const void *udata;
+
+	key  = nftnl_set_elem_get(e, NFTNL_SET_ELEM_KEY, &klen);
+	data = nftnl_set_elem_get(e, NFTNL_SET_ELEM_DATA, &dlen);
+
+	if (!key || klen != key_layout(rule->opcode, af, &type) ||
+	    !data || dlen != data_layout(af, &type))
+		return false;
+
+	memcpy(rule->ifname, key, IFNAMSIZ);
+	rule->ifname[IFNAMSIZ-1] = '\0';
+	rule->proto = key[IFNAMSIZ];
+
+	p = key + IFNAMSIZ + 4;
+
+	if (rule->opcode == PCP_PEER) {
+		memcpy(&nport, p + alen, 2);
+		if (sa_from_raw(&rule->int_addr, p, alen, nport))
+			return false;
+
+		p += alen + 4;
+
+		memcpy(&nport, p + alen, 2);
+		if (sa_from_raw(&rule->rem_addr, p, alen, nport))
+			return false;
+
+		memcpy(&nport, data + alen, 2);
+		if (sa_from_raw(&rule->ext_addr, data, alen, nport))
+			return false;
+	}
+	else {
+		memcpy(&nport, p, 2);
+		sa_init(&rule->ext_addr, af);
+		sa_set_port(&rule->ext_addr, ntohs(nport));
+
+		memcpy(&nport, data + alen, 2);
+		if (sa_from_raw(&rule->int_addr, data, alen, nport))
+			return false;
+	}
+
+	udata = nftnl_set_elem_get(e, NFTNL_SET_ELEM_USERDATA, &ulen);
+	if (udata)
+		nftnl_udata_parse(udata, ulen, udata_handler, comment);
+
+	return true;
+}
+
+
+static int elem_handler(struct nftnl_set_elem *e, void *arg)
+{
+	struct dump *d = arg;
+	const char *comment = NULL;
+	struct rule *rule;
+	bool keep;
+
+	rule = dump_rule(d);
+	if (!rule) {
+		d->err = ENOMEM;
+		return -1;
+	}
+
+	rule->opcode = d->opcode;
+
+	keep = elem_decode(rule, &comment, e, d->af) &&
+		d->rh(rule->opcode, rule->proto, &rule->ext_addr,
+		      rule->ifname[0] ? rule->ifname : NULL,
+		      &rule->int_addr, &rule->rem_addr, comment, d->arg);
+
+	dump_result(d, rule, keep);
+
+	return d->err ? -1 : 0;
+}
+
+
+static int set_handler(const struct nlmsghdr *nlh, struct dump *d)
+{
+	struct nftnl_set *s;
+
+	if (NFNL_MSG_TYPE(nlh->nlmsg_type) != NFT_MSG_NEWSETELEM)
+		return 0;
+
+	s = nftnl_set_alloc();
+	if (!s)
+		return ENOMEM;
+
+	if (nftnl_set_elems_nlmsg_parse(nlh, s) >= 0)
+		(void)nftnl_set_elem_foreach(s, elem_handler, d);
+
+	nftnl_set_free(s);
+
+	return d->err;
+}
+
+
+/* send a dump request, and pass each reply to the handler */
+static int dump_run(const struct nlmsghdr *req, dump_h *dh, struct dump *d)
+{
+	uint8_t buf[MNL_SOCKET_BUFFER_SIZE];
+	struct nlmsghdr *nlh;
+	bool done = false;
+	int err = 0;
+
+	if (mnl_socket_sendto(nft.nl, req, req->nlmsg_len) < 0)
+		return errno;
+
+	while (!done) {
+
+		ssize_t n;
+		int len;
+
+		n = mnl_socket_recvfrom(nft.nl, buf, sizeof(buf));
+		if (n < 0) {
+			if (!err)
+				err = errno;
+			break;
+		}
+
+		len = (int)n;
+
+		for (nlh = (struct nlmsghdr *)buf; NLMSG_OK(nlh, len);
+		     nlh = NLMSG_NEXT(nlh, len)) {
+
+			const struct nlmsgerr *e;
+
+			if (nlh->nlmsg_seq != req->nlmsg_seq)
+				continue;
+
+			if (nlh->nlmsg_type == NLMSG_DONE) {
+				done = true;
+				break;
+			}
+
+			if (nlh->nlmsg_type == NLMSG_ERROR) {
+				e = mnl_nlmsg_get_payload(nlh);
+				if (e->error && !err)
+					err = -e->error;
+				done = true;
+				break;
+			}
+
+			if (!err)
+				err = dh(nlh, d);
+		}
+	}
+
+	return err;
+}
+
+
+static int dump_rules(struct dump *d)
+{
+	uint8_t buf[MNL_SOCKET_BUFFER_SIZE];
+	struct nftnl_rule *r;
+	struct nlmsghdr *nlh;
+
+	r = nftnl_rule_alloc();
+	if (!r)
+		return ENOMEM;
+
+	nlh = nftnl_nlmsg_build_hdr((char *)buf, NFT_MSG_GETRULE,
+				    NFPROTO_INET, NLM_F_DUMP, nft.seq++);
+	nftnl_rule_set_str(r, NFTNL_RULE_TABLE, d->name);
+	nftnl_rule_nlmsg_build_payload(nlh, r);
+	nftnl_rule_free(r);
+
+	return dump_run(nlh, rule_handler, d);
+}
+
+
+static int dump_maps(struct dump *d)
+{
+	uint8_t buf[MNL_SOCKET_BUFFER_SIZE];
+	struct nftnl_set *s;
+	struct nlmsghdr *nlh;
+	size_t i;
+	int err = 0;
+
+	for (i = 0; i < ARRAY_SIZE(setv) && !err; i++) {
+
+		s = nftnl_set_alloc();
+		if (!s)
+			return ENOMEM;
+
+		d->opcode = setv[i].opcode;
+		d->af     = setv[i].af;
+
+		nlh = nftnl_nlmsg_build_hdr((char *)buf, NFT_MSG_GETSETELEM,
+					    NFPROTO_INET, NLM_F_DUMP,
+					    nft.seq++);
+		nftnl_set_set_str(s, NFTNL_SET_TABLE, d->name);
+		nftnl_set_set_str(s, NFTNL_SET_NAME,
+				  set_name(d->opcode, d->af));
+		nftnl_set_elems_nlmsg_build_payload(nlh, s);
+		nftnl_set_free(s);
+
+		err = dump_run(nlh, set_handler, d);
+	}
+
+	return err;
+}
+
+
+static int backend_dump(const char *name, backend_rule_h *rh, void *arg)
+{
+	struct dump d;
+	int err;
+
+	if (!rh)
+		return EINVAL;
+
+	memset(&d, 0, sizeof(d));
+	d.name = name;
+	d.rh   = rh;
+	d.arg  = arg;
+
+	/* rules that are not kept are deleted in one transaction */
+	err = txn_begin(&d.txn);
+	if (err)
+		return err;
+
+	err = nft.maps ? dump_maps(&d) : dump_rules(&d);
+
+	if (err || !d.txn.acks) {
+		txn_reset(&d.txn);
+		return err;
+	}
+
+	return txn_commit(&d.txn);
+}
+
+
+static struct backend be = {
+	.new    = backend_new,
+	.flush  = backend_flush,
+	.append = backend_append,
+	.delete = backend_delete,
+	.append_snat = backend_append_snat,
+	.delete_snat = backend_delete_snat,
+	.begin  = backend_begin,
+	.commit = backend_commit,
+	.dump   = backend_dump,
+};
+
+
+static int module_init(void)
+{
+	struct timeval tv = {NFT_RCV_TIMEOUT, 0};
+	int err;
+
+	err = hash_alloc(&nft.rules, 256);
+	if (err)
+		return err;
+
+	nft.nl = mnl_socket_open(NETLINK_NETFILTER);
+	if (!nft.nl) {
+		err = errno;
+		warning("nftables: could not open netlink socket (%m)\n",
+			err);
+		goto out;
+	}
+
+	if (mnl_socket_bind(nft.nl, 0, MNL_SOCKET_AUTOPID) < 0) {
+		err = errno;
+		warning("nftables: could not bind netlink socket (%m)\n",
+			err);
+		goto out;
+	}
+
+	/* never block the main loop forever on a lost ACK */
+	(void)setsockopt(mnl_socket_get_fd(nft.nl), SOL_SOCKET, SO_RCVTIMEO,
+			 &tv, sizeof(tv));
+
+	(void)conf_get_bool(_conf(), "nftables_maps", &nft.maps);
+
+	nft.portid = mnl_socket_get_portid(nft.nl);
+	nft.seq    = (uint32_t)time(NULL);
+
+	backend_register(&be);
+
+	debug("nftables: module loaded (portid=%u%s)\n", nft.portid,
+	      nft.maps ? ", maps" : "");
+
+ out:
+	if (err) {
+		if (nft.nl) {
+			mnl_socket_close(nft.nl);
+			nft.nl = NULL;
+		}
+		nft.rules = mem_deref(nft.rules);
+	}
+
+	return err;
+}
+
+
+static int module_close(void)
+{
+	backend_unregister(&be);
+
+	if (nft.batch) {
+		txn_reset(&nft.txn);
+		nft.batch = false;
+	}
+
+	hash_flush(nft.rules);
+	nft.rules = mem_deref(nft.rules);
+
+	if (nft.nl) {
+		mnl_socket_close(nft.nl);
+		nft.nl = NULL;
+	}
+
+	debug("nftables: module closed\n");
+
+	return 0;
+}
+
+
+const struct mod_export exports = {
+	.name  = "nftables",
+	.type  = "pcp",
+	.init  = module_init,
+	.close = module_close,
+};
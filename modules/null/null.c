@@ -0,0 +1,485 @@
+/**
+ * @file null.c  In-memory backend, for benchmarks
+ *
+ * Copyright (C) 2010 - 2016 Creytiv.com
+ */
+
+#define _DEFAULT_SOURCE 1
+#include <math.h>
+#include <pthread.h>
+#include <re.h>
+#include <repcpd.h>
+#include "null.h"
+
+
+/*
+ * NOTE: the null backend keeps the rules in memory and never touches
+ *       the system, so that the daemon can be run and measured without
+ *       root and netfilter. The cost of a real backend can be simulated
+ *       with these config items:
+ *
+ *         null_latency       latency per rule in [us], default 0
+ *         null_latency_dist  fixed, uniform or exponential
+ *         null_failure       percentage of appends that fail with EIO
+ *         null_completion    blocking or batched
+ *
+ *       The latency of a uniform distribution is between 0 and twice
+ *       the mean. With blocking completion every rule takes its latency
+ *       when it is applied. With batched completion the latencies of a
+ *       batch are summed up and slept off at once in the commit, like a
+ *       backend that applies a whole transaction in one go. Both block
+ *       the backend thread, nothing completes asynchronously.
+ *
+ *       The number of rules can be read with null_rule_count(), which
+ *       a test harness can look up with dlsym() on the module.
+ */
+
+
+enum dist {
+	DIST_FIXED = 0,
+	DIST_UNIFORM,
+	DIST_EXPONENTIAL,
+};
+
+struct table {
+	struct le le;
+	char *name;
+	struct hash *rules;
+	uint32_t rulec;
+};
+
+struct rule {
+	struct le le;
+	int proto;
+	struct sa ext_addr;
+	struct sa int_addr;
+	struct sa remote_addr;  /* SNAT only */
+};
+
+struct tuple {
+	int proto;
+	const struct sa *int_addr;
+	const struct sa *remote_addr;
+};
+
+
+static struct {
+	struct list tablel;
+	pthread_mutex_t mutex;  /* for null_rule_count() */
+	uint32_t latency;       /* mean latency per rule [us] */
+	enum dist dist;
+	uint32_t failure;       /* [percent] */
+	bool batched;
+	uint64_t pending;       /* latency to be taken at commit [us] */
+} nul = {
+	.mutex = PTHREAD_MUTEX_INITIALIZER,
+};
+
+
+static uint32_t latency_draw(void)
+{
+	double u;
+
+	switch (nul.dist) {
+
+	case DIST_UNIFORM:
+		return (uint32_t)(rand_u32() %
+				  (2 * (uint64_t)nul.latency + 1));
+
+	case DIST_EXPONENTIAL:
+		/* u is in (0, 1] */
+		u = (rand_u32() + 1.0) / 4294967296.0;
+		return (uint32_t)(-log(u) * nul.latency);
+
+	default:
+		return nul.latency;
+	}
+}
+
+
+/* called for every rule that is applied */
+static void latency_take(void)
+{
+	uint32_t us;
+
+	if (!nul.latency)
+		return;
+
+	us = latency_draw();
+
+	if (nul.batched)
+		nul.pending += us;
+	else
+		sys_usleep(us);
+}
+
+
+static bool failure_draw(void)
+{
+	return nul.failure && rand_u32() % 100 < nul.failure;
+}
+
+
+static void table_destructor(void *arg)
+{
+	struct table *table = arg;
+
+	list_unlink(&table->le);
+	hash_flush(table->rules);
+	mem_deref(table->rules);
+	mem_deref(table->name);
+}
+
+
+static void rule_destructor(void *arg)
+{
+	struct rule *rule = arg;
+
+	hash_unlink(&rule->le);
+}
+
+
+static struct table *table_find(const char *name)
+{
+	struct le *le;
+
+	for (le = nul.tablel.head; le; le = le->next) {
+
+		struct table *table = le->data;
+
+		if (0 == str_cmp(table->name, name))
+			return table;
+	}
+
+	return NULL;
+}
+
+
+static bool rule_cmp_handler(struct le *le, void *arg)
+{
+	const struct rule *rule = le->data;
+	const struct tuple *tup = arg;
+
+	if (rule->proto != tup->proto)
+		return false;
+
+	if (!sa_cmp(&rule->int_addr, tup->int_addr, SA_ALL))
+		return false;
+
+	if (sa_isset(tup->remote_addr, SA_ALL))
+		return sa_cmp(&rule->remote_addr, tup->remote_addr, SA_ALL);
+
+	return !sa_isset(&rule->remote_addr, SA_ALL);
+}
+
+
+static struct rule *rule_find(const struct table *table, int proto,
+			      const struct sa *int_addr,
+			      const struct sa *remote_addr)
+{
+	struct tuple tup = {proto, int_addr, remote_addr};
+
+	return list_ledata(hash_lookup(table->rules,
+				       mapping_tuple_hash(proto, int_addr,
+							  remote_addr),
+				       rule_cmp_handler, &tup));
+}
+
+
+static int rule_add(const char *name, int proto, const struct sa *ext_addr,
+		    const struct sa *int_addr, const struct sa *remote_addr)
+{
+	struct table *table;
+	struct rule *rule, *old;
+	int err = 0;
+
+	latency_take();
+
+	if (failure_draw())
+		return EIO;
+
+	rule = mem_zalloc(sizeof(*rule), rule_destructor);
+	if (!rule)
+		return ENOMEM;
+
+	rule->proto    = proto;
+	rule->ext_addr = *ext_addr;
+	rule->int_addr = *int_addr;
+	if (remote_addr)
+		rule->remote_addr = *remote_addr;
+
+	pthread_mutex_lock(&nul.mutex);
+
+	table = table_find(name);
+	if (table) {
+		/* an existing rule for the tuple is replaced */
+		old = rule_find(table, proto, int_addr, remote_addr);
+		if (old) {
+			mem_deref(old);
+			--table->rulec;
+		}
+
+		hash_append(table->rules,
+			    mapping_tuple_hash(proto, int_addr, remote_addr),
+			    &rule->le, rule);
+		++table->rulec;
+	}
+	else
+		err = ENOENT;
+
+	pthread_mutex_unlock(&nul.mutex);
+
+	if (err)
+		mem_deref(rule);
+
+	return err;
+}
+
+
+static void rule_del(const char *name, int proto, const struct sa *int_addr,
+		     const struct sa *remote_addr)
+{
+	struct table *table;
+	struct rule *rule = NULL;
+
+	latency_take();
+
+	pthread_mutex_lock(&nul.mutex);
+
+	table = table_find(name);
+	if (table)
+		rule = rule_find(table, proto, int_addr, remote_addr);
+
+	if (rule) {
+		mem_deref(rule);
+		--table->rulec;
+	}
+
+	pthread_mutex_unlock(&nul.mutex);
+}
+
+
+static int backend_new(const char *name)
+{
+	struct table *table;
+	int err;
+
+	table = mem_zalloc(sizeof(*table), table_destructor);
+	if (!table)
+		return ENOMEM;
+
+	err = str_dup(&table->name, name);
+	if (err)
+		goto out;
+
+	err = hash_alloc(&table->rules, 256);
+	if (err)
+		goto out;
+
+	pthread_mutex_lock(&nul.mutex);
+
+	if (table_find(name))
+		err = EALREADY;
+	else
+		list_append(&nul.tablel, &table->le, table);
+
+	pthread_mutex_unlock(&nul.mutex);
+
+ out:
+	if (err)
+		mem_deref(table);
+
+	return err;
+}
+
+
+static void backend_flush(const char *name)
+{
+	pthread_mutex_lock(&nul.mutex);
+	mem_deref(table_find(name));
+	pthread_mutex_unlock(&nul.mutex);
+}
+
+
+static int backend_append(const char *name, int proto,
+			  const struct sa *ext_addr,
+			  const char *ext_ifname,
+			  const struct sa *int_addr,
+			  const char *descr)
+{
+	(void)ext_ifname;
+	(void)descr;
+
+	return rule_add(name, proto, ext_addr, int_addr, NULL);
+}
+
+
+static void backend_delete(const char *name, int proto,
+			   const struct sa *ext_addr,
+			   const char *ext_ifname,
+			   const struct sa *int_addr,
+			   const char *descr)
+{
+	(void)ext_addr;
+	(void)ext_ifname;
+	(void)descr;
+
+	rule_del(name, proto, int_addr, NULL);
+}
+
+
+static int backend_append_snat(const char *name, int proto,
+			       const struct sa *ext_addr,
+			       const char *ext_ifname,
+			       const struct sa *int_addr,
+			       const struct sa *peer_addr,
+			       const char *descr)
+{
+	(void)ext_ifname;
+	(void)descr;
+
+	return rule_add(name, proto, ext_addr, int_addr, peer_addr);
+}
+
+
+static void backend_delete_snat(const char *name, int proto,
+				const struct sa *ext_addr,
+				const char *ext_ifname,
+				const struct sa *int_addr,
+				const struct sa *peer_addr,
+				const char *descr)
+{
+	(void)ext_addr;
+	(void)ext_ifname;
+	(void)descr;
+
+	rule_del(name, proto, int_addr, peer_addr);
+}
+
+
+static int backend_begin(const char *name)
+{
+	(void)name;
+
+	nul.pending = 0;
+
+	return 0;
+}
+
+
+static int backend_commit(const char *name)
+{
+	(void)name;
+
+	while (nul.pending) {
+
+		uint32_t us = (uint32_t)min(nul.pending, 1000000);
+
+		sys_usleep(us);
+		nul.pending -= us;
+	}
+
+	return 0;
+}
+
+
+static struct backend be = {
+	.new    = backend_new,
+	.flush  = backend_flush,
+	.append = backend_append,
+	.delete = backend_delete,
+	.append_snat = backend_append_snat,
+	.delete_snat = backend_delete_snat,
+	.begin  = backend_begin,
+	.commit = backend_commit,
+};
+
+
+/**
+ * Get the number of rules in the null backend
+ *
+ * @param name Table name, NULL for all tables
+ *
+ * @return Number of rules
+ */
+uint32_t null_rule_count(const char *name)
+{
+	uint32_t n = 0;
+	struct le *le;
+
+	pthread_mutex_lock(&nul.mutex);
+
+	for (le = nul.tablel.head; le; le = le->next) {
+
+		const struct table *table = le->data;
+
+		if (!name || 0 == str_cmp(table->name, name))
+			n += table->rulec;
+	}
+
+	pthread_mutex_unlock(&nul.mutex);
+
+	return n;
+}
+
+
+static int module_init(void)
+{
+	struct pl pl;
+
+	(void)conf_get_u32(_conf(), "null_latency", &nul.latency);
+	(void)conf_get_u32(_conf(), "null_failure", &nul.failure);
+	nul.failure = min(nul.failure, 100);
+
+	if (!conf_get(_conf(), "null_latency_dist", &pl)) {
+
+		if (!pl_strcasecmp(&pl, "uniform"))
+			nul.dist = DIST_UNIFORM;
+		else if (!pl_strcasecmp(&pl, "exponential"))
+			nul.dist = DIST_EXPONENTIAL;
+		else if (!pl_strcasecmp(&pl, "fixed"))
+			nul.dist = DIST_FIXED;
+		else {
+			warning("null: unknown latency distribution `%r'\n",
+				&pl);
+			return EINVAL;
+		}
+	}
+
+	if (!conf_get(_conf(), "null_completion", &pl)) {
+
+		if (!pl_strcasecmp(&pl, "batched"))
+			nul.batched = true;
+		else if (pl_strcasecmp(&pl, "blocking")) {
+			warning("null: unknown completion `%r'\n", &pl);
+			return EINVAL;
+		}
+	}
+
+	backend_register(&be);
+
+	debug("null: module loaded (latency=%uus, failure=%u%%%s)\n",
+	      nul.latency, nul.failure, nul.batched ? ", batched" : "");
+
+	return 0;
+}
+
+
+static int module_close(void)
+{
+	backend_unregister(&be);
+
+	debug("null: module closed (%u rules)\n", null_rule_count(NULL));
+
+	list_flush(&nul.tablel);
+
+	return 0;
+}
+
+
+const struct mod_export exports = {
+	.name  = "null",
+	.type  = "pcp",
+	.init  = module_init,
+	.close = module_close,
+};
@@ -0,0 +1,8 @@
+/**
+ * @file null.h  In-memory backend, for benchmarks
+ *
+ * Copyright (C) 2010 - 2016 Creytiv.com
+ */
+
+
+uint32_t null_rule_count(const char *name);
@@ -50,50 +50,65 @@ static bool request_handler(struct udp_sock *us, const struct sa *src,
 
 	if (!mapping) {
 
+		const struct mapping *map;
 		const char *ext_ifname = NULL;
 
-		if (!sa_isset(&peer.map.ext_addr, SA_ALL) ||
-		    repcpd_extaddr_exist(&peer.map.ext_addr)) {
+		/*
+		 * a mapped endpoint keeps the external endpoint of its MAP,
+		 * the PEER still gets a SNAT rule of its own
+		 */
+		map = mapping_find(table, peer.map.proto, &int_addr);
 
-			if (!sa_isset(&peer.map.ext_addr, SA_ALL)) {
+		if (map && !memcmp(map->nonce, peer.map.nonce,
+				   PCP_NONCE_SZ)) {
 
-				err = repcpd_extaddr_assign(&peer.map.ext_addr,
-							    sa_port(&int_addr),
-							    sa_af(src));
-				if (err) {
-					warning("peer: could not assign"
-						       " external address\n");
-					result = PCP_CANNOT_PROVIDE_EXTERNAL;
-					goto error;
-				}
-			}
+			maddr_get(&map->ext_addr, &peer.map.ext_addr);
+		}
+		else if (!sa_isset(&peer.map.ext_addr, SA_ALL) ||
+			 repcpd_extaddr_exist(&peer.map.ext_addr)) {
 
-			/* Check the external Interface note:
-			   af is suggested AF -- AF_UNSPEC means any */
-			ext_ifname = repcpd_extaddr_ifname_find(AF_UNSPEC);
-			if (!ext_ifname) {
-				warning("peer: external interface"
-					" not found\n");
-			}
+			uint16_t port = sa_port(&int_addr);
 
-			err = mapping_create(&mapping, table, PCP_PEER,
-					     peer.map.proto, &int_addr,
-					     ext_ifname,
-					     &peer.map.ext_addr,
-					     &peer.remote_addr,
-					     lifetime, peer.map.nonce, NULL);
+			/* the suggested port is used if it is free */
+			if (sa_isset(&peer.map.ext_addr, SA_ALL))
+				port = sa_port(&peer.map.ext_addr);
+
+			err = repcpd_extaddr_assign(&peer.map.ext_addr,
+						    peer.map.proto, port,
+						    &int_addr, sa_af(src));
 			if (err) {
-				warning("peer: failed to create mapping"
-					       " (%m)\n", err);
+				warning("peer: could not assign"
+					       " external address\n");
+				result = PCP_CANNOT_PROVIDE_EXTERNAL;
 				goto error;
 			}
-			else
-				goto out;
 		}
 		else {
 			result = PCP_CANNOT_PROVIDE_EXTERNAL;
 			goto error;
 		}
+
+		/* Check the external Interface note:
+		   af is suggested AF -- AF_UNSPEC means any */
+		ext_ifname = repcpd_extaddr_ifname_find(AF_UNSPEC);
+		if (!ext_ifname) {
+			warning("peer: external interface not found\n");
+		}
+
+		err = mapping_create(&mapping, table, PCP_PEER,
+				     peer.map.proto, &int_addr,
+				     ext_ifname,
+				     &peer.map.ext_addr,
+				     &peer.remote_addr,
+				     lifetime, peer.map.nonce, NULL);
+		if (err) {
+			warning("peer: failed to create mapping (%m)\n", err);
+			if (err == EDQUOT)
+				result = PCP_USER_EX_QUOTA;
+			goto error;
+		}
+
+		goto out;
 	}
 
 	/* todo: if a matching mapping is found, and no previous
@@ -102,7 +117,7 @@ static bool request_handler(struct udp_sock *us, const struct sa *src,
 
 	/* simple threat model */
 	if (mapping) {
-		if (0 != memcmp(peer.map.nonce, mapping->map.nonce,
+		if (0 != memcmp(peer.map.nonce, mapping->nonce,
 				PCP_NONCE_SZ)) {
 			result = PCP_NOT_AUTHORIZED;
 			goto error;
@@ -115,15 +130,14 @@ static bool request_handler(struct udp_sock *us, const struct sa *src,
 		     &msg->pld.peer.map.ext_addr, &peer.map.ext_addr);
 	}
 
+	/* reply SUCCESS, when the mapping is committed */
 	if (mapping) {
-		peer = *(struct pcp_peer *)&mapping->map;
-		peer.remote_addr = mapping->remote_addr;
+		err = mapping_reply(mapping, us, src, mb, lifetime);
+	}
+	else {
+		err = pcp_reply(us, src, mb, msg->hdr.opcode, PCP_SUCCESS,
+				lifetime, repcpd_epoch_time(), &peer);
 	}
-
-	/* reply SUCCESS */
-	err = pcp_reply(us, src, mb, msg->hdr.opcode, PCP_SUCCESS,
-			lifetime, repcpd_epoch_time(),
-			&peer);
 	if (err) {
 		warning("peer: pcp_reply() failed (%m)\n", err);
 		goto error;
@@ -139,8 +153,25 @@ static bool request_handler(struct udp_sock *us, const struct sa *src,
 }
 
 
+static bool exist_handler(const struct pcp_msg *msg)
+{
+	const struct pcp_peer *peer = &msg->pld.peer;
+	struct sa int_addr;
+
+	if (msg->hdr.opcode != PCP_PEER)
+		return false;
+
+	int_addr = msg->hdr.cli_addr;
+	sa_set_port(&int_addr, peer->map.int_port);
+
+	return mapping_find_peer(table, peer->map.proto, &int_addr,
+				 &peer->remote_addr) != NULL;
+}
+
+
 static struct repcpd_pcp peer = {
-	.reqh = request_handler,
+	.reqh   = request_handler,
+	.existh = exist_handler,
 };
 
 
@@ -4,27 +4,262 @@
  * Copyright (C) 2010 - 2016 Creytiv.com
  */
 
+#define _DEFAULT_SOURCE 1
+#include <pthread.h>
 #include <re.h>
 #include <repcpd.h>
 #include "pcpd.h"
 
 
-static struct list backendl;
+/*
+ * Backend jobs are executed by a dedicated worker thread, so that a slow
+ * backend never blocks the main loop. The completion handler of a job is
+ * called from the event loop of the thread that started the job, via
+ * the mqueue of that thread.
+ */
+
+struct job {
+	struct le le;        /* worker queue, protected by the mutex */
+	struct le le_main;   /* all jobs, thread of the job only */
+	struct mqueue *mq;   /* of the thread that started the job */
+	backend_work_h *workh;
+	backend_done_h *doneh;
+	void *arg;
+	int err;
+};
+
+
+static struct {
+	struct list backendl;
+	struct list jobl;        /* pending jobs (worker) */
+	pthread_t thread;
+	pthread_mutex_t mutex;   /* protects jobl, busy and run */
+	pthread_mutex_t be_lock; /* serializes all backend calls */
+	pthread_cond_t cond;
+	bool busy;
+	bool run;
+	bool started;
+} bex = {
+	.mutex   = PTHREAD_MUTEX_INITIALIZER,
+	.be_lock = PTHREAD_MUTEX_INITIALIZER,
+	.cond    = PTHREAD_COND_INITIALIZER,
+};
+
+/* the completions of the calling thread */
+static __thread struct {
+	struct list alljobl;     /* jobs not yet completed */
+	struct mqueue *mq;
+} thr;
+
+
+static void job_destructor(void *arg)
+{
+	struct job *job = arg;
+
+	list_unlink(&job->le_main);
+	mem_deref(job->arg);
+}
+
+
+static void *worker_thread(void *arg)
+{
+	(void)arg;
+
+	pthread_mutex_lock(&bex.mutex);
+
+	for (;;) {
+		struct job *job;
+
+		while (bex.run && !bex.jobl.head)
+			pthread_cond_wait(&bex.cond, &bex.mutex);
+
+		if (!bex.jobl.head)
+			break;
+
+		job = bex.jobl.head->data;
+		list_unlink(&job->le);
+		bex.busy = true;
+
+		pthread_mutex_unlock(&bex.mutex);
+
+		pthread_mutex_lock(&bex.be_lock);
+		job->err = job->workh(job->arg);
+		pthread_mutex_unlock(&bex.be_lock);
+
+		if (mqueue_push(job->mq, 0, job))
+			warning("backend: could not complete job\n");
+
+		pthread_mutex_lock(&bex.mutex);
+		bex.busy = false;
+		pthread_cond_broadcast(&bex.cond);
+	}
+
+	pthread_mutex_unlock(&bex.mutex);
+
+	return NULL;
+}
+
+
+static void mqueue_handler(int id, void *data, void *arg)
+{
+	struct job *job = data;
+	(void)id;
+	(void)arg;
+
+	list_unlink(&job->le_main);
+
+	if (job->doneh)
+		job->doneh(job->err, job->arg);
+
+	mem_deref(job);
+}
+
+
+/**
+ * Allocate the completion queue of the calling thread
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+int backend_thread_init(void)
+{
+	return mqueue_alloc(&thr.mq, mqueue_handler, NULL);
+}
+
+
+void backend_thread_close(void)
+{
+	/* completions that did not make it through the mqueue */
+	list_flush(&thr.alljobl);
+
+	thr.mq = mem_deref(thr.mq);
+}
+
+
+int backend_init(void)
+{
+	int err;
+
+	err = backend_thread_init();
+	if (err)
+		return err;
+
+	bex.run = true;
+
+	err = pthread_create(&bex.thread, NULL, worker_thread, NULL);
+	if (err) {
+		backend_thread_close();
+		return err;
+	}
+
+	bex.started = true;
+
+	return 0;
+}
+
+
+void backend_close(void)
+{
+	if (bex.started) {
+		pthread_mutex_lock(&bex.mutex);
+		bex.run = false;
+		pthread_cond_broadcast(&bex.cond);
+		pthread_mutex_unlock(&bex.mutex);
+
+		pthread_join(bex.thread, NULL);
+		bex.started = false;
+	}
+
+	backend_thread_close();
+}
 
 
 void backend_register(struct backend *be)
 {
-	list_append(&backendl, &be->le, be);
+	list_append(&bex.backendl, &be->le, be);
 }
 
 
 void backend_unregister(struct backend *be)
 {
+	/* the worker might still be using this backend */
+	backend_sync();
+
 	list_unlink(&be->le);
 }
 
 
 struct backend *backend_get(void)
 {
-	return list_ledata(backendl.head);
+	return list_ledata(bex.backendl.head);
+}
+
+
+/**
+ * Run a backend job in the worker thread
+ *
+ * @param workh Work handler, called from the worker thread
+ * @param doneh Completion handler, called from the calling thread
+ * @param arg   Handler argument (referenced until completion)
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+int backend_work(backend_work_h *workh, backend_done_h *doneh, void *arg)
+{
+	struct job *job;
+
+	if (!workh)
+		return EINVAL;
+
+	if (!bex.started || !thr.mq)
+		return ESRCH;
+
+	job = mem_zalloc(sizeof(*job), job_destructor);
+	if (!job)
+		return ENOMEM;
+
+	job->mq    = thr.mq;
+	job->workh = workh;
+	job->doneh = doneh;
+	job->arg   = mem_ref(arg);
+
+	list_append(&thr.alljobl, &job->le_main, job);
+
+	pthread_mutex_lock(&bex.mutex);
+	list_append(&bex.jobl, &job->le, job);
+	pthread_cond_signal(&bex.cond);
+	pthread_mutex_unlock(&bex.mutex);
+
+	return 0;
+}
+
+
+/**
+ * Wait until the worker thread has executed all pending jobs
+ *
+ * note: the completion handlers are still called from the main loop
+ */
+void backend_sync(void)
+{
+	if (!bex.started)
+		return;
+
+	pthread_mutex_lock(&bex.mutex);
+
+	while (bex.jobl.head || bex.busy)
+		pthread_cond_wait(&bex.cond, &bex.mutex);
+
+	pthread_mutex_unlock(&bex.mutex);
+}
+
+
+/* Synchronous backend calls from the main thread must hold this lock */
+void backend_lock(void)
+{
+	pthread_mutex_lock(&bex.be_lock);
+}
+
+
+void backend_unlock(void)
+{
+	pthread_mutex_unlock(&bex.be_lock);
 }
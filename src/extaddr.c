@@ -4,25 +4,96 @@
  * Copyright (C) 2010 - 2016 Creytiv.com
  */
 
+#define _DEFAULT_SOURCE 1
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
 #include <re.h>
 #include <repcpd.h>
 #include "pcpd.h"
 
 
+/*
+ * Every external address has a port allocator per protocol, which is
+ * allocated when the protocol is first used. The range of external
+ * ports is set with the "external_ports" config item.
+ *
+ * In pool mode ("external_pool yes") the ports of every address are
+ * split into blocks of "external_block" ports. A subscriber gets one
+ * block, on an address that is chosen by consistent hashing of the
+ * subscriber address, and all its mappings get a port in that block.
+ * Adding an address only moves the subscribers that hash to its points
+ * on the ring. A block is logged when it is assigned and when it is
+ * released, instead of every mapping.
+ *
+ * The port allocators are shared by the workers, and are locked when a
+ * port is assigned, taken or released. A port that is assigned is not
+ * taken until the mapping is created, so two workers may get the same
+ * port, and the second one fails to take it.
+ */
+
+enum {
+	PORT_MIN     = 1,
+	PORT_MAX     = 65535,
+	BLOCK_SIZE   = 512,
+	RING_VNODES  = 64,     /* points on the ring per address */
+	POOL_HASHSZ  = 1024,
+};
+
 struct extaddr {
 	struct le le;
 	struct sa addr;
 	char *ifname;
+	struct portmap *pmv[256];  /* by protocol */
+	struct portmap *blocks;    /* pool mode, block index + 1 */
+	struct block **blockv;     /* pool mode, by block index */
+};
+
+/* port block of a subscriber */
+struct block {
+	struct le he;
+	struct sa sub;             /* subscriber address */
+	struct extaddr *ea;
+	uint32_t idx;
+	uint16_t min;
+	uint32_t ports;            /* ports taken */
+	struct portmap *pmv[3];    /* TCP, UDP and other protocols */
+};
+
+struct vnode {
+	uint32_t hash;
+	struct extaddr *ea;
 };
 
 
 static struct list extaddrl;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static uint32_t port_min = PORT_MIN;
+static uint32_t port_max = PORT_MAX;
+
+static struct {
+	bool enabled;
+	uint32_t size;             /* ports per block */
+	uint32_t nblocks;          /* blocks per address */
+	struct vnode *ringv;       /* sorted by hash */
+	uint32_t ringc;
+	struct hash *subh;         /* blocks, by subscriber */
+	uint32_t blockc;
+} pool = {
+	.size = BLOCK_SIZE,
+};
 
 
 static void destructor(void *arg)
 {
 	struct extaddr *ea = arg;
+	size_t i;
 
+	for (i = 0; i < ARRAY_SIZE(ea->pmv); i++)
+		mem_deref(ea->pmv[i]);
+
+	mem_deref(ea->blocks);
+	mem_deref(ea->blockv);
 	mem_deref(ea->ifname);
 
 	list_unlink(&ea->le);
@@ -44,6 +115,19 @@ static int extaddr_add(const char *ifname, const struct sa *addr)
 	if (err)
 		goto out;
 
+	if (pool.enabled) {
+		err = portmap_alloc(&ea->blocks, 1, pool.nblocks);
+		if (err)
+			goto out;
+
+		ea->blockv = mem_zalloc(pool.nblocks * sizeof(*ea->blockv),
+					NULL);
+		if (!ea->blockv) {
+			err = ENOMEM;
+			goto out;
+		}
+	}
+
 	list_append(&extaddrl, &ea->le, ea);
 
 	debug("added external interface: %s with IP-address %j\n",
@@ -57,6 +141,351 @@ static int extaddr_add(const char *ifname, const struct sa *addr)
 }
 
 
+static size_t addr_put(uint8_t *p, const struct sa *sa)
+{
+	switch (sa_af(sa)) {
+
+	case AF_INET:
+		memcpy(p, &sa->u.in.sin_addr, 4);
+		return 4;
+
+	case AF_INET6:
+		memcpy(p, &sa->u.in6.sin6_addr, 16);
+		return 16;
+
+	default:
+		return 0;
+	}
+}
+
+
+static int vnode_cmp(const void *a, const void *b)
+{
+	const struct vnode *va = a, *vb = b;
+
+	if (va->hash == vb->hash)
+		return 0;
+
+	return va->hash < vb->hash ? -1 : 1;
+}
+
+
+static int ring_build(void)
+{
+	struct le *le;
+	uint32_t n = 0;
+
+	pool.ringv = mem_zalloc(list_count(&extaddrl) * RING_VNODES *
+				sizeof(*pool.ringv), NULL);
+	if (!pool.ringv)
+		return ENOMEM;
+
+	for (le = extaddrl.head; le; le = le->next) {
+
+		struct extaddr *ea = le->data;
+		uint8_t buf[4 + 16];
+		size_t len;
+		uint32_t v;
+
+		len = addr_put(&buf[4], &ea->addr);
+
+		for (v = 0; v < RING_VNODES; v++) {
+
+			memcpy(buf, &v, 4);
+
+			pool.ringv[n].hash = hash_joaat(buf, 4 + len);
+			pool.ringv[n].ea   = ea;
+			++n;
+		}
+	}
+
+	qsort(pool.ringv, n, sizeof(*pool.ringv), vnode_cmp);
+	pool.ringc = n;
+
+	return 0;
+}
+
+
+/* the first address of the family at or after the subscriber's point */
+static struct extaddr *ring_lookup(const struct sa *sub, int af)
+{
+	uint8_t buf[16];
+	uint32_t h, lo = 0, hi = pool.ringc, i;
+
+	h = hash_joaat(buf, addr_put(buf, sub));
+
+	while (lo < hi) {
+
+		const uint32_t mid = lo + (hi - lo) / 2;
+
+		if (pool.ringv[mid].hash < h)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	for (i = 0; i < pool.ringc; i++) {
+
+		struct extaddr *ea = pool.ringv[(lo + i) % pool.ringc].ea;
+
+		if (sa_af(&ea->addr) == af)
+			return ea;
+	}
+
+	return NULL;
+}
+
+
+static void block_destructor(void *arg)
+{
+	struct block *blk = arg;
+	size_t i;
+
+	info("extaddr: released block %j:%u-%u of %j\n", &blk->ea->addr,
+	     blk->min, blk->min + pool.size - 1, &blk->sub);
+
+	hash_unlink(&blk->he);
+	blk->ea->blockv[blk->idx] = NULL;
+	portmap_release(blk->ea->blocks, blk->idx + 1);
+	--pool.blockc;
+
+	for (i = 0; i < ARRAY_SIZE(blk->pmv); i++)
+		mem_deref(blk->pmv[i]);
+}
+
+
+static bool block_cmp_handler(struct le *le, void *arg)
+{
+	const struct block *blk = le->data;
+
+	return sa_cmp(&blk->sub, arg, SA_ADDR);
+}
+
+
+static struct block *block_find(const struct sa *sub)
+{
+	return list_ledata(hash_lookup(pool.subh, sa_hash(sub, SA_ADDR),
+				       block_cmp_handler, (void *)sub));
+}
+
+
+static int block_alloc(struct block **blkp, struct extaddr *ea,
+		       uint32_t idx, const struct sa *sub)
+{
+	struct block *blk;
+	int err;
+
+	err = portmap_take(ea->blocks, idx + 1);
+	if (err)
+		return err;
+
+	blk = mem_zalloc(sizeof(*blk), block_destructor);
+	if (!blk) {
+		portmap_release(ea->blocks, idx + 1);
+		return ENOMEM;
+	}
+
+	blk->sub = *sub;
+	blk->ea  = ea;
+	blk->idx = idx;
+	blk->min = port_min + idx * pool.size;
+
+	ea->blockv[idx] = blk;
+	hash_append(pool.subh, sa_hash(sub, SA_ADDR), &blk->he, blk);
+	++pool.blockc;
+
+	info("extaddr: assigned block %j:%u-%u to %j\n", &ea->addr,
+	     blk->min, blk->min + pool.size - 1, sub);
+
+	*blkp = blk;
+
+	return 0;
+}
+
+
+static struct portmap *block_portmap(struct block *blk, int proto)
+{
+	struct portmap **pmp;
+
+	switch (proto) {
+
+	case IPPROTO_TCP:
+		pmp = &blk->pmv[0];
+		break;
+
+	case IPPROTO_UDP:
+		pmp = &blk->pmv[1];
+		break;
+
+	default:
+		pmp = &blk->pmv[2];
+		break;
+	}
+
+	if (!*pmp && portmap_alloc(pmp, blk->min,
+				   blk->min + pool.size - 1))
+		return NULL;
+
+	return *pmp;
+}
+
+
+static int pool_assign(struct sa *ext_addr, int proto, uint16_t suggested,
+		       const struct sa *int_addr, int af)
+{
+	struct block *blk;
+	struct extaddr *ea;
+	struct sa sub;
+	uint16_t port, idx1;
+	int err;
+
+	if (!int_addr)
+		return EINVAL;
+
+	repcpd_subscriber(&sub, int_addr);
+
+	blk = block_find(&sub);
+	if (blk) {
+		struct portmap *pm = block_portmap(blk, proto);
+
+		if (!pm)
+			return ENOMEM;
+
+		err = portmap_pick(pm, &port, suggested);
+		if (err)
+			return err;
+
+		ea = blk->ea;
+	}
+	else {
+		/* the block is assigned when the port is reserved */
+		ea = ring_lookup(&sub, af != AF_UNSPEC ? af : sa_af(&sub));
+		if (!ea)
+			return EAFNOSUPPORT;
+
+		err = portmap_pick(ea->blocks, &idx1, 0);
+		if (err)
+			return err;
+
+		port = port_min + (idx1 - 1) * pool.size;
+
+		if (suggested >= port &&
+		    (uint32_t)(suggested - port) < pool.size)
+			port = suggested;
+		else
+			port += rand_u32() % pool.size;
+	}
+
+	*ext_addr = ea->addr;
+	sa_set_port(ext_addr, port);
+
+	return 0;
+}
+
+
+static int pool_reserve(struct extaddr *ea, const struct sa *ext_addr,
+			int proto, const struct sa *int_addr)
+{
+	const uint16_t port = sa_port(ext_addr);
+	struct block *blk;
+	struct portmap *pm;
+	struct sa sub;
+	uint32_t idx;
+	int err;
+
+	if (!int_addr)
+		return EINVAL;
+
+	if (port < port_min)
+		return ERANGE;
+
+	idx = (port - port_min) / pool.size;
+	if (idx >= pool.nblocks)
+		return ERANGE;
+
+	repcpd_subscriber(&sub, int_addr);
+
+	blk = ea->blockv[idx];
+	if (!blk) {
+		/* one block per subscriber */
+		if (block_find(&sub))
+			return EADDRINUSE;
+
+		err = block_alloc(&blk, ea, idx, &sub);
+		if (err)
+			return err;
+	}
+	else if (!sa_cmp(&blk->sub, &sub, SA_ADDR)) {
+		return EADDRINUSE;
+	}
+
+	pm = block_portmap(blk, proto);
+	err = pm ? portmap_take(pm, port) : ENOMEM;
+	if (err) {
+		if (!blk->ports)
+			mem_deref(blk);
+		return err;
+	}
+
+	++blk->ports;
+
+	return 0;
+}
+
+
+static void pool_release(struct extaddr *ea, const struct sa *ext_addr,
+			 int proto)
+{
+	const uint16_t port = sa_port(ext_addr);
+	struct block *blk;
+	uint32_t idx;
+
+	if (port < port_min)
+		return;
+
+	idx = (port - port_min) / pool.size;
+	if (idx >= pool.nblocks)
+		return;
+
+	blk = ea->blockv[idx];
+	if (!blk)
+		return;
+
+	portmap_release(block_portmap(blk, proto), port);
+
+	if (blk->ports && !--blk->ports)
+		mem_deref(blk);
+}
+
+
+static int pool_init(void)
+{
+	int err;
+
+	(void)conf_get_bool(_conf(), "external_pool", &pool.enabled);
+	if (!pool.enabled)
+		return 0;
+
+	(void)conf_get_u32(_conf(), "external_block", &pool.size);
+
+	if (!pool.size || pool.size > port_max - port_min + 1) {
+		warning("extaddr: illegal block size %u\n", pool.size);
+		return EINVAL;
+	}
+
+	pool.nblocks = (port_max - port_min + 1) / pool.size;
+
+	err = hash_alloc(&pool.subh, POOL_HASHSZ);
+	if (err)
+		return err;
+
+	info("extaddr: pool mode, %u blocks of %u ports per address\n",
+	     pool.nblocks, pool.size);
+
+	return 0;
+}
+
+
 static int listen_handler(const struct pl *interface, void *arg)
 {
 	char ifname[64];
@@ -92,10 +521,35 @@ int repcpd_extaddr_init(void)
 
 	list_init(&extaddrl);
 
+	err = conf_get_range(_conf(), "external_ports", &port_min, &port_max);
+	if (err && err != ENOENT) {
+		warning("extaddr: error parsing `external_ports' config"
+			" (%m)\n", err);
+		return err;
+	}
+
+	if (!port_min || port_min > port_max || port_max > PORT_MAX) {
+		warning("extaddr: illegal external ports %u-%u\n",
+			port_min, port_max);
+		return EINVAL;
+	}
+
+	info("extaddr: external ports are %u-%u\n", port_min, port_max);
+
+	err = pool_init();
+	if (err)
+		goto out;
+
 	err = conf_apply(_conf(), "external_interface", listen_handler, 0);
 	if (err)
 		goto out;
 
+	if (pool.enabled) {
+		err = ring_build();
+		if (err)
+			goto out;
+	}
+
  out:
 	if (err)
 		repcpd_extaddr_close();
@@ -106,11 +560,37 @@ int repcpd_extaddr_init(void)
 
 void repcpd_extaddr_close(void)
 {
+	struct le *le;
+	size_t i;
+
+	for (le = extaddrl.head; le; le = le->next) {
+
+		const struct extaddr *ea = le->data;
+
+		for (i = 0; i < ARRAY_SIZE(ea->pmv); i++) {
+
+			if (!portmap_count(ea->pmv[i]))
+				continue;
+
+			debug("extaddr: %j: %u %s ports still in use\n",
+			      &ea->addr, portmap_count(ea->pmv[i]),
+			      pcp_proto_name((int)i));
+		}
+	}
+
+	if (pool.blockc)
+		debug("extaddr: %u blocks still assigned\n", pool.blockc);
+
+	hash_flush(pool.subh);
+	pool.subh  = mem_deref(pool.subh);
+	pool.ringv = mem_deref(pool.ringv);
+	pool.ringc = 0;
+
 	list_flush(&extaddrl);
 }
 
 
-bool repcpd_extaddr_exist(const struct sa *addr)
+static struct extaddr *extaddr_lookup(const struct sa *addr)
 {
 	struct le *le;
 
@@ -119,29 +599,164 @@ bool repcpd_extaddr_exist(const struct sa *addr)
 		struct extaddr *ea = le->data;
 
 		if (sa_cmp(&ea->addr, addr, SA_ADDR))
-			return true;
+			return ea;
 	}
 
-	return false;
+	return NULL;
+}
+
+
+static struct portmap *portmap_get(struct extaddr *ea, int proto)
+{
+	struct portmap **pmp = &ea->pmv[proto & 0xff];
+
+	if (!*pmp && portmap_alloc(pmp, port_min, port_max))
+		return NULL;
+
+	return *pmp;
 }
 
 
-/* note: af is suggested AF -- AF_UNSPEC means any */
-int repcpd_extaddr_assign(struct sa *ext_addr, uint16_t int_port, int af)
+bool repcpd_extaddr_exist(const struct sa *addr)
 {
-	struct sa *ea;
+	return extaddr_lookup(addr) != NULL;
+}
+
+
+/**
+ * Check if the external addresses are a pool with port blocks
+ *
+ * @return True if pool mode is enabled
+ */
+bool repcpd_extaddr_pooled(void)
+{
+	return pool.enabled;
+}
 
-	if (!ext_addr || !int_port)
+
+/**
+ * Assign an external address and port. The port is taken when the
+ * mapping is created, see repcpd_extaddr_reserve().
+ *
+ * @param ext_addr  External address, if it is one of the external
+ *                  addresses it is kept. Returns the assigned address
+ * @param proto     Protocol
+ * @param suggested Suggested port, used if it is free
+ * @param int_addr  Internal address, of the subscriber
+ * @param af        Suggested AF -- AF_UNSPEC means any
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+int repcpd_extaddr_assign(struct sa *ext_addr, int proto,
+			  uint16_t suggested, const struct sa *int_addr,
+			  int af)
+{
+	struct extaddr *ea;
+	struct portmap *pm;
+	uint16_t port;
+	int err;
+
+	if (!ext_addr)
 		return EINVAL;
 
-	ea = repcpd_extaddr_find(af);
+	pthread_mutex_lock(&lock);
+
+	/* the subscriber's block decides the address */
+	if (pool.enabled) {
+		err = pool_assign(ext_addr, proto, suggested, int_addr, af);
+		goto out;
+	}
+
+	ea = extaddr_lookup(ext_addr);
+	if (!ea) {
+		struct sa *addr = repcpd_extaddr_find(af);
+
+		if (!addr) {
+			err = EAFNOSUPPORT;
+			goto out;
+		}
+
+		ea = extaddr_lookup(addr);
+	}
+
+	pm = portmap_get(ea, proto);
+	if (!pm) {
+		err = ENOMEM;
+		goto out;
+	}
+
+	err = portmap_pick(pm, &port, suggested);
+	if (err)
+		goto out;
+
+	*ext_addr = ea->addr;
+	sa_set_port(ext_addr, port);
+
+ out:
+	pthread_mutex_unlock(&lock);
+
+	return err;
+}
+
+
+/**
+ * Take the port of an external address
+ *
+ * @param ext_addr External address and port
+ * @param proto    Protocol
+ * @param int_addr Internal address, of the subscriber
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+int repcpd_extaddr_reserve(const struct sa *ext_addr, int proto,
+			   const struct sa *int_addr)
+{
+	struct extaddr *ea;
+	struct portmap *pm;
+	int err;
+
+	ea = extaddr_lookup(ext_addr);
 	if (!ea)
-		return EAFNOSUPPORT;
+		return ENOENT;
 
-	*ext_addr = *ea;
-	sa_set_port(ext_addr, int_port);
+	pthread_mutex_lock(&lock);
 
-	return 0;
+	if (pool.enabled) {
+		err = pool_reserve(ea, ext_addr, proto, int_addr);
+	}
+	else {
+		pm = portmap_get(ea, proto);
+		err = pm ? portmap_take(pm, sa_port(ext_addr)) : ENOMEM;
+	}
+
+	pthread_mutex_unlock(&lock);
+
+	return err;
+}
+
+
+/**
+ * Release the port of an external address
+ *
+ * @param ext_addr External address and port
+ * @param proto    Protocol
+ */
+void repcpd_extaddr_release(const struct sa *ext_addr, int proto)
+{
+	struct extaddr *ea;
+
+	ea = extaddr_lookup(ext_addr);
+	if (!ea)
+		return;
+
+	pthread_mutex_lock(&lock);
+
+	if (pool.enabled)
+		pool_release(ea, ext_addr, proto);
+	else
+		portmap_release(ea->pmv[proto & 0xff], sa_port(ext_addr));
+
+	pthread_mutex_unlock(&lock);
 }
 
 
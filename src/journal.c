@@ -0,0 +1,1416 @@
+/**
+ * @file journal.c  Persistent mapping state
+ *
+ * Copyright (C) 2010 - 2016 Creytiv.com
+ */
+
+#define _DEFAULT_SOURCE 1
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <re.h>
+#include <repcpd.h>
+#include "pcpd.h"
+
+
+/*
+ * The state of all mappings is kept in an append-only journal of create,
+ * refresh and delete records. Records are buffered and written with one
+ * fdatasync() per sync interval (group commit). When the journal has
+ * grown long enough, the state of all mapping tables is written to a
+ * snapshot and the journal is truncated.
+ *
+ * At startup the snapshot and the journal are replayed into memory, and
+ * handed over to the mapping tables as they are allocated. Both files
+ * start with a magic number, followed by records of the form
+ *
+ *     type (1) | length (2) | body (length) | crc32 (4)
+ *
+ * in network byte order. A torn record at the end is ignored.
+ *
+ * Each thread encodes its records into a buffer of its own. The journal
+ * thread swaps the buffers, and writes and syncs the records without
+ * holding any lock the threads need. The snapshot of a shard is taken
+ * by its worker, and written by the journal thread. The records that
+ * are collected while a compaction is running are held back, and start
+ * the new journal.
+ */
+
+
+enum {
+	JOURNAL_MAGIC   = 0x52504a31,   /* "RPJ1" */
+	JOURNAL_SYNC    = 100,          /* [ms] */
+	JOURNAL_COMPACT = 100000,       /* records between snapshots */
+	JOURNAL_BUFSZ   = 65536,
+	JOURNAL_FLUSH   = 1 << 20,      /* write at once above this size */
+	JOURNAL_HASHSZ  = 4096,         /* at least, see index_size() */
+	JOURNAL_HASHMAX = 1 << 22,
+	JOURNAL_RECSZ   = 64,           /* bytes of a create record, about */
+};
+
+enum compact_state {
+	COMPACT_IDLE = 0,
+	COMPACT_REQUEST,          /* records are to be held back */
+	COMPACT_HOLD,             /* records are held back */
+	COMPACT_SNAPSHOT,         /* snapshot is taken */
+};
+
+enum rec_type {
+	REC_EPOCH   = 1,
+	REC_CREATE  = 2,
+	REC_REFRESH = 3,
+	REC_DELETE  = 4,
+};
+
+
+/* records of one thread, not yet written */
+struct jbuf {
+	pthread_mutex_t lock;
+	struct mbuf *mb;
+	uint32_t recs;
+};
+
+static struct {
+	char dir[256];
+	char path[256];
+	char snap[256];
+	struct jbuf *bufv;        /* one per thread that writes records */
+	uint32_t bufc;
+	struct mbuf *spare;       /* swapped with a full buffer */
+	struct mbuf *held;        /* records held back, journal thread */
+	struct mbuf *snapmb;      /* snapshot to be written */
+	struct tmr tmr;           /* compaction */
+	struct hash *entries;     /* replayed state, until replay is done */
+	struct list tablel;       /* replayed state, by table */
+	uint64_t epoch;           /* replayed epoch start, 0 if none */
+	uint32_t sync;
+	uint32_t compact;
+	uint32_t recs;            /* records since the last snapshot */
+	uint32_t held_recs;
+	enum compact_state compact_state;
+	pthread_mutex_t lock;     /* protects the journal thread state */
+	pthread_cond_t cond;
+	pthread_t thread;
+	bool run;
+	bool kick;
+	int fd;
+} jnl = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.cond = PTHREAD_COND_INITIALIZER,
+	.fd = -1,
+};
+
+
+/*
+ * Encoding
+ */
+
+static int enc_str(struct mbuf *mb, const char *str)
+{
+	size_t len = str ? str_len(str) : 0;
+	int err;
+
+	if (len > 0xffff)
+		return EOVERFLOW;
+
+	err = mbuf_write_u16(mb, htons((uint16_t)len));
+	if (len)
+		err |= mbuf_write_mem(mb, (const uint8_t *)str, len);
+
+	return err;
+}
+
+
+static int enc_maddr(struct mbuf *mb, const struct maddr *ma)
+{
+	int err;
+
+	switch (ma->af) {
+
+	case 4:
+		err  = mbuf_write_u8(mb, 4);
+		err |= mbuf_write_mem(mb, ma->addr, 4);
+		break;
+
+	case 6:
+		err  = mbuf_write_u8(mb, 6);
+		err |= mbuf_write_mem(mb, ma->addr, 16);
+		break;
+
+	default:
+		return mbuf_write_u8(mb, 0);
+	}
+
+	err |= mbuf_write_u16(mb, htons(ma->port));
+
+	return err;
+}
+
+
+/* same encoding as enc_str() */
+static int enc_tag(struct mbuf *mb, const struct mapping *m)
+{
+	size_t start = mb->pos, len;
+	int err;
+
+	err  = mbuf_write_u16(mb, 0);
+	err |= mbuf_printf(mb, "%H", mapping_tag_print, m);
+	if (err)
+		return err;
+
+	len = mb->pos - start - 2;
+	if (len > 0xffff)
+		return EOVERFLOW;
+
+	mb->pos = start;
+	err = mbuf_write_u16(mb, htons((uint16_t)len));
+	mb->pos = start + 2 + len;
+
+	return err;
+}
+
+
+static int enc_key(struct mbuf *mb, const char *table,
+		   const struct mapping *m)
+{
+	int err;
+
+	err  = enc_str(mb, table);
+	err |= mbuf_write_u8(mb, m->opcode);
+	err |= mbuf_write_u8(mb, m->proto);
+	err |= enc_maddr(mb, &m->int_addr);
+	err |= enc_maddr(mb, &m->remote_addr);
+
+	return err;
+}
+
+
+static void rec_begin(struct mbuf *mb, enum rec_type type, size_t *start)
+{
+	*start = mb->pos;
+
+	(void)mbuf_write_u8(mb, type);
+	(void)mbuf_write_u16(mb, 0);  /* length, set by rec_end() */
+}
+
+
+static int rec_end(struct mbuf *mb, size_t start, int err)
+{
+	size_t len = mb->pos - start - 3;
+	uint32_t crc;
+
+	if (!err && len > 0xffff)
+		err = EOVERFLOW;
+
+	if (err) {
+		mb->pos = mb->end = start;
+		return err;
+	}
+
+	mb->pos = start + 1;
+	(void)mbuf_write_u16(mb, htons((uint16_t)len));
+	mb->pos = start + 3 + len;
+
+	crc = (uint32_t)crc32(0, mb->buf + start, (uint32_t)(3 + len));
+
+	return mbuf_write_u32(mb, htonl(crc));
+}
+
+
+static int enc_epoch(struct mbuf *mb)
+{
+	size_t start;
+
+	rec_begin(mb, REC_EPOCH, &start);
+
+	return rec_end(mb, start,
+		       mbuf_write_u64(mb, sys_htonll(repcpd_epoch_start())));
+}
+
+
+/**
+ * Encode a create record, for the journal or a snapshot
+ *
+ * @param mb      Buffer to write to
+ * @param table   Name of the mapping table
+ * @param m       Mapping
+ * @param expires Expiry time, in [seconds since the Epoch]
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+int journal_encode(struct mbuf *mb, const char *table,
+		   const struct mapping *m, uint64_t expires)
+{
+	size_t start;
+	int err;
+
+	if (!mb || !table || !m)
+		return EINVAL;
+
+	rec_begin(mb, REC_CREATE, &start);
+
+	err  = enc_key(mb, table, m);
+	err |= enc_maddr(mb, &m->ext_addr);
+	err |= mbuf_write_mem(mb, m->nonce, PCP_NONCE_SZ);
+	err |= mbuf_write_u64(mb, sys_htonll(expires));
+	err |= enc_str(mb, ifname_lookup(m->ifidx));
+	err |= enc_str(mb, m->descr);
+	err |= enc_tag(mb, m);
+
+	return rec_end(mb, start, err);
+}
+
+
+/*
+ * Decoding
+ */
+
+static int dec_str(struct mbuf *mb, char **strp)
+{
+	struct pl pl;
+	uint16_t len;
+	int err;
+
+	if (mbuf_get_left(mb) < 2)
+		return EBADMSG;
+
+	len = ntohs(mbuf_read_u16(mb));
+	if (mbuf_get_left(mb) < len)
+		return EBADMSG;
+
+	if (!len)
+		return 0;
+
+	pl.p = (const char *)mbuf_buf(mb);
+	pl.l = len;
+
+	err = pl_strdup(strp, &pl);
+	mb->pos += len;
+
+	return err;
+}
+
+
+static int dec_sa(struct mbuf *mb, struct sa *sa)
+{
+	uint8_t addr[16];
+	uint32_t v4;
+	uint16_t port;
+
+	if (mbuf_get_left(mb) < 1)
+		return EBADMSG;
+
+	switch (mbuf_read_u8(mb)) {
+
+	case 0:
+		sa_init(sa, AF_UNSPEC);
+		return 0;
+
+	case 4:
+		if (mbuf_get_left(mb) < 6)
+			return EBADMSG;
+
+		(void)mbuf_read_mem(mb, (uint8_t *)&v4, 4);
+		port = ntohs(mbuf_read_u16(mb));
+		sa_set_in(sa, ntohl(v4), port);
+		return 0;
+
+	case 6:
+		if (mbuf_get_left(mb) < 18)
+			return EBADMSG;
+
+		(void)mbuf_read_mem(mb, addr, 16);
+		port = ntohs(mbuf_read_u16(mb));
+		sa_set_in6(sa, addr, port);
+		return 0;
+
+	default:
+		return EBADMSG;
+	}
+}
+
+
+/*
+ * The replayed entries of a table. They are split by shard on the first
+ * replay, so that every worker only walks its own entries.
+ */
+struct jtable {
+	struct le le;
+	char *name;
+	struct list entryl;
+	struct list *shardv;      /* by worker, after the first replay */
+	uint32_t shardc;
+};
+
+
+static void jtable_destructor(void *arg)
+{
+	struct jtable *jt = arg;
+
+	/* the entries are owned by the hash */
+	list_unlink(&jt->le);
+	mem_deref(jt->shardv);
+	mem_deref(jt->name);
+}
+
+
+static struct jtable *jtable_get(const char *name)
+{
+	struct jtable *jt;
+	struct le *le;
+
+	for (le = jnl.tablel.head; le; le = le->next) {
+
+		jt = le->data;
+
+		if (0 == str_cmp(jt->name, name))
+			return jt;
+	}
+
+	jt = mem_zalloc(sizeof(*jt), jtable_destructor);
+	if (!jt)
+		return NULL;
+
+	if (str_dup(&jt->name, name)) {
+		mem_deref(jt);
+		return NULL;
+	}
+
+	list_append(&jnl.tablel, &jt->le, jt);
+
+	return jt;
+}
+
+
+static void entry_destructor(void *arg)
+{
+	struct journal_entry *je = arg;
+
+	hash_unlink(&je->le);
+	list_unlink(&je->tle);
+	mem_deref(je->table);
+	mem_deref(je->ext_ifname);
+	mem_deref(je->descr);
+	mem_deref(je->tag);
+}
+
+
+static uint32_t entry_key(const struct journal_entry *je)
+{
+	uint32_t v;
+
+	v = hash_joaat_str(je->table) + je->proto +
+		sa_hash(&je->int_addr, SA_ALL);
+
+	if (sa_isset(&je->remote_addr, SA_ALL))
+		v += sa_hash(&je->remote_addr, SA_ALL);
+
+	return v;
+}
+
+
+static bool sa_equal(const struct sa *a, const struct sa *b)
+{
+	if (!sa_isset(a, SA_ADDR) && !sa_isset(b, SA_ADDR))
+		return true;
+
+	return sa_cmp(a, b, SA_ALL);
+}
+
+
+static bool entry_cmp_handler(struct le *le, void *arg)
+{
+	const struct journal_entry *je = le->data;
+	const struct journal_entry *key = arg;
+
+	return je->opcode == key->opcode && je->proto == key->proto &&
+		0 == str_cmp(je->table, key->table) &&
+		sa_cmp(&je->int_addr, &key->int_addr, SA_ALL) &&
+		sa_equal(&je->remote_addr, &key->remote_addr);
+}
+
+
+static struct journal_entry *entry_find(const struct journal_entry *key)
+{
+	return list_ledata(hash_lookup(jnl.entries, entry_key(key),
+				       entry_cmp_handler, (void *)key));
+}
+
+
+static int dec_key(struct mbuf *mb, struct journal_entry *je)
+{
+	int err;
+
+	err = dec_str(mb, &je->table);
+	if (err)
+		return err;
+
+	if (!je->table || mbuf_get_left(mb) < 2)
+		return EBADMSG;
+
+	je->opcode = mbuf_read_u8(mb);
+	je->proto  = mbuf_read_u8(mb);
+
+	err = dec_sa(mb, &je->int_addr);
+	if (err)
+		return err;
+
+	return dec_sa(mb, &je->remote_addr);
+}
+
+
+static int rec_apply(enum rec_type type, struct mbuf *mb)
+{
+	struct journal_entry *je, *old;
+	struct jtable *jt;
+	int err;
+
+	if (type == REC_EPOCH) {
+
+		if (mbuf_get_left(mb) < 8)
+			return EBADMSG;
+
+		jnl.epoch = sys_ntohll(mbuf_read_u64(mb));
+		return 0;
+	}
+
+	je = mem_zalloc(sizeof(*je), entry_destructor);
+	if (!je)
+		return ENOMEM;
+
+	err = dec_key(mb, je);
+	if (err)
+		goto out;
+
+	old = entry_find(je);
+
+	switch (type) {
+
+	case REC_CREATE:
+		err = dec_sa(mb, &je->ext_addr);
+		if (err)
+			break;
+
+		if (mbuf_get_left(mb) < PCP_NONCE_SZ + 8) {
+			err = EBADMSG;
+			break;
+		}
+
+		(void)mbuf_read_mem(mb, je->nonce, PCP_NONCE_SZ);
+		je->expires = sys_ntohll(mbuf_read_u64(mb));
+
+		err  = dec_str(mb, &je->ext_ifname);
+		err |= dec_str(mb, &je->descr);
+		err |= dec_str(mb, &je->tag);
+		if (err)
+			break;
+
+		jt = jtable_get(je->table);
+		if (!jt) {
+			err = ENOMEM;
+			break;
+		}
+
+		mem_deref(old);
+		hash_append(jnl.entries, entry_key(je), &je->le, je);
+		list_append(&jt->entryl, &je->tle, je);
+		return 0;
+
+	case REC_REFRESH:
+		if (mbuf_get_left(mb) < 8) {
+			err = EBADMSG;
+			break;
+		}
+
+		if (old)
+			old->expires = sys_ntohll(mbuf_read_u64(mb));
+		break;
+
+	case REC_DELETE:
+		mem_deref(old);
+		break;
+
+	default:
+		/* unknown records are skipped */
+		break;
+	}
+
+ out:
+	mem_deref(je);
+
+	return err;
+}
+
+
+static int rec_decode(struct mbuf *mb)
+{
+	size_t start = mb->pos;
+	struct mbuf body;
+	uint16_t len;
+	uint8_t type;
+	uint32_t crc;
+
+	if (mbuf_get_left(mb) < 3)
+		return ENODATA;
+
+	type = mbuf_read_u8(mb);
+	len  = ntohs(mbuf_read_u16(mb));
+
+	if (mbuf_get_left(mb) < (size_t)len + 4)
+		return ENODATA;
+
+	crc = (uint32_t)crc32(0, mb->buf + start, (uint32_t)(3 + len));
+
+	mbuf_init(&body);
+	body.buf  = mb->buf + start + 3;
+	body.size = body.end = len;
+
+	mb->pos += len;
+
+	if (ntohl(mbuf_read_u32(mb)) != crc)
+		return EBADMSG;
+
+	return rec_apply(type, &body);
+}
+
+
+static int file_load(const char *path)
+{
+	struct mbuf *mb = NULL;
+	struct stat st;
+	uint32_t recs = 0;
+	ssize_t n;
+	int fd, err = 0;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return errno == ENOENT ? 0 : errno;
+
+	if (fstat(fd, &st) < 0) {
+		err = errno;
+		goto out;
+	}
+
+	if (!st.st_size)
+		goto out;
+
+	mb = mbuf_alloc((size_t)st.st_size);
+	if (!mb) {
+		err = ENOMEM;
+		goto out;
+	}
+
+	while (mb->end < (size_t)st.st_size) {
+
+		n = read(fd, mb->buf + mb->end, st.st_size - mb->end);
+		if (n < 0) {
+			err = errno;
+			goto out;
+		}
+		if (n == 0)
+			break;
+
+		mb->end += n;
+	}
+
+	if (mbuf_get_left(mb) < 4 ||
+	    ntohl(mbuf_read_u32(mb)) != JOURNAL_MAGIC) {
+		warning("journal: %s: bad magic, ignored\n", path);
+		goto out;
+	}
+
+	while (mbuf_get_left(mb)) {
+
+		err = rec_decode(mb);
+		if (err) {
+			warning("journal: %s: stopped at offset %zu (%m)\n",
+				path, mb->pos, err);
+			err = 0;
+			break;
+		}
+
+		++recs;
+	}
+
+	debug("journal: %s: %u records\n", path, recs);
+
+ out:
+	mem_deref(mb);
+	(void)close(fd);
+
+	return err;
+}
+
+
+/*
+ * Writing
+ */
+
+static int write_all(int fd, const uint8_t *buf, size_t len)
+{
+	while (len) {
+
+		ssize_t n = write(fd, buf, len);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return errno;
+		}
+
+		buf += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+
+/*
+ * Append to the journal. A failed write is cut off again, so that no
+ * torn record is left in front of the records that follow -- the replay
+ * stops at the first record that does not check out.
+ */
+static int journal_append(const uint8_t *buf, size_t len)
+{
+	off_t off;
+	int err;
+
+	off = lseek(jnl.fd, 0, SEEK_END);
+	if (off < 0)
+		return errno;
+
+	err = write_all(jnl.fd, buf, len);
+	if (err && ftruncate(jnl.fd, off) < 0)
+		warning("journal: could not cut off a failed write to %s"
+			" (%m)\n", jnl.path, errno);
+
+	return err;
+}
+
+
+/*
+ * Take the records of all threads, and swap their buffers with the
+ * spare one. The records are written to the journal, or held back while
+ * a compaction is running or after a failed write.
+ *
+ * note: called by the journal thread, or when it is not running
+ */
+static int journal_collect(bool hold, uint32_t *recs, bool *written)
+{
+	uint32_t i;
+	int err = 0;
+
+	/* the records that were held back go first */
+	if (!hold && jnl.held->end) {
+		err = journal_append(jnl.held->buf, jnl.held->end);
+		*written = true;
+		if (err)
+			hold = true;
+		else
+			mbuf_rewind(jnl.held);
+	}
+
+	for (i = 0; i < jnl.bufc; i++) {
+
+		struct jbuf *jb = &jnl.bufv[i];
+		struct mbuf *mb;
+
+		pthread_mutex_lock(&jb->lock);
+		mb = jb->mb;
+		jb->mb = jnl.spare;
+		*recs += jb->recs;
+		jb->recs = 0;
+		pthread_mutex_unlock(&jb->lock);
+
+		jnl.spare = mb;
+
+		if (!mb->end)
+			continue;
+
+		if (!hold) {
+			err = journal_append(mb->buf, mb->end);
+			*written = true;
+			hold = err != 0;
+		}
+
+		if (hold && mbuf_write_mem(jnl.held, mb->buf, mb->end))
+			err = ENOMEM;
+
+		mbuf_rewind(mb);
+	}
+
+	return err;
+}
+
+
+/* note: called by the journal thread, or when it is not running */
+static int journal_flush(bool hold)
+{
+	bool written = false;
+	uint32_t recs = 0;
+	int err;
+
+	err = journal_collect(hold, &recs, &written);
+	if (!err && written && fdatasync(jnl.fd) < 0)
+		err = errno;
+
+	pthread_mutex_lock(&jnl.lock);
+	if (hold) {
+		jnl.held_recs += recs;
+	}
+	else {
+		jnl.recs += recs;
+		if (!jnl.held->end) {
+			jnl.recs += jnl.held_recs;
+			jnl.held_recs = 0;
+		}
+	}
+	pthread_mutex_unlock(&jnl.lock);
+
+	if (err)
+		warning("journal: write to %s failed (%m)\n", jnl.path, err);
+
+	return err;
+}
+
+
+/* encode a snapshot of the current state, in the owning threads */
+static int snapshot_encode(struct mbuf **mbp)
+{
+	struct mbuf *mb;
+	int err;
+
+	mb = mbuf_alloc(JOURNAL_BUFSZ);
+	if (!mb)
+		return ENOMEM;
+
+	err  = mbuf_write_u32(mb, htonl(JOURNAL_MAGIC));
+	err |= enc_epoch(mb);
+	err |= mapping_snapshot(mb);
+	if (err)
+		mem_deref(mb);
+	else
+		*mbp = mb;
+
+	return err;
+}
+
+
+/* the rename of the snapshot is only durable with its directory */
+static int dir_sync(void)
+{
+	int fd, err = 0;
+
+	fd = open(jnl.dir, O_RDONLY | O_DIRECTORY);
+	if (fd < 0)
+		return errno;
+
+	if (fsync(fd) < 0)
+		err = errno;
+
+	(void)close(fd);
+
+	return err;
+}
+
+
+static int snapshot_write(const struct mbuf *mb)
+{
+	char tmp[268];
+	int fd, err;
+
+	re_snprintf(tmp, sizeof(tmp), "%s.tmp", jnl.snap);
+
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (fd < 0)
+		return errno;
+
+	err = write_all(fd, mb->buf, mb->end);
+	if (!err && fdatasync(fd) < 0)
+		err = errno;
+
+	(void)close(fd);
+
+	if (!err && rename(tmp, jnl.snap) < 0)
+		err = errno;
+
+	if (!err)
+		err = dir_sync();
+
+	return err;
+}
+
+
+/*
+ * Replace the journal with a snapshot. The new journal starts with the
+ * records held back since the compaction was started -- some of them
+ * are in the snapshot already, and replaying them again gives the same
+ * state. If the snapshot can not be written, they are appended to the
+ * old journal.
+ *
+ * note: called by the journal thread, or when it is not running
+ */
+static int journal_restart(const struct mbuf *snap)
+{
+	struct mbuf *mb = NULL;
+	bool restarted = false;
+	int err;
+
+	err = snapshot_write(snap);
+	if (err) {
+		warning("journal: could not write snapshot %s (%m)\n",
+			jnl.snap, err);
+		goto out;
+	}
+
+	mb = mbuf_alloc(32);
+	if (!mb) {
+		err = ENOMEM;
+		goto out;
+	}
+
+	err  = mbuf_write_u32(mb, htonl(JOURNAL_MAGIC));
+	err |= enc_epoch(mb);
+	if (err)
+		goto out;
+
+	if (ftruncate(jnl.fd, 0) < 0) {
+		err = errno;
+		warning("journal: could not truncate %s (%m)\n",
+			jnl.path, err);
+		goto out;
+	}
+
+	restarted = true;
+
+	err = journal_append(mb->buf, mb->end);
+
+ out:
+	/* else they are written with the next records */
+	if (!err && jnl.held->end) {
+		err = journal_append(jnl.held->buf, jnl.held->end);
+		if (!err)
+			mbuf_rewind(jnl.held);
+	}
+	if (!err && fdatasync(jnl.fd) < 0)
+		err = errno;
+
+	pthread_mutex_lock(&jnl.lock);
+	if (restarted)
+		jnl.recs = 0;
+	if (!jnl.held->end) {
+		jnl.recs += jnl.held_recs;
+		jnl.held_recs = 0;
+	}
+	jnl.compact_state = COMPACT_IDLE;
+	pthread_mutex_unlock(&jnl.lock);
+
+	mem_deref(mb);
+
+	return err;
+}
+
+
+/*
+ * The journal thread writes and syncs the records of all threads, once
+ * per sync interval or when a buffer is full, and writes the snapshots.
+ */
+static void *journal_thread(void *arg)
+{
+	(void)arg;
+
+	pthread_mutex_lock(&jnl.lock);
+
+	while (jnl.run) {
+
+		struct mbuf *snap;
+		struct timespec ts;
+		bool hold;
+
+		if (!jnl.kick) {
+			(void)clock_gettime(CLOCK_REALTIME, &ts);
+			ts.tv_sec  += jnl.sync / 1000;
+			ts.tv_nsec += (long)(jnl.sync % 1000) * 1000000;
+			if (ts.tv_nsec >= 1000000000) {
+				++ts.tv_sec;
+				ts.tv_nsec -= 1000000000;
+			}
+
+			(void)pthread_cond_timedwait(&jnl.cond, &jnl.lock,
+						     &ts);
+		}
+
+		/* all records collected from now on are held back */
+		if (jnl.compact_state == COMPACT_REQUEST)
+			jnl.compact_state = COMPACT_HOLD;
+
+		hold = jnl.compact_state != COMPACT_IDLE;
+		snap = jnl.snapmb;
+		jnl.snapmb = NULL;
+		jnl.kick = false;
+
+		pthread_mutex_unlock(&jnl.lock);
+
+		(void)journal_flush(hold);
+
+		if (snap) {
+			(void)journal_restart(snap);
+			mem_deref(snap);
+		}
+
+		pthread_mutex_lock(&jnl.lock);
+	}
+
+	pthread_mutex_unlock(&jnl.lock);
+
+	return NULL;
+}
+
+
+/* note: called with the lock */
+static void kick(void)
+{
+	jnl.kick = true;
+	pthread_cond_signal(&jnl.cond);
+}
+
+
+/*
+ * A compaction is requested from the journal thread, which then holds
+ * back the records it collects. Only after that the snapshot is taken,
+ * so no record that is missing in the snapshot is truncated away.
+ */
+static void compact_handler(void *arg)
+{
+	struct mbuf *snap = NULL;
+	bool encode = false;
+	int err;
+	(void)arg;
+
+	tmr_start(&jnl.tmr, jnl.sync, compact_handler, NULL);
+
+	pthread_mutex_lock(&jnl.lock);
+
+	switch (jnl.compact_state) {
+
+	case COMPACT_IDLE:
+		if (jnl.recs + jnl.held_recs < jnl.compact)
+			break;
+		jnl.compact_state = COMPACT_REQUEST;
+		kick();
+		break;
+
+	case COMPACT_HOLD:
+		jnl.compact_state = COMPACT_SNAPSHOT;
+		encode = true;
+		break;
+
+	default:
+		break;
+	}
+
+	pthread_mutex_unlock(&jnl.lock);
+
+	if (!encode)
+		return;
+
+	/* the shards are encoded by their workers */
+	err = snapshot_encode(&snap);
+	if (err)
+		warning("journal: could not encode snapshot (%m)\n", err);
+
+	pthread_mutex_lock(&jnl.lock);
+	if (snap)
+		jnl.snapmb = snap;
+	else
+		jnl.compact_state = COMPACT_IDLE;
+	kick();
+	pthread_mutex_unlock(&jnl.lock);
+}
+
+
+/* get the buffer of the calling thread, locked */
+static struct jbuf *jbuf_get(void)
+{
+	struct jbuf *jb;
+
+	if (jnl.fd < 0 || worker_self() >= jnl.bufc)
+		return NULL;
+
+	jb = &jnl.bufv[worker_self()];
+
+	pthread_mutex_lock(&jb->lock);
+
+	return jb;
+}
+
+
+/* unlock the buffer, the journal thread is woken when it is full */
+static void jbuf_put(struct jbuf *jb, int err)
+{
+	bool due = false;
+
+	if (err) {
+		warning("journal: could not encode record (%m)\n", err);
+	}
+	else {
+		++jb->recs;
+		due = jb->mb->end >= JOURNAL_FLUSH;
+	}
+
+	pthread_mutex_unlock(&jb->lock);
+
+	if (!due)
+		return;
+
+	pthread_mutex_lock(&jnl.lock);
+	kick();
+	pthread_mutex_unlock(&jnl.lock);
+}
+
+
+void journal_create(const char *table, const struct mapping *m,
+		    uint64_t expires)
+{
+	struct jbuf *jb;
+
+	if (!table || !m)
+		return;
+
+	jb = jbuf_get();
+	if (!jb)
+		return;
+
+	jbuf_put(jb, journal_encode(jb->mb, table, m, expires));
+}
+
+
+void journal_refresh(const char *table, const struct mapping *m,
+		     uint64_t expires)
+{
+	struct jbuf *jb;
+	size_t start;
+	int err;
+
+	if (!table || !m)
+		return;
+
+	jb = jbuf_get();
+	if (!jb)
+		return;
+
+	rec_begin(jb->mb, REC_REFRESH, &start);
+
+	err  = enc_key(jb->mb, table, m);
+	err |= mbuf_write_u64(jb->mb, sys_htonll(expires));
+
+	jbuf_put(jb, rec_end(jb->mb, start, err));
+}
+
+
+void journal_delete(const char *table, const struct mapping *m)
+{
+	struct jbuf *jb;
+	size_t start;
+
+	if (!table || !m)
+		return;
+
+	jb = jbuf_get();
+	if (!jb)
+		return;
+
+	rec_begin(jb->mb, REC_DELETE, &start);
+
+	jbuf_put(jb, rec_end(jb->mb, start, enc_key(jb->mb, table, m)));
+}
+
+
+/* note: called from the worker of the first replay of the table */
+static int jtable_split(struct jtable *jt)
+{
+	const uint32_t n = worker_count();
+	struct le *le;
+
+	jt->shardv = mem_zalloc(n * sizeof(*jt->shardv), NULL);
+	if (!jt->shardv)
+		return ENOMEM;
+
+	jt->shardc = n;
+
+	while ((le = list_head(&jt->entryl))) {
+
+		struct journal_entry *je = le->data;
+		uint32_t i = worker_shard(&je->int_addr);
+
+		list_unlink(&je->tle);
+		list_append(&jt->shardv[i < n ? i : 0], &je->tle, je);
+	}
+
+	return 0;
+}
+
+
+/**
+ * Hand over the replayed mappings of a table, of the shard of the calling
+ * worker. The mappings that are not claimed by the handler are kept.
+ *
+ * @param table Name of the mapping table
+ * @param h     Handler called for each mapping
+ * @param arg   Handler argument
+ */
+void journal_replay(const char *table, journal_replay_h *h, void *arg)
+{
+	struct jtable *jt = NULL;
+	struct le *le;
+
+	if (!jnl.entries || !table || !h)
+		return;
+
+	for (le = jnl.tablel.head; le && !jt; le = le->next) {
+
+		if (0 == str_cmp(((struct jtable *)le->data)->name, table))
+			jt = le->data;
+	}
+
+	if (!jt)
+		return;
+
+	if (!jt->shardv && jtable_split(jt))
+		return;
+
+	if (worker_self() >= jt->shardc)
+		return;
+
+	le = jt->shardv[worker_self()].head;
+
+	while (le) {
+
+		struct journal_entry *je = le->data;
+
+		le = le->next;
+
+		if (h(je, arg))
+			mem_deref(je);
+	}
+}
+
+
+/* drop the replayed state */
+static void entries_flush(void)
+{
+	if (!jnl.entries)
+		return;
+
+	hash_flush(jnl.entries);
+	jnl.entries = mem_deref(jnl.entries);
+	list_flush(&jnl.tablel);
+}
+
+
+/* the number of hash buckets, from the size of the files to load */
+static uint32_t index_size(void)
+{
+	const char *pathv[2] = {jnl.snap, jnl.path};
+	uint64_t sz = 0;
+	uint32_t n = JOURNAL_HASHSZ;
+	struct stat st;
+	size_t i;
+
+	for (i = 0; i < ARRAY_SIZE(pathv); i++) {
+
+		if (0 == stat(pathv[i], &st))
+			sz += (uint64_t)st.st_size;
+	}
+
+	while (n < JOURNAL_HASHMAX && (uint64_t)n * JOURNAL_RECSZ < sz)
+		n <<= 1;
+
+	return n;
+}
+
+
+static void bufv_destructor(void *arg)
+{
+	struct jbuf *bufv = arg;
+	uint32_t i;
+
+	for (i = 0; i < jnl.bufc; i++) {
+		pthread_mutex_destroy(&bufv[i].lock);
+		mem_deref(bufv[i].mb);
+	}
+}
+
+
+static int bufv_alloc(void)
+{
+	uint32_t i, n = worker_count();
+
+	jnl.bufv = mem_zalloc(n * sizeof(*jnl.bufv), bufv_destructor);
+	if (!jnl.bufv)
+		return ENOMEM;
+
+	for (i = 0; i < n; i++) {
+
+		jnl.bufv[i].mb = mbuf_alloc(JOURNAL_BUFSZ);
+		if (!jnl.bufv[i].mb)
+			return ENOMEM;
+
+		pthread_mutex_init(&jnl.bufv[i].lock, NULL);
+		jnl.bufc = i + 1;
+	}
+
+	jnl.spare = mbuf_alloc(JOURNAL_BUFSZ);
+	jnl.held  = mbuf_alloc(JOURNAL_BUFSZ);
+	if (!jnl.spare || !jnl.held)
+		return ENOMEM;
+
+	return 0;
+}
+
+
+/**
+ * Called when all mapping tables are allocated. The replayed state that
+ * was not claimed is dropped, a new snapshot is written, and the journal
+ * thread is started.
+ */
+void journal_replay_done(void)
+{
+	struct mbuf *snap = NULL;
+	int err;
+
+	if (!jnl.path[0])
+		return;
+
+	entries_flush();
+
+	err = bufv_alloc();
+	if (err)
+		goto out;
+
+	jnl.fd = open(jnl.path, O_WRONLY | O_CREAT | O_APPEND, 0600);
+	if (jnl.fd < 0) {
+		err = errno;
+		warning("journal: could not open %s (%m)\n", jnl.path, err);
+		goto out;
+	}
+
+	/* the journal thread is not running yet */
+	err = snapshot_encode(&snap);
+	if (!err)
+		err = journal_restart(snap);
+	if (err)
+		goto out;
+
+	jnl.run = true;
+	err = pthread_create(&jnl.thread, NULL, journal_thread, NULL);
+	if (err) {
+		jnl.run = false;
+		warning("journal: could not start thread (%m)\n", err);
+		goto out;
+	}
+
+	tmr_start(&jnl.tmr, jnl.sync, compact_handler, NULL);
+
+	info("journal: writing to %s\n", jnl.path);
+
+ out:
+	mem_deref(snap);
+
+	if (err && jnl.fd >= 0) {
+		(void)close(jnl.fd);
+		jnl.fd = -1;
+	}
+}
+
+
+static bool count_handler(struct le *le, void *arg)
+{
+	uint32_t *n = arg;
+	(void)le;
+
+	++*n;
+
+	return false;
+}
+
+
+int journal_init(void)
+{
+	char dir[256];
+	uint32_t n = 0;
+	uint64_t now = (uint64_t)time(NULL);
+	int err;
+
+	if (conf_get_str(_conf(), "journal_path", dir, sizeof(dir)))
+		return 0;
+
+	jnl.sync    = JOURNAL_SYNC;
+	jnl.compact = JOURNAL_COMPACT;
+	(void)conf_get_u32(_conf(), "journal_sync", &jnl.sync);
+	(void)conf_get_u32(_conf(), "journal_compact", &jnl.compact);
+
+	str_ncpy(jnl.dir, dir, sizeof(jnl.dir));
+	re_snprintf(jnl.path, sizeof(jnl.path), "%s/journal", dir);
+	re_snprintf(jnl.snap, sizeof(jnl.snap), "%s/snapshot", dir);
+
+	/* about one entry per bucket */
+	err = hash_alloc(&jnl.entries, index_size());
+	if (err)
+		return err;
+
+	/* the journal holds the changes made after the snapshot */
+	err = file_load(jnl.snap);
+	if (!err)
+		err = file_load(jnl.path);
+	if (err) {
+		warning("journal: could not load %s (%m)\n", dir, err);
+		return err;
+	}
+
+	/* continue the epoch of the previous instance */
+	if (jnl.epoch && jnl.epoch <= now)
+		repcpd_epoch_set(jnl.epoch);
+
+	(void)hash_apply(jnl.entries, count_handler, &n);
+
+	info("journal: replayed %u mappings from %s\n", n, dir);
+
+	return 0;
+}
+
+
+void journal_close(void)
+{
+	tmr_cancel(&jnl.tmr);
+
+	if (jnl.run) {
+		pthread_mutex_lock(&jnl.lock);
+		jnl.run = false;
+		pthread_cond_signal(&jnl.cond);
+		pthread_mutex_unlock(&jnl.lock);
+
+		pthread_join(jnl.thread, NULL);
+	}
+
+	/* a snapshot not written yet is dropped, with the records kept */
+	jnl.snapmb = mem_deref(jnl.snapmb);
+
+	if (jnl.fd >= 0) {
+		(void)journal_flush(false);
+		(void)close(jnl.fd);
+		jnl.fd = -1;
+	}
+
+	entries_flush();
+
+	jnl.bufv  = mem_deref(jnl.bufv);
+	jnl.bufc  = 0;
+	jnl.spare = mem_deref(jnl.spare);
+	jnl.held  = mem_deref(jnl.held);
+}
@@ -77,6 +77,19 @@ uint32_t repcpd_epoch_time(void)
 }
 
 
+uint64_t repcpd_epoch_start(void)
+{
+	return (uint64_t)start_time;
+}
+
+
+/* continue the epoch of a previous instance */
+void repcpd_epoch_set(uint64_t start)
+{
+	start_time = (time_t)start;
+}
+
+
 static void usage(void)
 {
 	(void)re_fprintf(stderr, "usage: repcpd [-dhn] [-f <file>]\n");
@@ -154,6 +167,11 @@ int main(int argc, char *argv[])
 	if (err)
 		goto out;
 
+	/* worker config, the sockets are opened per worker */
+	err = worker_init();
+	if (err)
+		goto out;
+
 	/* udp */
 	err = repcpd_udp_init();
 	if (err)
@@ -164,19 +182,16 @@ int main(int argc, char *argv[])
 	if (err)
 		goto out;
 
+	/* mapping state */
+	err = journal_init();
+	if (err)
+		goto out;
+
 	/* daemon config */
 	if (!conf_get(conf, "daemon", &opt) && !pl_strcasecmp(&opt, "no"))
 		daemon = false;
 
-	/* module config */
-	if (conf_get(conf, "module_path", &opt))
-		pl_set_str(&opt, ".");
-
-	err = conf_apply(conf, "module", module_handler, &opt);
-	if (err)
-		goto out;
-
-	/* daemon */
+	/* daemon, before the threads -- they do not survive fork() */
 	if (daemon) {
 		err = sys_daemon();
 		if (err) {
@@ -187,14 +202,44 @@ int main(int argc, char *argv[])
 		log_enable_stderr(false);
 	}
 
+	/* backend worker, a thread too */
+	err = backend_init();
+	if (err) {
+		error("backend init failed: %m\n", err);
+		goto out;
+	}
+
+	err = worker_start();
+	if (err) {
+		error("worker start failed: %m\n", err);
+		goto out;
+	}
+
+	/* module config */
+	if (conf_get(conf, "module_path", &opt))
+		pl_set_str(&opt, ".");
+
+	err = conf_apply(conf, "module", module_handler, &opt);
+	if (err)
+		goto out;
+
+	journal_replay_done();
+
 	info("PCP server ready.\n");
 
 	/* main loop */
 	err = re_main(signal_handler);
 
+	debug("pcp: %H\n", repcpd_pcp_debug, NULL);
+
  out:
 	info("PCP server terminated.\n");
 	mod_close();
+	worker_close();
+	repcpd_pcp_thread_close();
+	strpool_close();
+	journal_close();
+	backend_close();
 	repcpd_extaddr_close();
 	repcpd_udp_close();
 	conf = mem_deref(conf);
@@ -4,235 +4,1971 @@
  * Copyright (C) 2010 - 2016 Creytiv.com
  */
 
+#include <stdio.h>
 #include <string.h>
+#include <time.h>
 #include <re.h>
 #include <repcpd.h>
+#include "pcpd.h"
 
 
+enum {
+	BACKEND_QUEUE_MAX = 4096,
+	TAG_MAX           = 320,
+	DESCR_MAX         = 200,  /* the tag fits in 255 bytes */
+};
+
+
+/*
+ * The mappings of all tables are kept in one store per worker, so that
+ * a PEER can find the MAP of its internal endpoint and share its
+ * external port. Only this in-memory state is shared: the port is
+ * reserved once, but the PEER still installs a SNAT rule of its own,
+ * as the DNAT rule of the MAP does not translate the flows that the
+ * internal endpoint opens. Every table keeps its own backend chain, and
+ * has a shard with an operation queue per worker. A shard and its store
+ * are only used from the thread of their worker, see worker.c.
+ */
+struct store {
+	struct slab *slab;    /* storage of the mappings */
+	struct maptab *mt;    /* mappings, by tuple */
+	struct maptab *ext_mt;  /* mappings, by external endpoint */
+	struct hash *subh;    /* subscribers */
+	struct wheel *wheel;  /* expiry of the mappings */
+	uint32_t max;         /* mappings, 0 for no limit */
+	uint32_t quota;       /* mappings per subscriber, 0 for no limit */
+};
+
+struct shard {
+	struct mapping_table *table;
+	struct store *store;
+	struct list opl;      /* queued backend operations */
+	struct hash *oph;     /* queued and in-flight operations, by tuple */
+	struct tmr tmr;       /* commits the queued operations */
+	struct batch *batch;  /* operations being committed by the backend */
+	uint32_t opc;         /* number of queued operations */
+};
+
 struct mapping_table {
+	struct le le;
 	struct backend *be;
-	struct hash *ht;
+	struct shard *shardv; /* by worker */
+	uint32_t shardc;
+	uint32_t queue_max;
 	char *name;
+	bool reconcile;       /* rules survive a restart */
 	bool exiting;
 };
 
 
-static void mapping_destructor(void *arg)
+enum op_type {
+	OP_APPEND,
+	OP_DELETE,
+};
+
+/*
+ * A backend operation waiting to be committed. All operations that
+ * are queued while the previous batch is in-flight are committed
+ * together, in one backend transaction, by the backend worker.
+ */
+struct op {
+	struct le le;
+	struct le he;
+	enum op_type type;
+	struct mapping *mapping;   /* OP_APPEND only, NULL if deleted */
+	uint8_t opcode;
+	uint8_t proto;
+	struct maddr ext_addr;
+	struct maddr int_addr;
+	struct maddr remote_addr;
+	const char *ext_ifname;
+	uint8_t nonce[PCP_NONCE_SZ];
+	const char *descr;         /* interned */
+	bool inflight;
+	int err;
+};
+
+struct batch {
+	struct list opl;
+	struct shard *shard;  /* NULL if the table is gone */
+	struct backend *be;
+	char *name;
+	uint32_t n;
+	bool split;           /* the ops were committed one by one */
+};
+
+static struct list tablel;
+static __thread struct store *store;  /* of the calling worker */
+
+
+/* The mappings of a subscriber, see repcpd_subscriber() */
+struct subscriber {
+	struct le he;
+	struct sa addr;
+	struct list mapl;
+	uint32_t count;
+};
+
+
+/* A SUCCESS reply that is sent when the mapping is committed */
+struct reply {
+	struct le le;
+	struct udp_sock *us;
+	struct mbuf *mb;
+	struct sa dst;
+	uint32_t lifetime;
+};
+
+
+/* per-process secret key of the tuple hash */
+static uint8_t hash_key[16];
+static bool hash_keyed;
+
+
+static struct shard *shard_get(const struct mapping_table *table)
+{
+	return &table->shardv[worker_self()];
+}
+
+
+/*
+ * The backend rule is tagged with the nonce of the mapping, so that it
+ * can be adopted again after a restart:
+ *
+ *     "pcp <nonce>[ <description>]"
+ *
+ * The tag does not change while the mapping lives, so a refresh never
+ * touches the backend. The remaining lifetime is kept in the journal.
+ */
+static const char tag_fmt[] = "pcp %w%s%s";
+
+
+/*
+ * The description comes from the client, and ends up in the rule
+ * comment of the backend. Only printable characters are kept, without
+ * quotes and backslashes, and it is cut to DESCR_MAX.
+ */
+static void descr_clean(char *buf, size_t sz, const char *descr)
+{
+	size_t n = 0;
+
+	for (; *descr && n < sz - 1 && n < DESCR_MAX; descr++) {
+
+		const char c = *descr;
+
+		if (c < 0x20 || c > 0x7e || c == '"' || c == '\'' ||
+		    c == '\\')
+			continue;
+
+		buf[n++] = c;
+	}
+
+	buf[n] = '\0';
+}
+
+
+void maddr_set(struct maddr *ma, const struct sa *sa)
+{
+	if (!ma)
+		return;
+
+	memset(ma, 0, sizeof(*ma));
+
+	switch (sa_af(sa)) {
+
+	case AF_INET:
+		ma->af = 4;
+		memcpy(ma->addr, &sa->u.in.sin_addr, 4);
+		break;
+
+	case AF_INET6:
+		ma->af = 6;
+		memcpy(ma->addr, &sa->u.in6.sin6_addr, 16);
+		break;
+
+	default:
+		return;
+	}
+
+	ma->port = sa_port(sa);
+}
+
+
+void maddr_get(const struct maddr *ma, struct sa *sa)
+{
+	uint32_t v4;
+
+	if (!ma || !sa)
+		return;
+
+	switch (ma->af) {
+
+	case 4:
+		memcpy(&v4, ma->addr, 4);
+		sa_set_in(sa, ntohl(v4), ma->port);
+		break;
+
+	case 6:
+		sa_set_in6(sa, ma->addr, ma->port);
+		break;
+
+	default:
+		sa_init(sa, AF_UNSPEC);
+		break;
+	}
+}
+
+
+static int maddr_print(struct re_printf *pf, const struct maddr *ma)
+{
+	struct sa sa;
+
+	maddr_get(ma, &sa);
+
+	return re_hprintf(pf, "%J", &sa);
+}
+
+
+/*
+ * Keyed hash of the full tuple. The key is random, so that the bucket of
+ * a tuple cannot be predicted by the clients.
+ */
+static uint32_t key(int proto, const struct maddr *int_addr,
+		    const struct maddr *rem_addr)
+{
+	uint8_t buf[1 + 2 * sizeof(struct maddr)];
+	size_t n = 0;
+	uint64_t h;
+
+	buf[n++] = proto;
+	memcpy(&buf[n], int_addr, sizeof(*int_addr));
+	n += sizeof(*int_addr);
+
+	if (rem_addr && rem_addr->af) {
+		memcpy(&buf[n], rem_addr, sizeof(*rem_addr));
+		n += sizeof(*rem_addr);
+	}
+
+	h = siphash(hash_key, buf, n);
+
+	return (uint32_t)(h ^ h >> 32);
+}
+
+
+/* compared inline by the mapping hash table */
+static uint32_t ckey(int proto, const struct maddr *int_addr)
+{
+	return (uint32_t)proto << 16 | int_addr->port;
+}
+
+
+static bool str_equal(const char *a, const char *b)
+{
+	if (!a || !b)
+		return a == b;
+
+	return 0 == str_cmp(a, b);
+}
+
+
+static void op_destructor(void *arg)
+{
+	struct op *op = arg;
+
+	list_unlink(&op->le);
+	hash_unlink(&op->he);
+	strpool_release(op->descr);
+}
+
+
+struct op_match {
+	enum op_type type;
+	const struct mapping *mapping;
+	bool inflight;
+};
+
+
+static bool op_cmp_handler(struct le *le, void *arg)
+{
+	const struct op *op = le->data;
+	const struct op_match *m = arg;
+	const struct mapping *mapping = m->mapping;
+
+	if (op->type != m->type || op->inflight != m->inflight)
+		return false;
+
+	if (op->type == OP_APPEND)
+		return op->mapping == mapping;
+
+	/* the descriptions are interned */
+	return op->opcode == mapping->opcode &&
+		op->proto == mapping->proto &&
+		!memcmp(&op->ext_addr, &mapping->ext_addr,
+			sizeof(op->ext_addr)) &&
+		!memcmp(&op->int_addr, &mapping->int_addr,
+			sizeof(op->int_addr)) &&
+		!memcmp(&op->remote_addr, &mapping->remote_addr,
+			sizeof(op->remote_addr)) &&
+		op->ext_ifname == ifname_lookup(mapping->ifidx) &&
+		!memcmp(op->nonce, mapping->nonce, PCP_NONCE_SZ) &&
+		op->descr == mapping->descr;
+}
+
+
+static struct op *op_find(const struct shard *sh,
+			  enum op_type type, const struct mapping *mapping,
+			  bool inflight)
+{
+	struct op_match m;
+
+	m.type     = type;
+	m.mapping  = mapping;
+	m.inflight = inflight;
+
+	return list_ledata(hash_lookup(sh->oph,
+				       key(mapping->proto,
+					   &mapping->int_addr,
+					   &mapping->remote_addr),
+				       op_cmp_handler, &m));
+}
+
+
+/* remove a queued operation that was not yet committed */
+static void op_cancel(struct shard *sh, struct op *op)
+{
+	if (!op)
+		return;
+
+	if (sh->opc)
+		--sh->opc;
+
+	mem_deref(op);
+}
+
+
+static void commit_handler(void *arg);
+
+
+static void op_enqueue(struct shard *sh, struct op *op)
+{
+	list_append(&sh->opl, &op->le, op);
+	hash_append(sh->oph, key(op->proto, &op->int_addr,
+				 &op->remote_addr), &op->he, op);
+	++sh->opc;
+
+	if (!sh->batch && !tmr_isrunning(&sh->tmr))
+		tmr_start(&sh->tmr, 0, commit_handler, sh);
+}
+
+
+static int op_queue(struct shard *sh, enum op_type type,
+		    struct mapping *mapping)
+{
+	struct op *op;
+
+	op = mem_zalloc(sizeof(*op), op_destructor);
+	if (!op)
+		return ENOMEM;
+
+	op->type        = type;
+	op->opcode      = mapping->opcode;
+	op->proto       = mapping->proto;
+	op->ext_addr    = mapping->ext_addr;
+	op->int_addr    = mapping->int_addr;
+	op->remote_addr = mapping->remote_addr;
+	op->ext_ifname  = ifname_lookup(mapping->ifidx);
+	op->descr       = strpool_ref(mapping->descr);
+	memcpy(op->nonce, mapping->nonce, PCP_NONCE_SZ);
+
+	if (type == OP_APPEND)
+		op->mapping = mapping;
+
+	op_enqueue(sh, op);
+
+	return 0;
+}
+
+
+/* delete the rule of an append whose mapping went away in the meantime */
+static int op_queue_orphan(struct shard *sh, const struct op *ap)
+{
+	struct op *op;
+
+	op = mem_zalloc(sizeof(*op), op_destructor);
+	if (!op)
+		return ENOMEM;
+
+	op->type        = OP_DELETE;
+	op->opcode      = ap->opcode;
+	op->proto       = ap->proto;
+	op->ext_addr    = ap->ext_addr;
+	op->int_addr    = ap->int_addr;
+	op->remote_addr = ap->remote_addr;
+	op->ext_ifname  = ap->ext_ifname;
+	op->descr       = strpool_ref(ap->descr);
+	memcpy(op->nonce, ap->nonce, PCP_NONCE_SZ);
+
+	op_enqueue(sh, op);
+
+	return 0;
+}
+
+
+/* note: called from the backend worker thread */
+static int op_apply(struct backend *be, const char *name,
+		    const struct op *op)
+{
+	struct sa ext_addr, int_addr, remote_addr;
+	char tag[TAG_MAX];
+
+	maddr_get(&op->ext_addr, &ext_addr);
+	maddr_get(&op->int_addr, &int_addr);
+	maddr_get(&op->remote_addr, &remote_addr);
+
+	(void)re_snprintf(tag, sizeof(tag), tag_fmt,
+			  op->nonce, (size_t)PCP_NONCE_SZ,
+			  op->descr ? " " : "",
+			  op->descr ? op->descr : "");
+
+	switch (op->type) {
+
+	case OP_APPEND:
+		if (op->opcode == PCP_MAP)
+			return be->append(name, op->proto,
+					  &ext_addr, op->ext_ifname,
+					  &int_addr, tag);
+		else if (op->opcode == PCP_PEER)
+			return be->append_snat(name, op->proto,
+					       &ext_addr, op->ext_ifname,
+					       &int_addr, &remote_addr, tag);
+		break;
+
+	case OP_DELETE:
+		if (op->opcode == PCP_MAP)
+			be->delete(name, op->proto,
+				   &ext_addr, op->ext_ifname,
+				   &int_addr, tag);
+		else if (op->opcode == PCP_PEER)
+			be->delete_snat(name, op->proto,
+					&ext_addr, op->ext_ifname,
+					&int_addr, &remote_addr, tag);
+		break;
+	}
+
+	return 0;
+}
+
+
+static void reply_destructor(void *arg)
+{
+	struct reply *reply = arg;
+
+	list_unlink(&reply->le);
+	mem_deref(reply->us);
+	mem_deref(reply->mb);
+}
+
+
+/*
+ * Encode the SUCCESS reply of a mapping, with a zero lifetime and epoch.
+ * It is encoded again when the external address of the mapping changes.
+ */
+static void reply_build(struct mapping *mapping)
+{
+	struct mbuf mb = {
+		.buf  = mapping->reply,
+		.size = sizeof(mapping->reply),
+	};
+	struct sa addr;
+	int err = 0;
+
+	mapping->reply_len = 0;
+
+	if (mapping->opcode != PCP_MAP && mapping->opcode != PCP_PEER)
+		return;
+
+	err |= mbuf_write_u8(&mb, PCP_VERSION);
+	err |= mbuf_write_u8(&mb, 1 << 7 | mapping->opcode);
+	err |= mbuf_write_u8(&mb, 0x00);
+	err |= mbuf_write_u8(&mb, PCP_SUCCESS);
+	err |= mbuf_fill(&mb, 0x00, 4 + 4 + 12);
+
+	err |= mbuf_write_mem(&mb, mapping->nonce, PCP_NONCE_SZ);
+	err |= mbuf_write_u8(&mb, mapping->proto);
+	err |= mbuf_fill(&mb, 0x00, 3);
+	err |= mbuf_write_u16(&mb, htons(mapping->int_addr.port));
+	err |= mbuf_write_u16(&mb, htons(mapping->ext_addr.port));
+	maddr_get(&mapping->ext_addr, &addr);
+	err |= pcp_ipaddr_encode(&mb, &addr);
+
+	if (mapping->opcode == PCP_PEER) {
+		err |= mbuf_write_u16(&mb, htons(mapping->remote_addr.port));
+		err |= mbuf_fill(&mb, 0x00, 2);
+		maddr_get(&mapping->remote_addr, &addr);
+		err |= pcp_ipaddr_encode(&mb, &addr);
+	}
+
+	if (err)
+		return;
+
+	mapping->reply_len = (uint8_t)mb.end;
+}
+
+
+/*
+ * Send the SUCCESS reply from the template of the mapping. Like
+ * pcp_reply(), the reply is written over the request, and the options of
+ * the request are echoed. Only the lifetime and the epoch are patched.
+ */
+static int reply_send(const struct mapping *mapping, struct udp_sock *us,
+		      const struct sa *dst, struct mbuf *req,
+		      uint32_t lifetime)
+{
+	const size_t start = req->pos;
+	uint32_t v;
+	int err;
+
+	if (!mapping->reply_len)
+		return EPROTO;
+
+	err = mbuf_write_mem(req, mapping->reply, mapping->reply_len);
+	if (err)
+		return err;
+
+	v = htonl(lifetime);
+	memcpy(&req->buf[start + 4], &v, sizeof(v));
+	v = htonl(repcpd_epoch_time());
+	memcpy(&req->buf[start + 8], &v, sizeof(v));
+
+	req->pos = start;
+
+	return udp_send(us, dst, req);
+}
+
+
+/* send the replies that were waiting for the commit */
+static void replies_flush(struct mapping *mapping, int err)
+{
+	struct le *le;
+
+	while ((le = list_head(&mapping->replyl))) {
+
+		struct reply *reply = le->data;
+		const size_t start = reply->mb->pos;
+		struct dup_key key;
+		int rerr;
+
+		/* the reply is written over the request */
+		repcpd_dupcache_key(&key, reply->mb);
+
+		if (err) {
+			rerr = pcp_ereply(reply->us, &reply->dst, reply->mb,
+					  PCP_NO_RESOURCES);
+		}
+		else {
+			rerr = reply_send(mapping, reply->us, &reply->dst,
+					  reply->mb, reply->lifetime);
+		}
+
+		if (rerr)
+			warning("mapping: reply to %J failed (%m)\n",
+				&reply->dst, rerr);
+
+		reply->mb->pos = start;
+		repcpd_dupcache_store(&reply->dst, reply->mb, &key);
+
+		mem_deref(reply);
+	}
+}
+
+
+static void op_complete(struct shard *sh, struct op *op)
+{
+	struct mapping *mapping = op->mapping;
+
+	switch (op->type) {
+
+	case OP_APPEND:
+		if (!mapping) {
+			if (!op->err && op_queue_orphan(sh, op))
+				warning("mapping: could not queue delete\n");
+			break;
+		}
+
+		if (op->err) {
+			warning("map: append rule failed (%m)\n", op->err);
+
+			op->mapping = NULL;
+			mem_deref(op);
+
+			replies_flush(mapping, op->err);
+			mapping_delete(mapping);
+			return;
+		}
+
+		mapping->committed = true;
+
+		/* in pool mode, the port blocks are logged instead */
+		loglv(repcpd_extaddr_pooled() ? DEBUG : INFO,
+		      "map: created mapping: proto=%s int=%H <---> ext=%H"
+		      " (%usec)\n",
+		      pcp_proto_name(mapping->proto),
+		      maddr_print, &mapping->int_addr,
+		      maddr_print, &mapping->ext_addr, mapping->lifetime);
+
+		replies_flush(mapping, 0);
+		break;
+
+	case OP_DELETE:
+		if (op->err) {
+			warning("mapping: delete rule failed (%m)\n",
+				op->err);
+			break;
+		}
+
+		loglv(repcpd_extaddr_pooled() ? DEBUG : INFO,
+		      "mapping: deleted: proto=%s int=%H <----> ext=%H\n",
+		      pcp_proto_name(op->proto),
+		      maddr_print, &op->int_addr, maddr_print, &op->ext_addr);
+		break;
+	}
+
+	mem_deref(op);
+}
+
+
+static void batch_destructor(void *arg)
+{
+	struct batch *batch = arg;
+
+	list_flush(&batch->opl);
+	mem_deref(batch->name);
+}
+
+
+/* note: called from the backend worker thread */
+static int batch_work(void *arg)
+{
+	struct batch *batch = arg;
+	struct backend *be = batch->be;
+	struct le *le;
+	int err = 0;
+
+	if (be->begin)
+		err = be->begin(batch->name);
+
+	for (le = batch->opl.head; le; le = le->next) {
+
+		struct op *op = le->data;
+
+		/* nothing is applied if the transaction did not begin */
+		if (!err)
+			op->err = op_apply(be, batch->name, op);
+	}
+
+	if (!err && be->commit)
+		err = be->commit(batch->name);
+
+	if (!err || !be->begin || !be->commit || batch->n < 2)
+		return err;
+
+	/*
+	 * The failed transaction is rolled back as a whole, and one bad
+	 * operation would fail all the others. Retry them one by one.
+	 */
+	batch->split = true;
+
+	for (le = batch->opl.head; le; le = le->next) {
+
+		struct op *op = le->data;
+		int cerr;
+
+		op->err = be->begin(batch->name);
+		if (op->err)
+			continue;
+
+		op->err = op_apply(be, batch->name, op);
+
+		cerr = be->commit(batch->name);
+		if (!op->err)
+			op->err = cerr;
+	}
+
+	return 0;
+}
+
+
+static void batch_done(int err, void *arg)
+{
+	struct batch *batch = arg;
+	struct shard *sh = batch->shard;
+	struct le *le;
+
+	if (!sh)
+		return;
+
+	sh->batch = NULL;
+
+	if (err) {
+		warning("mapping: `%s': commit of %u operations failed (%m)\n",
+			batch->name, batch->n, err);
+	}
+	else if (batch->split) {
+		warning("mapping: `%s': commit of %u operations failed,"
+			" committed one by one\n", batch->name, batch->n);
+	}
+	else {
+		debug("mapping: `%s': committed %u operations\n",
+		      batch->name, batch->n);
+	}
+
+	while ((le = list_head(&batch->opl))) {
+
+		struct op *op = le->data;
+
+		if (err)
+			op->err = err;
+
+		op_complete(sh, op);
+	}
+
+	/* commit what was queued while this batch was in-flight */
+	if (sh->opl.head && !tmr_isrunning(&sh->tmr))
+		tmr_start(&sh->tmr, 0, commit_handler, sh);
+}
+
+
+static void commit_handler(void *arg)
+{
+	struct shard *sh = arg;
+	struct mapping_table *table = sh->table;
+	struct batch *batch;
+	struct le *le;
+	int err;
+
+	/* only one batch per shard is in-flight */
+	if (sh->batch || !sh->opl.head)
+		return;
+
+	batch = mem_zalloc(sizeof(*batch), batch_destructor);
+	if (!batch) {
+		tmr_start(&sh->tmr, 10, commit_handler, sh);
+		return;
+	}
+
+	batch->shard = sh;
+	batch->be    = table->be;
+	batch->name  = mem_ref(table->name);
+
+	while ((le = list_head(&sh->opl))) {
+
+		struct op *op = le->data;
+
+		list_unlink(&op->le);
+		list_append(&batch->opl, &op->le, op);
+		op->inflight = true;
+		++batch->n;
+	}
+
+	sh->opc   = 0;
+	sh->batch = batch;
+
+	err = backend_work(batch_work, batch_done, batch);
+	if (err) {
+		warning("mapping: `%s': could not start commit (%m)\n",
+			table->name, err);
+		batch_done(err, batch);
+	}
+
+	mem_deref(batch);
+}
+
+
+static uint32_t ext_key(const struct mapping *mapping)
+{
+	return key(mapping->proto, &mapping->ext_addr, NULL);
+}
+
+
+/*
+ * Take the external port, and index the mapping by it. A PEER of a
+ * mapped internal endpoint shares the external port of its MAP, so the
+ * port is only reserved by the first mapping that holds it.
+ */
+static int ext_hold(struct mapping *mapping)
+{
+	const struct mapping *holder;
+	struct sa ext, int_addr;
+	int err = 0;
+
+	maddr_get(&mapping->ext_addr, &ext);
+	maddr_get(&mapping->int_addr, &int_addr);
+
+	holder = mapping_find_ext(mapping->table, mapping->proto, &ext);
+	if (holder && memcmp(&holder->int_addr, &mapping->int_addr,
+			     sizeof(mapping->int_addr)))
+		err = EADDRINUSE;
+	else if (!holder)
+		err = repcpd_extaddr_reserve(&ext, mapping->proto, &int_addr);
+	if (err) {
+		warning("mapping: external port %J/%s is not available"
+			" (%m)\n", &ext, pcp_proto_name(mapping->proto), err);
+		return err;
+	}
+
+	err = maptab_insert(store->ext_mt, ext_key(mapping),
+			    ckey(mapping->proto, &mapping->ext_addr), mapping);
+	if (err) {
+		if (!holder)
+			repcpd_extaddr_release(&ext, mapping->proto);
+		return err;
+	}
+
+	mapping->ext_held = true;
+
+	return 0;
+}
+
+
+static void ext_drop(struct mapping *mapping)
+{
+	struct sa ext;
+
+	if (!mapping->ext_held)
+		return;
+
+	maddr_get(&mapping->ext_addr, &ext);
+
+	maptab_remove(store->ext_mt, ext_key(mapping), mapping);
+
+	/* the port is released by the last mapping that holds it */
+	if (!mapping_find_ext(mapping->table, mapping->proto, &ext))
+		repcpd_extaddr_release(&ext, mapping->proto);
+
+	mapping->ext_held = false;
+}
+
+
+static void subscriber_destructor(void *arg)
+{
+	struct subscriber *sub = arg;
+
+	hash_unlink(&sub->he);
+}
+
+
+static bool sub_cmp_handler(struct le *le, void *arg)
+{
+	const struct subscriber *sub = le->data;
+
+	return sa_cmp(&sub->addr, arg, SA_ADDR);
+}
+
+
+static struct subscriber *subscriber_find(const struct mapping_table *table,
+					  const struct sa *int_addr)
+{
+	struct sa addr;
+
+	repcpd_subscriber(&addr, int_addr);
+
+	return list_ledata(hash_lookup(store->subh, sa_hash(&addr, SA_ADDR),
+				       sub_cmp_handler, &addr));
+}
+
+
+static int subscriber_attach(struct mapping *mapping,
+			     const struct sa *int_addr)
+{
+	struct mapping_table *table = mapping->table;
+	struct subscriber *sub;
+
+	sub = subscriber_find(table, int_addr);
+	if (!sub) {
+		sub = mem_zalloc(sizeof(*sub), subscriber_destructor);
+		if (!sub)
+			return ENOMEM;
+
+		repcpd_subscriber(&sub->addr, int_addr);
+		hash_append(store->subh, sa_hash(&sub->addr, SA_ADDR),
+			    &sub->he, sub);
+	}
+
+	list_append(&sub->mapl, &mapping->sle, mapping);
+	mapping->sub = sub;
+	++sub->count;
+
+	return 0;
+}
+
+
+static void subscriber_detach(struct mapping *mapping)
+{
+	struct subscriber *sub = mapping->sub;
+
+	if (!sub)
+		return;
+
+	list_unlink(&mapping->sle);
+	mapping->sub = NULL;
+
+	if (!--sub->count)
+		mem_deref(sub);
+}
+
+
+/* the cached replies of the subscriber may be stale now */
+static void dupcache_flush(const struct mapping *mapping)
+{
+	struct sa int_addr;
+
+	maddr_get(&mapping->int_addr, &int_addr);
+	repcpd_dupcache_flush(&int_addr);
+}
+
+
+/**
+ * Delete a mapping, and its backend rule
+ *
+ * @param mapping PCP mapping
+ */
+void mapping_delete(struct mapping *mapping)
+{
+	struct mapping_table *table;
+	struct shard *sh;
+	bool pending = false;
+	struct op *op;
+
+	if (!mapping)
+		return;
+
+	table = mapping->table;
+	sh    = shard_get(table);
+
+	maptab_remove(store->mt, key(mapping->proto, &mapping->int_addr,
+				     &mapping->remote_addr), mapping);
+	ext_drop(mapping);
+	subscriber_detach(mapping);
+	wheel_cancel(store->wheel, &mapping->we);
+	list_flush(&mapping->replyl);
+	dupcache_flush(mapping);
+
+	if (!table->exiting) {
+
+		if (mapping->journaled)
+			journal_delete(table->name, mapping);
+
+		/* no op may keep pointing at the mapping once it is freed */
+		while ((op = op_find(sh, OP_APPEND, mapping, true))) {
+			/* the rule is deleted again when it is committed */
+			op->mapping = NULL;
+			pending = true;
+		}
+
+		while ((op = op_find(sh, OP_APPEND, mapping, false))) {
+			/* create and delete in the same batch cancel out */
+			op_cancel(sh, op);
+			pending = true;
+		}
+
+		if (!pending && mapping->committed) {
+			if (op_queue(sh, OP_DELETE, mapping))
+				warning("mapping: could not queue delete\n");
+		}
+	}
+
+	strpool_release(mapping->descr);
+	slab_put(store->slab, mapping);
+}
+
+
+static void flush_handler(void *item)
+{
+	mapping_delete(item);
+}
+
+
+/* all mappings that expired in one tick */
+static void expire_handler(struct list *expired, void *arg)
+{
+	uint32_t n = 0;
+	struct le *le;
+	(void)arg;
+
+	while ((le = list_head(expired))) {
+
+		struct mapping *mapping = le->data;
+
+		debug("map: mapping expired (port %u -- external %H)\n",
+		      mapping->int_addr.port, maddr_print, &mapping->ext_addr);
+
+		wheel_cancel(store->wheel, &mapping->we);
+		mapping_delete(mapping);
+		++n;
+	}
+
+	info("mapping: %u mappings expired\n", n);
+}
+
+
+static int mapping_alloc(struct mapping **mappingp,
+			 struct mapping_table *table,
+			 enum pcp_opcode opcode, int proto,
+			 const struct sa *int_addr, const char *ext_ifname,
+			 const struct sa *ext_addr,
+			 const struct sa *remote_addr,
+			 uint32_t lifetime, const uint8_t nonce[12],
+			 const char *descr)
+{
+	struct mapping *mapping;
+	int err;
+
+	mapping = slab_get(store->slab);
+	if (!mapping) {
+		if (store->max) {
+			warning("mapping: too many mappings (%u)\n",
+				store->max);
+			return ENOSPC;
+		}
+
+		return ENOMEM;
+	}
+
+	mapping->table  = table;
+	mapping->opcode = opcode;
+	mapping->proto  = proto;
+	memcpy(mapping->nonce, nonce, PCP_NONCE_SZ);
+	maddr_set(&mapping->int_addr, int_addr);
+	maddr_set(&mapping->ext_addr, ext_addr);
+	maddr_set(&mapping->remote_addr, remote_addr);
+	reply_build(mapping);
+
+	mapping->lifetime = lifetime;
+
+	err = ifname_intern(&mapping->ifidx, ext_ifname);
+	if (err)
+		goto out;
+
+	if (descr) {
+		char buf[DESCR_MAX + 1];
+
+		descr_clean(buf, sizeof(buf), descr);
+
+		if (buf[0]) {
+			err = strpool_intern(&mapping->descr, buf);
+			if (err)
+				goto out;
+		}
+	}
+
+	err = ext_hold(mapping);
+	if (err)
+		goto out;
+
+	err = subscriber_attach(mapping, int_addr);
+	if (err)
+		goto out;
+
+	err = maptab_insert(store->mt, key(proto, &mapping->int_addr,
+					   &mapping->remote_addr),
+			    ckey(proto, &mapping->int_addr), mapping);
+	if (err)
+		goto out;
+
+	wheel_start(store->wheel, &mapping->we, lifetime, mapping);
+
+ out:
+	if (err) {
+		mapping_delete(mapping);
+	}
+	else {
+		dupcache_flush(mapping);
+		*mappingp = mapping;
+	}
+
+	return err;
+}
+
+
+/* parse the tag of a backend rule, see tag_fmt */
+static int tag_parse(const char *tag, uint8_t nonce[PCP_NONCE_SZ],
+		     const char **descr)
+{
+	char hex[2 * PCP_NONCE_SZ + 1];
+	int n = 0;
+
+	if (!tag)
+		return EINVAL;
+
+	if (1 != sscanf(tag, "pcp %24[0-9a-f]%n", hex, &n) || !n)
+		return EBADMSG;
+
+	/* the whole nonce, not the expiry of an older tag */
+	if (str_len(hex) != 2 * PCP_NONCE_SZ ||
+	    (tag[n] && tag[n] != ' '))
+		return EBADMSG;
+
+	if (str_hex(nonce, PCP_NONCE_SZ, hex))
+		return EBADMSG;
+
+	*descr = tag + n;
+	if (**descr == ' ')
+		++*descr;
+
+	return 0;
+}
+
+
+/**
+ * Print the backend rule tag of a mapping
+ *
+ * @param pf      Print handler
+ * @param mapping PCP mapping
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+int mapping_tag_print(struct re_printf *pf, const struct mapping *mapping)
+{
+	if (!mapping)
+		return 0;
+
+	return re_hprintf(pf, tag_fmt,
+			  mapping->nonce, (size_t)PCP_NONCE_SZ,
+			  mapping->descr ? " " : "",
+			  mapping->descr ? mapping->descr : "");
+}
+
+
+/* note: "remote_addr" is optional (only for PEER) */
+int mapping_create(struct mapping **mappingp, struct mapping_table *table,
+		   enum pcp_opcode opcode,
+		   int proto,
+		   const struct sa *int_addr, const char *ext_ifname,
+		   const struct sa *ext_addr, const struct sa *remote_addr,
+		   uint32_t lifetime, const uint8_t nonce[12],
+		   const char *descr)
+{
+	struct mapping *mapping;
+	struct shard *sh;
+	struct op *op;
+	int err;
+
+	if (!mappingp || !table || !int_addr || !ext_addr || !nonce)
+		return EINVAL;
+
+	sh = shard_get(table);
+
+	if (sh->opc >= table->queue_max) {
+		warning("mapping: `%s': backend queue is full (%u)\n",
+			table->name, sh->opc);
+		return ENOBUFS;
+	}
+
+	if (store->quota &&
+	    mapping_subscriber_count(table, int_addr) >= store->quota) {
+		debug("mapping: subscriber %j is over quota (%u)\n",
+		      int_addr, store->quota);
+		return EDQUOT;
+	}
+
+	err = mapping_alloc(&mapping, table, opcode, proto, int_addr,
+			    ext_ifname, ext_addr, remote_addr, lifetime,
+			    nonce, descr);
+	if (err)
+		return err;
+
+	/* a queued delete of the same rule cancels out */
+	op = op_find(sh, OP_DELETE, mapping, false);
+	if (op) {
+		op_cancel(sh, op);
+		mapping->committed = true;
+		goto out;
+	}
+
+	/* the rule is appended when the next batch is committed */
+	err = op_queue(sh, OP_APPEND, mapping);
+	if (err)
+		goto out;
+
+	debug("map: queued mapping: proto=%s int=%H <---> ext=%H\n",
+	      pcp_proto_name(mapping->proto),
+	      maddr_print, &mapping->int_addr,
+	      maddr_print, &mapping->ext_addr);
+
+ out:
+	if (err) {
+		mapping_delete(mapping);
+	}
+	else {
+		journal_create(table->name, mapping,
+			       (uint64_t)time(NULL) + lifetime);
+		mapping->journaled = true;
+		*mappingp = mapping;
+	}
+
+	return err;
+}
+
+
+void mapping_refresh(struct mapping *mapping, uint32_t lifetime)
+{
+	const uint64_t now = (uint64_t)time(NULL);
+
+	if (!mapping)
+		return;
+
+	wheel_start(store->wheel, &mapping->we, lifetime, mapping);
+
+	journal_refresh(mapping->table->name, mapping, now + lifetime);
+}
+
+
+/**
+ * Send a SUCCESS reply for a mapping. If the mapping is not yet committed
+ * to the backend, the reply is sent when the commit completes (or an
+ * error reply, if the commit fails).
+ *
+ * @param mapping  PCP mapping
+ * @param us       UDP socket
+ * @param dst      Destination address
+ * @param req      Request message
+ * @param lifetime Lifetime in [seconds]
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+int mapping_reply(struct mapping *mapping, struct udp_sock *us,
+		  const struct sa *dst, struct mbuf *req, uint32_t lifetime)
+{
+	struct reply *reply;
+
+	if (!mapping || !us || !dst || !req)
+		return EINVAL;
+
+	if (mapping->committed)
+		return reply_send(mapping, us, dst, req, lifetime);
+
+	reply = mem_zalloc(sizeof(*reply), reply_destructor);
+	if (!reply)
+		return ENOMEM;
+
+	reply->us       = mem_ref(us);
+	reply->mb       = mem_ref(req);
+	reply->dst      = *dst;
+	reply->lifetime = lifetime;
+
+	list_append(&mapping->replyl, &reply->le, reply);
+
+	/* its retransmissions wait for the same reply */
+	repcpd_dupcache_defer(dst, req);
+
+	return 0;
+}
+
+
+struct tuple {
+	int proto;
+	struct maddr int_addr;
+	struct maddr remote_addr;  /* PEER only */
+};
+
+
+static bool cmp_handler(const void *item, void *arg)
+{
+	const struct mapping *map = item;
+	const struct tuple *tup = arg;
+
+	if (map->proto != tup->proto ||
+	    memcmp(&map->int_addr, &tup->int_addr, sizeof(tup->int_addr)))
+		return false;
+
+	/* a MAP never matches a PEER of the same internal endpoint */
+	return !memcmp(&map->remote_addr, &tup->remote_addr,
+		       sizeof(tup->remote_addr));
+}
+
+
+/* note: the external endpoint is in "int_addr" of the tuple */
+static bool ext_cmp_handler(const void *item, void *arg)
+{
+	const struct mapping *map = item;
+	const struct tuple *tup = arg;
+
+	return map->proto == tup->proto &&
+		!memcmp(&map->ext_addr, &tup->int_addr, sizeof(tup->int_addr));
+}
+
+
+static struct mapping *tuple_find(const struct mapping_table *table,
+				  struct tuple *tup)
+{
+	return maptab_lookup(store->mt,
+			     key(tup->proto, &tup->int_addr,
+				 &tup->remote_addr),
+			     ckey(tup->proto, &tup->int_addr),
+			     cmp_handler, tup);
+}
+
+
+/**
+ * Get the keyed hash of a mapping tuple, as used by the mapping tables
+ *
+ * @param proto    Protocol
+ * @param int_addr Internal address and port
+ * @param rem_addr Remote address and port of a PEER mapping, or NULL
+ *
+ * @return Hash value
+ */
+uint32_t mapping_tuple_hash(int proto, const struct sa *int_addr,
+			    const struct sa *rem_addr)
+{
+	struct maddr ia, ra;
+
+	maddr_set(&ia, int_addr);
+	maddr_set(&ra, rem_addr);
+
+	return key(proto, &ia, &ra);
+}
+
+
+struct mapping *mapping_find(const struct mapping_table *table,
+			     int proto, const struct sa *int_addr)
+{
+	struct tuple tup;
+
+	tup.proto = proto;
+	maddr_set(&tup.int_addr, int_addr);
+	maddr_set(&tup.remote_addr, NULL);
+
+	return tuple_find(table, &tup);
+}
+
+
+struct mapping *mapping_find_peer(const struct mapping_table *table,
+				  int proto, const struct sa *int_addr,
+				  const struct sa *remote_addr)
+{
+	struct tuple tup;
+
+	tup.proto = proto;
+	maddr_set(&tup.int_addr, int_addr);
+	maddr_set(&tup.remote_addr, remote_addr);
+
+	return tuple_find(table, &tup);
+}
+
+
+/**
+ * Find a mapping by its external address and port
+ *
+ * @param table    Mapping table
+ * @param proto    Protocol
+ * @param ext_addr External address and port
+ *
+ * @return Mapping if found, otherwise NULL
+ */
+struct mapping *mapping_find_ext(const struct mapping_table *table,
+				 int proto, const struct sa *ext_addr)
+{
+	struct tuple tup;
+
+	if (!table || !ext_addr)
+		return NULL;
+
+	tup.proto = proto;
+	maddr_set(&tup.int_addr, ext_addr);
+
+	return maptab_lookup(store->ext_mt,
+			     key(proto, &tup.int_addr, NULL),
+			     ckey(proto, &tup.int_addr),
+			     ext_cmp_handler, &tup);
+}
+
+
+/* a backend rule, adopted by the worker of its subscriber */
+struct adopt {
+	struct mapping_table *table;
+	enum pcp_opcode opcode;
+	int proto;
+	const struct sa *ext_addr;
+	const char *ext_ifname;
+	const struct sa *int_addr;
+	const struct sa *remote_addr;
+	const char *descr;
+};
+
+
+static int adopt_exec(void *arg)
 {
-	struct mapping *mapping = arg;
+	const struct adopt *ad = arg;
+	struct mapping_table *table = ad->table;
+	const enum pcp_opcode opcode = ad->opcode;
+	const int proto = ad->proto;
+	const struct sa *ext_addr = ad->ext_addr;
+	const char *ext_ifname = ad->ext_ifname;
+	const struct sa *int_addr = ad->int_addr;
+	const struct sa *remote_addr = ad->remote_addr;
+	struct mapping *mapping;
+	uint8_t nonce[PCP_NONCE_SZ];
+	const char *text;
+	struct sa ext;
+	uint32_t lifetime;
+	int err;
 
-	list_unlink(&mapping->le);
-	tmr_cancel(&mapping->tmr);
+	if (tag_parse(ad->descr, nonce, &text))
+		return EBADMSG;
 
-	if (mapping->committed && !mapping->table->exiting) {
+	/*
+	 * The remaining lifetime is set by the journal replay. Without a
+	 * journal entry, the longest configured one is assumed, so that no
+	 * live mapping expires before its client refreshes it.
+	 */
+	lifetime = pcp_lifetime_calculate(UINT32_MAX);
 
-		switch (mapping->opcode) {
+	if (!str_equal(ext_ifname, repcpd_extaddr_ifname_find(AF_UNSPEC)))
+		return ENODEV;
 
-		case PCP_MAP:
-			mapping->table->be->delete(mapping->table->name,
-						   mapping->map.proto,
-						   &mapping->map.ext_addr,
-						   mapping->ext_ifname,
-						   &mapping->int_addr,
-						   mapping->descr);
-			break;
+	switch (opcode) {
 
-		case PCP_PEER:
-			mapping->table->be->delete_snat(mapping->table->name,
-							mapping->map.proto,
-							&mapping->map.ext_addr,
-						        mapping->ext_ifname,
-							&mapping->int_addr,
-							&mapping->remote_addr,
-							mapping->descr);
-			break;
+	case PCP_MAP:
+		/* in pool mode, the address is that of the port block */
+		if (repcpd_extaddr_exist(ext_addr)) {
+			ext = *ext_addr;
+		}
+		else if (repcpd_extaddr_find(sa_af(int_addr))) {
+			ext = *repcpd_extaddr_find(sa_af(int_addr));
+			sa_set_port(&ext, sa_port(ext_addr));
+		}
+		else {
+			return EADDRNOTAVAIL;
+		}
+
+		if (mapping_find(table, proto, int_addr))
+			return EEXIST;
+		break;
 
-		default:
-			break;
-		};
+	case PCP_PEER:
+		if (!repcpd_extaddr_exist(ext_addr))
+			return EADDRNOTAVAIL;
+
+		ext = *ext_addr;
+
+		if (mapping_find_peer(table, proto, int_addr, remote_addr))
+			return EEXIST;
+		break;
 
-		info("mapping: deleted: proto=%s int=%J <----> ext=%J\n",
-		     pcp_proto_name(mapping->map.proto),
-		     &mapping->int_addr, &mapping->map.ext_addr);
+	default:
+		return EPROTO;
 	}
 
-	mem_deref(mapping->descr);
-	mem_deref(mapping->ext_ifname);
+	err = mapping_alloc(&mapping, table, opcode, proto, int_addr,
+			    ext_ifname, &ext, remote_addr, lifetime, nonce,
+			    *text ? text : NULL);
+	if (err)
+		return err;
+
+	/* the rule keeps its tag, and is in the next snapshot */
+	mapping->committed = true;
+	mapping->journaled = true;
+
+	info("mapping: adopted: proto=%s int=%J <---> ext=%J (%usec)\n",
+	     pcp_proto_name(proto), int_addr, &ext, lifetime);
+
+	return 0;
+}
+
+
+/*
+ * Adopt a rule that was left in the backend by a previous instance.
+ * Rules that do not carry a valid tag, or that do not
+ * match the current configuration are deleted by the backend.
+ */
+static bool adopt_handler(enum pcp_opcode opcode, int proto,
+			  const struct sa *ext_addr, const char *ext_ifname,
+			  const struct sa *int_addr,
+			  const struct sa *remote_addr,
+			  const char *descr, void *arg)
+{
+	struct adopt ad;
+
+	ad.table       = arg;
+	ad.opcode      = opcode;
+	ad.proto       = proto;
+	ad.ext_addr    = ext_addr;
+	ad.ext_ifname  = ext_ifname;
+	ad.int_addr    = int_addr;
+	ad.remote_addr = remote_addr;
+	ad.descr       = descr;
+
+	return 0 == worker_exec(worker_shard(int_addr), adopt_exec, &ad);
 }
 
 
-static void timeout(void *arg)
+/*
+ * Restore a mapping from the journal. A mapping that was already adopted
+ * from the backend gets the lifetime and external address of the journal.
+ * The mappings of other workers are left in the journal.
+ */
+static bool replay_handler(const struct journal_entry *je, void *arg)
 {
-	struct mapping *mapping = arg;
+	struct shard *sh = arg;
+	struct mapping_table *table = sh->table;
+	uint64_t now = (uint64_t)time(NULL);
+	struct mapping *mapping;
+	uint32_t lifetime;
+	int err;
+
+	if (worker_shard(&je->int_addr) != worker_self())
+		return false;
+
+	switch (je->opcode) {
+
+	case PCP_MAP:
+		mapping = mapping_find(table, je->proto, &je->int_addr);
+		break;
+
+	case PCP_PEER:
+		mapping = mapping_find_peer(table, je->proto, &je->int_addr,
+					    &je->remote_addr);
+		break;
+
+	default:
+		return true;
+	}
+
+	/* an adopted rule goes with its expired mapping */
+	if (je->expires <= now) {
+		mapping_delete(mapping);
+		return true;
+	}
+
+	if (!repcpd_extaddr_exist(&je->ext_addr))
+		return true;
+
+	/* the remaining lifetime, within the configured limits */
+	lifetime = (uint32_t)min(je->expires - now, UINT32_MAX);
+	lifetime = pcp_lifetime_calculate(lifetime);
+
+	if (mapping) {
+		if (mapping->ext_addr.port == sa_port(&je->ext_addr)) {
 
-	info("map: mapping expired (port %u -- external %J)\n",
-	     mapping->map.int_port, &mapping->map.ext_addr);
+			const struct maddr old = mapping->ext_addr;
 
-	mem_deref(mapping);
+			ext_drop(mapping);
+			maddr_set(&mapping->ext_addr, &je->ext_addr);
+
+			if (ext_hold(mapping)) {
+				mapping->ext_addr = old;
+				(void)ext_hold(mapping);
+			}
+
+			reply_build(mapping);
+		}
+
+		mapping->lifetime = lifetime;
+		wheel_start(store->wheel, &mapping->we, lifetime, mapping);
+		return true;
+	}
+
+	err = mapping_alloc(&mapping, table, je->opcode, je->proto,
+			    &je->int_addr, je->ext_ifname, &je->ext_addr,
+			    je->opcode == PCP_PEER ? &je->remote_addr : NULL,
+			    lifetime, je->nonce, je->descr);
+	if (err)
+		return true;
+
+	mapping->journaled = true;
+
+	err = op_queue(sh, OP_APPEND, mapping);
+	if (err) {
+		warning("mapping: could not restore mapping (%m)\n", err);
+		mapping_delete(mapping);
+	}
+
+	return true;
 }
 
 
-static uint32_t key(int proto, const struct sa *int_addr,
-		    const struct sa *rem_addr)
+/**
+ * Get the number of mappings of a subscriber
+ *
+ * @param table    Mapping table
+ * @param int_addr Internal address of the subscriber
+ *
+ * @return Number of mappings
+ */
+uint32_t mapping_subscriber_count(const struct mapping_table *table,
+				  const struct sa *int_addr)
 {
-	uint32_t v;
+	const struct subscriber *sub;
 
-	v = proto + sa_hash(int_addr, SA_ALL);
+	if (!table || !int_addr)
+		return 0;
 
-	if (sa_isset(rem_addr, SA_ALL))
-		v += sa_hash(rem_addr, SA_ALL);
+	sub = subscriber_find(table, int_addr);
 
-	return v;
+	return sub ? sub->count : 0;
 }
 
 
-/* note: "remote_addr" is optional (only for PEER) */
-int mapping_create(struct mapping **mappingp, struct mapping_table *table,
-		   enum pcp_opcode opcode,
-		   int proto,
-		   const struct sa *int_addr, const char *ext_ifname,
-		   const struct sa *ext_addr, const struct sa *remote_addr,
-		   uint32_t lifetime, const uint8_t nonce[12],
-		   const char *descr)
+/**
+ * Delete all mappings of a subscriber. The backend rules are deleted
+ * in one batch.
+ *
+ * @param table    Mapping table
+ * @param int_addr Internal address of the subscriber
+ *
+ * @return Number of deleted mappings
+ */
+uint32_t mapping_subscriber_delete(struct mapping_table *table,
+				   const struct sa *int_addr)
 {
-	struct mapping *mapping;
+	struct subscriber *sub;
+	struct le *le;
+	uint32_t n = 0;
+
+	if (!table || !int_addr)
+		return 0;
+
+	sub = mem_ref(subscriber_find(table, int_addr));
+	if (!sub)
+		return 0;
+
+	while ((le = list_head(&sub->mapl))) {
+		mapping_delete(le->data);
+		++n;
+	}
+
+	info("mapping: `%s': deleted %u mappings of subscriber %j\n",
+	     table->name, n, &sub->addr);
+
+	mem_deref(sub);
+
+	return n;
+}
+
+
+struct snapshot {
+	struct mbuf *mb;
+	uint64_t now;
 	int err;
+};
 
-	if (!mappingp || !table || !int_addr || !ext_addr || !nonce)
-		return EINVAL;
 
-	mapping = mem_zalloc(sizeof(*mapping), mapping_destructor);
-	if (!mapping)
-		return ENOMEM;
+static bool snapshot_handler(void *item, void *arg)
+{
+	const struct mapping *mapping = item;
+	struct snapshot *snap = arg;
 
-	mapping->table = table;
-	mapping->opcode = opcode;
-	memcpy(mapping->map.nonce, nonce, 12);
-	mapping->map.proto = proto;
-	mapping->map.int_port = sa_port(int_addr);
-	mapping->map.ext_addr = *ext_addr;
-	if (remote_addr)
-		mapping->remote_addr = *remote_addr;
-
-	mapping->int_addr = *int_addr;
-	mapping->lifetime = lifetime;
+	snap->err = journal_encode(snap->mb, mapping->table->name, mapping,
+				   snap->now +
+				   wheel_remaining(store->wheel,
+						   &mapping->we));
 
-	err = str_dup(&mapping->ext_ifname, ext_ifname);
-	if (err)
-		goto out;
+	return snap->err != 0;
+}
 
-	if (descr) {
-		err = str_dup(&mapping->descr, descr);
-		if (err)
-			goto out;
-	}
 
-	switch (opcode) {
+/* note: called from the worker of the shard */
+static int snapshot_exec(void *arg)
+{
+	struct snapshot *snap = arg;
 
-	case PCP_MAP:
-		err = table->be->append(table->name, proto, ext_addr,
-					ext_ifname, int_addr,
-					descr);
-		break;
+	if (store)
+		(void)maptab_apply(store->mt, snapshot_handler, snap);
 
-	case PCP_PEER:
-		err = table->be->append_snat(table->name, proto,
-					     ext_addr, ext_ifname, int_addr,
-					     remote_addr, descr);
-		break;
+	return snap->err;
+}
 
-	default:
-		break;
+
+/**
+ * Write the state of all mapping tables, as journal create records
+ *
+ * @param mb Buffer to write to
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+int mapping_snapshot(struct mbuf *mb)
+{
+	struct snapshot snap;
+	uint32_t i;
+	int err = 0;
+
+	snap.mb  = mb;
+	snap.now = (uint64_t)time(NULL);
+	snap.err = 0;
+
+	for (i = 0; i < worker_count() && !err; i++)
+		err = worker_exec(i, snapshot_exec, &snap);
+
+	return err;
+}
+
+
+/**
+ * Print the statistics of the shard of a mapping table, that is owned by
+ * the calling worker
+ *
+ * @param pf    Print handler
+ * @param table Mapping table
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+int mapping_table_debug(struct re_printf *pf,
+			const struct mapping_table *table)
+{
+	const struct shard *sh;
+	struct maptab_stats st;
+
+	if (!table)
+		return 0;
+
+	sh = shard_get(table);
+	if (!sh->store)
+		return 0;
+
+	maptab_stats(sh->store->mt, &st);
+
+	return re_hprintf(pf, "%u mappings, %u slots, load %u%%,"
+			  " probe max %u mean %u.%02u,"
+			  " %llu lookups, probe max %u mean %u.%02u,"
+			  " slab %H",
+			  st.count, st.slots, st.load, st.probe_max,
+			  st.probe_mean / 100, st.probe_mean % 100,
+			  (unsigned long long)st.lookups, st.lookup_max,
+			  st.lookup_mean / 100, st.lookup_mean % 100,
+			  slab_debug, sh->store->slab);
+}
+
+
+/* commit the queued operations synchronously, when exiting */
+static void table_commit(struct shard *sh, struct backend *be)
+{
+	struct mapping_table *table = sh->table;
+	struct batch batch;
+	struct le *le;
+	int err;
+
+	memset(&batch, 0, sizeof(batch));
+	batch.be   = be;
+	batch.name = table->name;
+
+	while ((le = list_head(&sh->opl))) {
+
+		struct op *op = le->data;
+
+		list_unlink(&op->le);
+		list_append(&batch.opl, &op->le, op);
+		++batch.n;
 	}
+
+	if (!batch.n)
+		return;
+
+	backend_lock();
+	err = batch_work(&batch);
+	backend_unlock();
+
 	if (err) {
-		warning("map: append rule failed (%m)\n", err);
-		goto out;
+		warning("mapping: `%s': commit of %u operations failed (%m)\n",
+			table->name, batch.n, err);
 	}
 
-	tmr_start(&mapping->tmr, lifetime * 1000, timeout, mapping);
+	list_flush(&batch.opl);
+}
 
-	hash_append(table->ht, key(proto, int_addr, remote_addr),
-		    &mapping->le, mapping);
 
-	mapping->committed = true;
+static void store_destructor(void *arg)
+{
+	struct store *st = arg;
+
+	maptab_flush(st->mt, flush_handler);
+	mem_deref(st->mt);
+	mem_deref(st->ext_mt);
+	mem_deref(st->subh);
+	mem_deref(st->wheel);
+	mem_deref(st->slab);
+
+	store = NULL;
+}
+
+
+static int store_alloc(struct store **stp)
+{
+	struct store *st;
+	int err;
+
+	st = mem_zalloc(sizeof(*st), store_destructor);
+	if (!st)
+		return ENOMEM;
+
+	if (!hash_keyed) {
+		rand_bytes(hash_key, sizeof(hash_key));
+		hash_keyed = true;
+	}
 
-	info("map: created mapping: proto=%s int=%J <---> ext=%J (%usec)\n",
-	     pcp_proto_name(mapping->map.proto),
-	     &mapping->int_addr, &mapping->map.ext_addr,
-	     lifetime);
+	/* all mappings are preallocated, if there is a limit */
+	(void)conf_get_u32(_conf(), "max_mappings", &st->max);
+	(void)conf_get_u32(_conf(), "subscriber_quota", &st->quota);
+
+	/* the limit is split between the workers */
+	if (st->max)
+		st->max = (st->max + worker_count() - 1) / worker_count();
+
+	err = slab_alloc(&st->slab, sizeof(struct mapping), st->max);
+	if (err)
+		goto out;
+
+	err = maptab_alloc(&st->mt, st->max);
+	if (err)
+		goto out;
+
+	err = maptab_alloc(&st->ext_mt, st->max);
+	if (err)
+		goto out;
+
+	err = wheel_alloc(&st->wheel, expire_handler, NULL);
+	if (err)
+		goto out;
+
+	err = hash_alloc(&st->subh, 1024);
+	if (err)
+		goto out;
+
+	store = st;
 
  out:
 	if (err)
-		mem_deref(mapping);
-	else if (mappingp)
-		*mappingp = mapping;
+		mem_deref(st);
+	else
+		*stp = st;
 
 	return err;
 }
 
 
-void mapping_refresh(struct mapping *mapping, uint32_t lifetime)
+struct collect {
+	const struct mapping_table *table;
+	struct mapping **v;
+	uint32_t n;
+};
+
+
+static bool collect_handler(void *item, void *arg)
 {
-	if (!mapping)
-		return;
+	struct mapping *mapping = item;
+	struct collect *c = arg;
+
+	if (mapping->table == c->table)
+		c->v[c->n++] = mapping;
 
-	tmr_start(&mapping->tmr, lifetime * 1000, timeout, mapping);
+	return false;
 }
 
 
-struct tuple {
-	int proto;
-	const struct sa *int_addr;
-	const struct sa *remote_addr;  /* PEER only */
-};
+static bool table_handler(void *item, void *arg)
+{
+	const struct mapping *mapping = item;
+
+	return mapping->table == arg;
+}
 
 
-static bool hash_cmp_handler(struct le *le, void *arg)
+/* delete the mappings of a table from the shared store */
+static void table_flush(struct mapping_table *table)
 {
-	const struct mapping *map = le->data;
-	const struct tuple *tup = arg;
+	struct maptab_stats st;
+	struct collect c;
+	struct mapping *mapping;
+	uint32_t i;
 
-	if (!sa_cmp(&map->int_addr, tup->int_addr, SA_ALL))
-		return false;
+	maptab_stats(store->mt, &st);
 
-	if (map->map.proto != tup->proto)
-		return false;
+	c.table = table;
+	c.n     = 0;
+	c.v     = mem_alloc(st.count * sizeof(*c.v) + 1, NULL);
 
-	if (sa_isset(tup->remote_addr, SA_ALL) &&
-	    !sa_cmp(&map->remote_addr, tup->remote_addr, SA_ALL))
-		return false;
+	if (c.v) {
+		(void)maptab_apply(store->mt, collect_handler, &c);
 
-	return true;
+		for (i = 0; i < c.n; i++)
+			mapping_delete(c.v[i]);
+
+		mem_deref(c.v);
+		return;
+	}
+
+	while ((mapping = maptab_apply(store->mt, table_handler, table)))
+		mapping_delete(mapping);
 }
 
 
-struct mapping *mapping_find(const struct mapping_table *table,
-			     int proto, const struct sa *int_addr)
+/* note: called from the worker of the shard */
+static int shard_open(void *arg)
 {
-	struct tuple tup;
+	struct shard *sh = arg;
+	int err;
+
+	if (store) {
+		sh->store = mem_ref(store);
+	}
+	else {
+		err = store_alloc(&sh->store);
+		if (err)
+			return err;
+	}
 
-	tup.proto       = proto;
-	tup.int_addr    = int_addr;
-	tup.remote_addr = NULL;
+	tmr_init(&sh->tmr);
 
-	return list_ledata(hash_lookup(table->ht, key(proto, int_addr, NULL),
-				       hash_cmp_handler, &tup));
+	return hash_alloc(&sh->oph, 64);
 }
 
 
-struct mapping *mapping_find_peer(const struct mapping_table *table,
-				  int proto, const struct sa *int_addr,
-				  const struct sa *remote_addr)
+/* note: called from the worker of the shard */
+static int shard_replay(void *arg)
 {
-	struct tuple tup;
+	struct shard *sh = arg;
+
+	journal_replay(sh->table->name, replay_handler, sh);
+
+	return 0;
+}
+
+
+/* note: called from the worker of the shard */
+static int shard_close(void *arg)
+{
+	struct shard *sh = arg;
+	struct mapping_table *table = sh->table;
+	struct backend *be;
+
+	be = backend_get();
 
-	tup.proto       = proto;
-	tup.int_addr    = int_addr;
-	tup.remote_addr = remote_addr;
+	debug("mapping: table `%s' destroyed (%H)\n", table->name,
+	      mapping_table_debug, table);
 
-	return list_ledata(hash_lookup(table->ht,
-				       key(proto, int_addr, remote_addr),
-				       hash_cmp_handler, &tup));
+	tmr_cancel(&sh->tmr);
+
+	if (sh->store)
+		table_flush(table);
+
+	sh->store = mem_deref(sh->store);
+
+	/* wait for the in-flight batch */
+	backend_sync();
+
+	if (sh->batch) {
+		sh->batch->shard = NULL;
+		list_flush(&sh->batch->opl);
+	}
+
+	/* the rules are kept, and adopted again at the next startup */
+	if (be && table->reconcile)
+		table_commit(sh, be);
+
+	list_flush(&sh->opl);
+	sh->oph = mem_deref(sh->oph);
+
+	return 0;
 }
 
 
@@ -240,19 +1976,29 @@ static void table_destructor(void *arg)
 {
 	struct mapping_table *table = arg;
 	struct backend *be;
+	uint32_t i;
 
 	be = backend_get();
 
-	debug("mapping: table `%s' destroyed\n", table->name);
-
+	list_unlink(&table->le);
 	table->exiting = true;
 
-	hash_flush(table->ht);
-	mem_deref(table->ht);
+	for (i = 0; i < table->shardc; i++) {
+
+		int err = worker_exec(i, shard_close, &table->shardv[i]);
+		if (err) {
+			warning("mapping: `%s': could not close shard %u"
+				" (%m)\n", table->name, i, err);
+		}
+	}
 
-	if (be)
+	if (be && !table->reconcile) {
+		backend_lock();
 		be->flush(table->name);
+		backend_unlock();
+	}
 
+	mem_deref(table->shardv);
 	mem_deref(table->name);
 }
 
@@ -260,6 +2006,7 @@ static void table_destructor(void *arg)
 int mapping_table_alloc(struct mapping_table **tablep, const char *name)
 {
 	struct mapping_table *table;
+	uint32_t i;
 	int err;
 
 	table = mem_zalloc(sizeof(*table), table_destructor);
@@ -270,10 +2017,6 @@ int mapping_table_alloc(struct mapping_table **tablep, const char *name)
 	if (err)
 		goto out;
 
-	err = hash_alloc(&table->ht, 64);
-	if (err)
-		goto out;
-
 	table->be = backend_get();
 	if (!table->be) {
 		warning("mapping: could not find a suitable backend\n");
@@ -281,16 +2024,58 @@ int mapping_table_alloc(struct mapping_table **tablep, const char *name)
 		goto out;
 	}
 
-	/* Flush and delete the backend table first */
-	table->be->flush(name);
+	table->queue_max = BACKEND_QUEUE_MAX;
+	(void)conf_get_u32(_conf(), "backend_queue", &table->queue_max);
+
+	table->reconcile = true;
+	(void)conf_get_bool(_conf(), "backend_reconcile", &table->reconcile);
+	if (!table->be->dump)
+		table->reconcile = false;
+
+	table->shardv = mem_zalloc(worker_count() * sizeof(*table->shardv),
+				   NULL);
+	if (!table->shardv) {
+		err = ENOMEM;
+		goto out;
+	}
+
+	for (i = 0; i < worker_count(); i++) {
+
+		table->shardv[i].table = table;
+		++table->shardc;
+
+		err = worker_exec(i, shard_open, &table->shardv[i]);
+		if (err)
+			goto out;
+	}
+
+	backend_lock();
+
+	if (table->reconcile) {
+		/* Adopt the rules of the previous instance */
+		err = table->be->dump(name, adopt_handler, table);
+		if (err == ENOENT)
+			err = table->be->new(name);
+	}
+	else {
+		/* Flush and delete the backend table first */
+		table->be->flush(name);
+		err = table->be->new(name);
+	}
+
+	backend_unlock();
 
-	err = table->be->new(name);
 	if (err) {
 		error("mapping: failed to create chain '%s' (%m)\n",
 		      name, err);
 		goto out;
 	}
 
+	list_append(&tablel, &table->le, table);
+
+	for (i = 0; i < table->shardc; i++)
+		(void)worker_exec(i, shard_replay, &table->shardv[i]);
+
 	info("mapping: created table `%s'\n", name);
 
  out:
@@ -0,0 +1,503 @@
+/**
+ * @file maptab.c  Open-addressing hash table of mappings
+ *
+ * Copyright (C) 2010 - 2016 Creytiv.com
+ */
+
+#include <string.h>
+#include <re.h>
+#include <repcpd.h>
+#include "pcpd.h"
+
+
+/*
+ * A flat array of slots with linear probing. Every slot holds the hash
+ * and a compact key of its item inline, so that a lookup only touches
+ * an item when both of them match. A removed slot is refilled by
+ * shifting the rest of its cluster back, there are no tombstones.
+ *
+ * The array is doubled when it is 3/4 full. The items are moved to the
+ * new array a few slots at a time, by the inserts and removes that
+ * follow, so that a resize never stalls the main loop. Until all items
+ * are moved, lookups search both arrays. In the old array, the slots
+ * that were moved or removed are marked so that probing goes on.
+ */
+
+
+enum {
+	MAPTAB_MIN   = 64,
+	MIGRATE_STEP = 64,
+};
+
+struct slot {
+	uint32_t hash;
+	uint32_t key;
+	void *item;     /* NULL if free */
+};
+
+struct maptab {
+	struct slot *slotv;
+	uint32_t size;       /* power of two, 0 when empty */
+	uint32_t count;      /* items in both arrays */
+	struct slot *oldv;   /* array being migrated */
+	uint32_t oldsize;
+	uint32_t oldpos;     /* next slot of the old array to migrate */
+	uint64_t lookups;
+	uint64_t probes;     /* slots visited by all lookups */
+	uint32_t probe_max;  /* slots visited by the worst lookup */
+};
+
+
+/* marks a slot of the old array that no longer holds an item */
+static uint8_t moved;
+#define MOVED ((void *)&moved)
+
+
+static void maptab_destructor(void *arg)
+{
+	struct maptab *mt = arg;
+
+	mem_deref(mt->slotv);
+	mem_deref(mt->oldv);
+}
+
+
+static uint32_t pow2(uint32_t n)
+{
+	uint32_t size = MAPTAB_MIN;
+
+	while (size < n && size < (1U << 31))
+		size <<= 1;
+
+	return size;
+}
+
+
+/**
+ * Allocate a mapping hash table
+ *
+ * @param mtp  Pointer to allocated table
+ * @param size Expected number of items, 0 for default
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+int maptab_alloc(struct maptab **mtp, uint32_t size)
+{
+	struct maptab *mt;
+
+	if (!mtp)
+		return EINVAL;
+
+	mt = mem_zalloc(sizeof(*mt), maptab_destructor);
+	if (!mt)
+		return ENOMEM;
+
+	mt->size  = pow2(size + size / 3);
+	mt->slotv = mem_zalloc(mt->size * sizeof(*mt->slotv), NULL);
+	if (!mt->slotv) {
+		mem_deref(mt);
+		return ENOMEM;
+	}
+
+	*mtp = mt;
+
+	return 0;
+}
+
+
+/* note: the new array always has a free slot */
+static void slot_put(struct slot *v, uint32_t size, const struct slot *s)
+{
+	const uint32_t mask = size - 1;
+	uint32_t i = s->hash & mask;
+
+	while (v[i].item)
+		i = (i + 1) & mask;
+
+	v[i] = *s;
+}
+
+
+static void migrate(struct maptab *mt, uint32_t n)
+{
+	while (mt->oldv && n--) {
+
+		struct slot *s = &mt->oldv[mt->oldpos];
+
+		if (s->item && s->item != MOVED) {
+			slot_put(mt->slotv, mt->size, s);
+			s->item = MOVED;
+		}
+
+		if (++mt->oldpos == mt->oldsize) {
+			mt->oldv    = mem_deref(mt->oldv);
+			mt->oldsize = 0;
+			mt->oldpos  = 0;
+		}
+	}
+}
+
+
+static int grow(struct maptab *mt)
+{
+	uint32_t size = mt->size ? mt->size * 2 : MAPTAB_MIN;
+	struct slot *v;
+
+	if (!size)
+		return ENOMEM;
+
+	/* the previous resize must be complete */
+	if (mt->oldv)
+		migrate(mt, mt->oldsize);
+
+	v = mem_zalloc(size * sizeof(*v), NULL);
+	if (!v)
+		return ENOMEM;
+
+	if (mt->size) {
+		mt->oldv    = mt->slotv;
+		mt->oldsize = mt->size;
+		mt->oldpos  = 0;
+	}
+
+	mt->slotv = v;
+	mt->size  = size;
+
+	debug("maptab: growing to %u slots (%u items)\n", size, mt->count);
+
+	return 0;
+}
+
+
+/**
+ * Insert an item into a mapping hash table
+ *
+ * @param mt   Mapping hash table
+ * @param hash Hash value of the item
+ * @param key  Compact key of the item, compared before the item
+ * @param item Item
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+int maptab_insert(struct maptab *mt, uint32_t hash, uint32_t key, void *item)
+{
+	struct slot s;
+	int err;
+
+	if (!mt || !item)
+		return EINVAL;
+
+	if ((uint64_t)(mt->count + 1) * 4 > (uint64_t)mt->size * 3) {
+		err = grow(mt);
+		if (err)
+			return err;
+	}
+
+	s.hash = hash;
+	s.key  = key;
+	s.item = item;
+
+	slot_put(mt->slotv, mt->size, &s);
+	++mt->count;
+
+	migrate(mt, MIGRATE_STEP);
+
+	return 0;
+}
+
+
+static void *array_lookup(const struct slot *v, uint32_t size,
+			  uint32_t hash, uint32_t key,
+			  maptab_cmp_h *cmph, void *arg, uint32_t *probes)
+{
+	const uint32_t mask = size - 1;
+	uint32_t i = hash & mask;
+	uint32_t n;
+
+	for (n = 0; n < size; n++, i = (i + 1) & mask) {
+
+		const struct slot *s = &v[i];
+
+		++*probes;
+
+		if (!s->item)
+			break;
+
+		if (s->item == MOVED || s->hash != hash || s->key != key)
+			continue;
+
+		if (!cmph || cmph(s->item, arg))
+			return s->item;
+	}
+
+	return NULL;
+}
+
+
+/**
+ * Find an item in a mapping hash table
+ *
+ * @param mt   Mapping hash table
+ * @param hash Hash value of the item
+ * @param key  Compact key of the item
+ * @param cmph Compare handler, called for items with the same hash and key
+ * @param arg  Handler argument
+ *
+ * @return Item if found, otherwise NULL
+ */
+void *maptab_lookup(struct maptab *mt, uint32_t hash, uint32_t key,
+		    maptab_cmp_h *cmph, void *arg)
+{
+	uint32_t probes = 0;
+	void *item = NULL;
+
+	if (!mt)
+		return NULL;
+
+	if (mt->size)
+		item = array_lookup(mt->slotv, mt->size, hash, key,
+				    cmph, arg, &probes);
+
+	if (!item && mt->oldv)
+		item = array_lookup(mt->oldv, mt->oldsize, hash, key,
+				    cmph, arg, &probes);
+
+	++mt->lookups;
+	mt->probes   += probes;
+	mt->probe_max = max(mt->probe_max, probes);
+
+	return item;
+}
+
+
+static bool array_remove(struct slot *v, uint32_t size, uint32_t hash,
+			 const void *item)
+{
+	const uint32_t mask = size - 1;
+	uint32_t i = hash & mask, j, n;
+
+	for (n = 0; n < size; n++, i = (i + 1) & mask) {
+
+		if (!v[i].item)
+			return false;
+
+		if (v[i].item == item)
+			break;
+	}
+
+	if (n == size)
+		return false;
+
+	/* move back the items of the cluster that may fill the hole */
+	for (j = (i + 1) & mask; v[j].item; j = (j + 1) & mask) {
+
+		const uint32_t home = v[j].hash & mask;
+
+		if (((j - home) & mask) >= ((j - i) & mask)) {
+			v[i] = v[j];
+			i = j;
+		}
+	}
+
+	memset(&v[i], 0, sizeof(v[i]));
+
+	return true;
+}
+
+
+static bool old_remove(struct slot *v, uint32_t size, uint32_t hash,
+		       const void *item)
+{
+	const uint32_t mask = size - 1;
+	uint32_t i = hash & mask;
+	uint32_t n;
+
+	for (n = 0; n < size; n++, i = (i + 1) & mask) {
+
+		if (!v[i].item)
+			return false;
+
+		if (v[i].item == item) {
+			v[i].item = MOVED;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+
+/**
+ * Remove an item from a mapping hash table
+ *
+ * @param mt   Mapping hash table
+ * @param hash Hash value of the item
+ * @param item Item to remove
+ */
+void maptab_remove(struct maptab *mt, uint32_t hash, const void *item)
+{
+	bool found = false;
+
+	if (!mt || !item)
+		return;
+
+	if (mt->size)
+		found = array_remove(mt->slotv, mt->size, hash, item);
+
+	if (!found && mt->oldv)
+		found = old_remove(mt->oldv, mt->oldsize, hash, item);
+
+	if (!found)
+		return;
+
+	--mt->count;
+
+	migrate(mt, MIGRATE_STEP);
+}
+
+
+/**
+ * Apply a handler to all items of a mapping hash table. The handler
+ * must not insert or remove items.
+ *
+ * @param mt   Mapping hash table
+ * @param h    Apply handler, returns true to stop
+ * @param arg  Handler argument
+ *
+ * @return Item where the handler stopped, otherwise NULL
+ */
+void *maptab_apply(const struct maptab *mt, maptab_apply_h *h, void *arg)
+{
+	uint32_t i;
+
+	if (!mt || !h)
+		return NULL;
+
+	for (i = 0; i < mt->size; i++) {
+
+		void *item = mt->slotv[i].item;
+
+		if (item && h(item, arg))
+			return item;
+	}
+
+	for (i = 0; mt->oldv && i < mt->oldsize; i++) {
+
+		void *item = mt->oldv[i].item;
+
+		if (item && item != MOVED && h(item, arg))
+			return item;
+	}
+
+	return NULL;
+}
+
+
+/**
+ * Free all items of a mapping hash table. The items may remove
+ * themselves from the table in the free handler.
+ *
+ * @param mt Mapping hash table
+ * @param fh Free handler
+ */
+void maptab_flush(struct maptab *mt, maptab_free_h *fh)
+{
+	struct slot *v, *ov;
+	uint32_t size, oldsize, i;
+
+	if (!mt || !fh)
+		return;
+
+	v       = mt->slotv;
+	size    = mt->size;
+	ov      = mt->oldv;
+	oldsize = mt->oldsize;
+
+	mt->slotv   = NULL;
+	mt->size    = 0;
+	mt->count   = 0;
+	mt->oldv    = NULL;
+	mt->oldsize = 0;
+	mt->oldpos  = 0;
+
+	for (i = 0; i < size; i++) {
+		if (v[i].item)
+			fh(v[i].item);
+	}
+
+	for (i = 0; i < oldsize; i++) {
+		if (ov[i].item && ov[i].item != MOVED)
+			fh(ov[i].item);
+	}
+
+	mem_deref(v);
+	mem_deref(ov);
+}
+
+
+/**
+ * Get the statistics of a mapping hash table. The probe length of an
+ * item is the number of slots that a lookup of the item visits. The
+ * lookup counters include the lookups of items that were not found.
+ *
+ * @param mt Mapping hash table
+ * @param st Statistics
+ */
+void maptab_stats(const struct maptab *mt, struct maptab_stats *st)
+{
+	uint64_t total = 0;
+	uint32_t i, n = 0;
+
+	if (!st)
+		return;
+
+	memset(st, 0, sizeof(*st));
+
+	if (!mt)
+		return;
+
+	st->slots = mt->size + mt->oldsize;
+	st->count = mt->count;
+
+	for (i = 0; i < mt->size; i++) {
+
+		const struct slot *s = &mt->slotv[i];
+		uint32_t probe;
+
+		if (!s->item)
+			continue;
+
+		probe = ((i - s->hash) & (mt->size - 1)) + 1;
+
+		st->probe_max = max(st->probe_max, probe);
+		total += probe;
+		++n;
+	}
+
+	for (i = 0; mt->oldv && i < mt->oldsize; i++) {
+
+		const struct slot *s = &mt->oldv[i];
+		uint32_t probe;
+
+		if (!s->item || s->item == MOVED)
+			continue;
+
+		probe = ((i - s->hash) & (mt->oldsize - 1)) + 1;
+
+		st->probe_max = max(st->probe_max, probe);
+		total += probe;
+		++n;
+	}
+
+	/* in 1/100 */
+	if (n)
+		st->probe_mean = (uint32_t)(total * 100 / n);
+
+	if (st->slots)
+		st->load = (uint32_t)((uint64_t)st->count * 100 / st->slots);
+
+	st->lookups    = mt->lookups;
+	st->lookup_max = mt->probe_max;
+	if (mt->lookups)
+		st->lookup_mean = (uint32_t)(mt->probes * 100 / mt->lookups);
+}
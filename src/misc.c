@@ -57,3 +57,76 @@ int conf_get_range(const struct conf *conf, const char *name,
 
 	return 0;
 }
+
+
+static uint64_t le64(const uint8_t *p)
+{
+	return (uint64_t)p[0]       | (uint64_t)p[1] << 8  |
+		(uint64_t)p[2] << 16 | (uint64_t)p[3] << 24 |
+		(uint64_t)p[4] << 32 | (uint64_t)p[5] << 40 |
+		(uint64_t)p[6] << 48 | (uint64_t)p[7] << 56;
+}
+
+
+static uint64_t rotl(uint64_t x, int b)
+{
+	return x << b | x >> (64 - b);
+}
+
+
+static void sipround(uint64_t v[4])
+{
+	v[0] += v[1]; v[1] = rotl(v[1], 13); v[1] ^= v[0];
+	v[0] = rotl(v[0], 32);
+	v[2] += v[3]; v[3] = rotl(v[3], 16); v[3] ^= v[2];
+	v[0] += v[3]; v[3] = rotl(v[3], 21); v[3] ^= v[0];
+	v[2] += v[1]; v[1] = rotl(v[1], 17); v[1] ^= v[2];
+	v[2] = rotl(v[2], 32);
+}
+
+
+/**
+ * Calculate the SipHash-2-4 of a buffer
+ *
+ * @param key Secret key
+ * @param p   Buffer
+ * @param len Length of buffer
+ *
+ * @return Hash value
+ */
+uint64_t siphash(const uint8_t key[16], const uint8_t *p, size_t len)
+{
+	const uint64_t k0 = le64(key), k1 = le64(key + 8);
+	const uint8_t *end = p + (len & ~(size_t)7);
+	uint64_t v[4], m, b = (uint64_t)len << 56;
+	size_t i;
+
+	v[0] = k0 ^ 0x736f6d6570736575ULL;
+	v[1] = k1 ^ 0x646f72616e646f6dULL;
+	v[2] = k0 ^ 0x6c7967656e657261ULL;
+	v[3] = k1 ^ 0x7465646279746573ULL;
+
+	for (; p != end; p += 8) {
+		m = le64(p);
+		v[3] ^= m;
+		sipround(v);
+		sipround(v);
+		v[0] ^= m;
+	}
+
+	for (i = 0; i < (len & 7); i++)
+		b |= (uint64_t)p[i] << (8 * i);
+
+	v[3] ^= b;
+	sipround(v);
+	sipround(v);
+	v[0] ^= b;
+
+	v[2] ^= 0xff;
+	sipround(v);
+	sipround(v);
+	sipround(v);
+	sipround(v);
+
+	return v[0] ^ v[1] ^ v[2] ^ v[3];
+}
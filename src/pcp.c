@@ -10,25 +10,801 @@
 #include "pcpd.h"
 
 
+/*
+ * The requests are decoded into a message on the stack. The options are
+ * not decoded up front, only checked for their length, and are decoded
+ * by repcpd_msg_option() when a handler asks for them. The decoded
+ * options are kept in a per-thread arena, which is rewound when the
+ * request is done -- the request path takes no heap allocations.
+ */
+
+enum {
+	HDR_SZ     = 24,
+	MAP_SZ     = 36,
+	PEER_SZ    = 56,
+	OPT_HDR_SZ = 4,
+	ARENA_SIZE = 65536,
+	DUP_SLOTS  = 256,
+	DUP_REPLY_MAX = 128,
+	LIMIT_SETS = 1024,
+	LIMIT_WAYS = 4,
+};
+
+/*
+ * A recent reply, for the retransmissions of its request. The request is
+ * known by its source, opcode, nonce, length and hash. A request whose
+ * reply waits for the backend is pending, its retransmissions are
+ * dropped until the reply is sent, see repcpd_dupcache_store().
+ */
+struct dup {
+	struct sa src;
+	uint8_t nonce[PCP_NONCE_SZ];
+	uint8_t opcode;
+	uint16_t len;
+	uint32_t hash;
+	uint64_t expires;          /* [ms] */
+	bool pending;
+	uint16_t reply_len;
+	uint8_t reply[DUP_REPLY_MAX];
+};
+
+/* the request that is dispatched to the modules, by thread */
+static __thread struct {
+	struct pcp_msg *msg;
+	struct mbuf *mb;
+	size_t optpos;
+} cur;
+
+static __thread struct {
+	uint64_t buf[ARENA_SIZE / sizeof(uint64_t)];
+	size_t pos;
+} arena;
+
+/* the token buckets of a subscriber, in [milli-tokens] */
+struct bucket {
+	struct maddr sub;
+	uint32_t tok_new;          /* requests that create or delete */
+	uint32_t tok_refresh;
+	uint64_t last;             /* [ms], 0 if unused */
+};
+
+/* a budget of a bucket, 0 rate if unlimited */
+struct budget {
+	uint32_t rate;             /* [requests/second] */
+	uint32_t burst;            /* [requests] */
+};
+
+/* the duplicate cache, by thread -- the subscriber stays on its worker */
+static __thread struct {
+	struct dup dupv[DUP_SLOTS];
+} dupc;
+
+static __thread struct {
+	uint64_t dup_hits;
+	uint64_t dup_misses;
+	uint64_t dup_pending;      /* dropped, the reply is pending */
+	uint64_t dropped;          /* by the prefilter */
+	uint64_t rejected;         /* by the prefilter, with an error */
+	uint64_t limited;          /* over the rate limit */
+} stats;
+
+/*
+ * The token buckets, by thread. The table is set-associative, a new
+ * subscriber takes the least recently used bucket of its set. An idle
+ * bucket is full anyway, so it expires without a timer.
+ */
+static __thread struct bucket *bucketv;
+
 static struct {
 	struct list pcpl;
 	uint32_t lifetime_min;
 	uint32_t lifetime_max;
+	uint32_t prefix6;          /* IPv6 subscriber prefix length */
+	uint32_t dup_ttl;          /* [ms], 0 to disable the cache */
+	struct budget lim_new;
+	struct budget lim_refresh;
 } pcpx = {
 	.lifetime_min = LIFETIME_MIN,
 	.lifetime_max = LIFETIME_MAX,
+	.prefix6      = 64,
+	.dup_ttl      = 4000,
 };
 
 
+static void *arena_alloc(size_t size)
+{
+	void *p;
+
+	size = (size + sizeof(uint64_t) - 1) & ~(sizeof(uint64_t) - 1);
+
+	if (size > sizeof(arena.buf) - arena.pos)
+		return NULL;
+
+	p = (uint8_t *)arena.buf + arena.pos;
+	arena.pos += size;
+
+	return p;
+}
+
+
+static int map_decode(struct pcp_map *map, struct mbuf *mb)
+{
+	uint16_t port;
+	int err;
+
+	if (mbuf_get_left(mb) < MAP_SZ)
+		return EBADMSG;
+
+	(void)mbuf_read_mem(mb, map->nonce, sizeof(map->nonce));
+	map->proto = mbuf_read_u8(mb);
+	mbuf_advance(mb, 3);
+	map->int_port = ntohs(mbuf_read_u16(mb));
+	port = ntohs(mbuf_read_u16(mb));
+
+	err = pcp_ipaddr_decode(mb, &map->ext_addr);
+	if (err)
+		return err;
+
+	sa_set_port(&map->ext_addr, port);
+
+	return 0;
+}
+
+
+static int peer_decode(struct pcp_peer *peer, struct mbuf *mb)
+{
+	uint16_t port;
+	int err;
+
+	if (mbuf_get_left(mb) < PEER_SZ)
+		return EBADMSG;
+
+	err = map_decode(&peer->map, mb);
+	if (err)
+		return err;
+
+	port = ntohs(mbuf_read_u16(mb));
+	mbuf_advance(mb, 2);
+
+	err = pcp_ipaddr_decode(mb, &peer->remote_addr);
+	if (err)
+		return err;
+
+	sa_set_port(&peer->remote_addr, port);
+
+	return 0;
+}
+
+
+/* reads the header of the next option, with its code and data length */
+static int opt_next(struct mbuf *mb, uint8_t *code, size_t *len)
+{
+	if (mbuf_get_left(mb) < OPT_HDR_SZ)
+		return ENOENT;
+
+	*code = mbuf_read_u8(mb);
+	(void)mbuf_read_u8(mb);
+	*len = ntohs(mbuf_read_u16(mb));
+
+	if (mbuf_get_left(mb) < *len)
+		return EBADMSG;
+
+	return 0;
+}
+
+
+/* note: the padding of the last option may be missing */
+static void opt_skip(struct mbuf *mb, size_t len)
+{
+	len += (4 - (len & 3)) & 3;
+
+	mbuf_advance(mb, min(len, mbuf_get_left(mb)));
+}
+
+
+/* decodes the header and the payload, and checks the options */
+static int msg_decode(struct pcp_msg *msg, struct mbuf *mb)
+{
+	uint8_t b, code;
+	size_t len;
+	int err;
+
+	memset(msg, 0, sizeof(*msg));
+	list_init(&msg->optionl);
+
+	if (mbuf_get_left(mb) < HDR_SZ)
+		return EBADMSG;
+
+	msg->hdr.version = mbuf_read_u8(mb);
+	b = mbuf_read_u8(mb);
+	msg->hdr.resp   = b >> 7;
+	msg->hdr.opcode = b & 0x7f;
+
+	/* responses are ignored, only the header is decoded */
+	if (msg->hdr.resp) {
+		(void)mbuf_read_u8(mb);
+		msg->hdr.result   = mbuf_read_u8(mb);
+		msg->hdr.lifetime = ntohl(mbuf_read_u32(mb));
+		msg->hdr.epoch    = ntohl(mbuf_read_u32(mb));
+		mbuf_advance(mb, 12);
+		return 0;
+	}
+
+	(void)mbuf_read_u16(mb);
+	msg->hdr.lifetime = ntohl(mbuf_read_u32(mb));
+
+	err = pcp_ipaddr_decode(mb, &msg->hdr.cli_addr);
+	if (err)
+		return err;
+
+	switch (msg->hdr.opcode) {
+
+	case PCP_MAP:
+		err = map_decode(&msg->pld.map, mb);
+		break;
+
+	case PCP_PEER:
+		err = peer_decode(&msg->pld.peer, mb);
+		break;
+
+	default:
+		break;
+	}
+
+	if (err)
+		return err;
+
+	/* the options are decoded later, on request */
+	while (!(err = opt_next(mb, &code, &len)))
+		opt_skip(mb, len);
+
+	return err == ENOENT ? 0 : err;
+}
+
+
+static int opt_decode(struct pcp_option *opt, struct mbuf *mb, size_t len)
+{
+	uint16_t port;
+	char *str;
+	int err;
+
+	switch (opt->code) {
+
+	case PCP_OPTION_THIRD_PARTY:
+		if (len < 16)
+			return EBADMSG;
+
+		return pcp_ipaddr_decode(mb, &opt->u.third_party);
+
+	case PCP_OPTION_FILTER:
+		if (len < 20)
+			return EBADMSG;
+
+		(void)mbuf_read_u8(mb);
+		opt->u.filter.prefix_length = mbuf_read_u8(mb);
+		port = ntohs(mbuf_read_u16(mb));
+
+		err = pcp_ipaddr_decode(mb, &opt->u.filter.remote_peer);
+		if (err)
+			return err;
+
+		sa_set_port(&opt->u.filter.remote_peer, port);
+		return 0;
+
+	case PCP_OPTION_DESCRIPTION:
+		str = arena_alloc(len + 1);
+		if (!str)
+			return ENOMEM;
+
+		(void)mbuf_read_mem(mb, (uint8_t *)str, len);
+		str[len] = '\0';
+		opt->u.description = str;
+		return 0;
+
+	default:
+		return 0;
+	}
+}
+
+
+/**
+ * Find an option of a PCP request. The options of the request that is
+ * being handled are decoded on the first lookup.
+ *
+ * @param msg  PCP message
+ * @param code Option code
+ *
+ * @return PCP option if found, otherwise NULL
+ */
+struct pcp_option *repcpd_msg_option(const struct pcp_msg *msg,
+				     enum pcp_option_code code)
+{
+	struct pcp_option *opt;
+	struct mbuf mb;
+	uint8_t c;
+	size_t len;
+	int err;
+
+	if (!msg)
+		return NULL;
+
+	/* a message of libre's decoder, with all the options */
+	if (msg != cur.msg)
+		return pcp_msg_option(msg, code);
+
+	opt = pcp_msg_option(msg, code);
+	if (opt)
+		return opt;
+
+	/* a view of the request, the handler may reuse the buffer */
+	mb = *cur.mb;
+	mb.pos = cur.optpos;
+
+	while (!opt_next(&mb, &c, &len)) {
+
+		if (c != code) {
+			opt_skip(&mb, len);
+			continue;
+		}
+
+		opt = arena_alloc(sizeof(*opt));
+		if (!opt)
+			break;
+
+		memset(opt, 0, sizeof(*opt));
+		opt->code = code;
+
+		err = opt_decode(opt, &mb, len);
+		if (err) {
+			debug("pcp: could not decode option %u (%m)\n",
+			      code, err);
+			return NULL;
+		}
+
+		list_append(&cur.msg->optionl, &opt->le, opt);
+
+		return opt;
+	}
+
+	return NULL;
+}
+
+
+static bool prefilter_addr(const uint8_t *p, const struct sa *src)
+{
+	static const uint8_t v4mapped[12] = {
+		0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff
+	};
+
+	switch (sa_af(src)) {
+
+	case AF_INET:
+		return !memcmp(p, v4mapped, sizeof(v4mapped)) &&
+			!memcmp(p + 12, &src->u.in.sin_addr, 4);
+
+	case AF_INET6:
+		return !memcmp(p, &src->u.in6.sin6_addr, 16);
+
+	default:
+		return false;
+	}
+}
+
+
+/*
+ * Checks the fixed fields of the request header, before the decode. The
+ * datagrams that RFC 6887 says to drop silently (too short, too long,
+ * or a response) return PCP_SUCCESS, the others an error result -- a
+ * length that is not a multiple of 4 is a malformed request. No address
+ * is formatted for a log line.
+ */
+static enum pcp_result prefilter(const struct sa *src,
+				 const struct mbuf *mb, bool *ok)
+{
+	const uint8_t *p = mbuf_buf(mb);
+	const size_t len = mbuf_get_left(mb);
+
+	*ok = false;
+
+	if (len < PCP_MIN_PACKET || len > PCP_MAX_PACKET)
+		return PCP_SUCCESS;
+
+	if (p[1] & 0x80)
+		return PCP_SUCCESS;
+
+	if (p[0] != PCP_VERSION)
+		return PCP_UNSUPP_VERSION;
+
+	if (len & 3)
+		return PCP_MALFORMED_REQUEST;
+
+	switch (p[1]) {
+
+	case PCP_ANNOUNCE:
+		break;
+
+	case PCP_MAP:
+		if (len < HDR_SZ + MAP_SZ)
+			return PCP_MALFORMED_REQUEST;
+		break;
+
+	case PCP_PEER:
+		if (len < HDR_SZ + PEER_SZ)
+			return PCP_MALFORMED_REQUEST;
+		break;
+
+	default:
+		return PCP_UNSUPP_OPCODE;
+	}
+
+	if (!prefilter_addr(p + 8, src))
+		return PCP_ADDRESS_MISMATCH;
+
+	*ok = true;
+
+	return PCP_SUCCESS;
+}
+
+
+/* the error reply is written over the header, like pcp_ereply() */
+static void prefilter_ereply(struct udp_sock *us, const struct sa *src,
+			     struct mbuf *mb, enum pcp_result result)
+{
+	uint8_t *p = mbuf_buf(mb);
+	uint32_t epoch = htonl(repcpd_epoch_time());
+
+	p[0] = PCP_VERSION;
+	p[1] |= 0x80;
+	p[2] = 0x00;
+	p[3] = result;
+	memset(p + 4, 0, 4);
+	memcpy(p + 8, &epoch, 4);
+	memset(p + 12, 0, 12);
+
+	(void)udp_send(us, src, mb);
+}
+
+
+/* the nonce of a MAP or PEER request, or zero */
+static void dup_nonce(uint8_t nonce[PCP_NONCE_SZ], const struct mbuf *mb)
+{
+	const uint8_t *p = mbuf_buf(mb);
+	const uint8_t opcode = p[1] & 0x7f;
+
+	if ((opcode == PCP_MAP || opcode == PCP_PEER) &&
+	    mbuf_get_left(mb) >= HDR_SZ + PCP_NONCE_SZ)
+		memcpy(nonce, p + HDR_SZ, PCP_NONCE_SZ);
+	else
+		memset(nonce, 0, PCP_NONCE_SZ);
+}
+
+
+static struct dup *dup_slot(const struct sa *src, uint32_t hash)
+{
+	return &dupc.dupv[(hash ^ sa_hash(src, SA_ALL)) % DUP_SLOTS];
+}
+
+
+static bool dup_match(const struct dup *d, const struct sa *src,
+		      const struct mbuf *mb, uint32_t hash)
+{
+	uint8_t nonce[PCP_NONCE_SZ];
+
+	if ((!d->reply_len && !d->pending) || d->expires <= tmr_jiffies())
+		return false;
+
+	if (d->hash != hash || d->len != mbuf_get_left(mb) ||
+	    d->opcode != (mbuf_buf(mb)[1] & 0x7f))
+		return false;
+
+	dup_nonce(nonce, mb);
+
+	return !memcmp(d->nonce, nonce, PCP_NONCE_SZ) &&
+		sa_cmp(&d->src, src, SA_ALL);
+}
+
+
+/* answers a retransmission with the reply of the first request */
+static bool dup_reply(struct udp_sock *us, const struct sa *src,
+		      struct mbuf *mb, uint32_t hash)
+{
+	struct dup *d = dup_slot(src, hash);
+	const size_t start = mb->pos;
+	uint32_t v;
+	int err;
+
+	if (!dup_match(d, src, mb, hash)) {
+		++stats.dup_misses;
+		return false;
+	}
+
+	/* the first request is answered when it is committed */
+	if (d->pending) {
+		++stats.dup_pending;
+		return true;
+	}
+
+	++stats.dup_hits;
+
+	err = mbuf_write_mem(mb, d->reply, d->reply_len);
+	if (err) {
+		mb->pos = start;
+		return false;
+	}
+
+	mb->end = mb->pos;
+	mb->pos = start;
+
+	v = htonl(repcpd_epoch_time());
+	memcpy(&mb->buf[start + 8], &v, sizeof(v));
+
+	err = udp_send(us, src, mb);
+	if (err)
+		warning("pcp: duplicate reply to %J failed (%m)\n", src, err);
+
+	return true;
+}
+
+
+/*
+ * Keeps the reply that was sent for a request. The replies of
+ * pcp_reply() and mapping_reply() are written over the request, so the
+ * buffer holds a response if the request was answered right away, and
+ * still the request if the reply was deferred.
+ */
+static void dup_store(const struct sa *src, const struct mbuf *mb,
+		      const struct dup_key *key)
+{
+	const uint8_t *p = mbuf_buf(mb);
+	struct dup *d = dup_slot(src, key->hash);
+
+	if (mbuf_get_left(mb) < HDR_SZ || !(p[1] & 0x80))
+		return;
+
+	/* the reply of the pending request of the slot */
+	if (d->pending && d->hash == key->hash && d->len == key->len &&
+	    !memcmp(d->nonce, key->nonce, PCP_NONCE_SZ) &&
+	    sa_cmp(&d->src, src, SA_ALL)) {
+		d->pending   = false;
+		d->reply_len = 0;
+	}
+
+	if (mbuf_get_left(mb) > DUP_REPLY_MAX)
+		return;
+
+	/* an error may be gone at the retransmission */
+	if (p[0] != PCP_VERSION || !(p[1] & 0x80) || p[3] != PCP_SUCCESS)
+		return;
+
+	d->src     = *src;
+	d->opcode  = p[1] & 0x7f;
+	d->len     = key->len;
+	d->hash    = key->hash;
+	d->expires = tmr_jiffies() + pcpx.dup_ttl;
+	d->pending = false;
+	memcpy(d->nonce, key->nonce, PCP_NONCE_SZ);
+	memcpy(d->reply, p, mbuf_get_left(mb));
+	d->reply_len = (uint16_t)mbuf_get_left(mb);
+}
+
+
+/* an ANNOUNCE, or a request with a lifetime for an existing mapping */
+static bool is_refresh(const struct pcp_msg *msg)
+{
+	struct le *le;
+
+	if (msg->hdr.opcode == PCP_ANNOUNCE)
+		return true;
+
+	if (!msg->hdr.lifetime)
+		return false;
+
+	for (le = pcpx.pcpl.head; le; le = le->next) {
+
+		struct repcpd_pcp *st = le->data;
+
+		if (st->existh && st->existh(msg))
+			return true;
+	}
+
+	return false;
+}
+
+
+static uint32_t bucket_refill(uint32_t tok, const struct budget *b,
+			      uint64_t elapsed)
+{
+	const uint64_t max = (uint64_t)b->burst * 1000;
+
+	return (uint32_t)min(max, tok + elapsed * b->rate);
+}
+
+
+static struct bucket *bucket_get(const struct sa *src, uint64_t now)
+{
+	struct bucket *set, *bk = NULL;
+	struct maddr key;
+	struct sa sub;
+	uint32_t i;
+
+	if (!bucketv) {
+		bucketv = mem_zalloc(LIMIT_SETS * LIMIT_WAYS *
+				     sizeof(*bucketv), NULL);
+		if (!bucketv)
+			return NULL;
+	}
+
+	repcpd_subscriber(&sub, src);
+	maddr_set(&key, &sub);
+
+	set = &bucketv[(sa_hash(&sub, SA_ADDR) % LIMIT_SETS) * LIMIT_WAYS];
+
+	for (i = 0; i < LIMIT_WAYS; i++) {
+
+		if (set[i].last && set[i].sub.af == key.af &&
+		    !memcmp(set[i].sub.addr, key.addr, sizeof(key.addr)))
+			return &set[i];
+
+		if (!bk || set[i].last < bk->last)
+			bk = &set[i];
+	}
+
+	bk->sub         = key;
+	bk->tok_new     = pcpx.lim_new.burst * 1000;
+	bk->tok_refresh = pcpx.lim_refresh.burst * 1000;
+	bk->last        = now;
+
+	return bk;
+}
+
+
+/* takes a token of the budget of the request, false if over the limit */
+static bool limit_check(const struct sa *src, const struct pcp_msg *msg)
+{
+	const bool refresh = is_refresh(msg);
+	const struct budget *b = refresh ? &pcpx.lim_refresh : &pcpx.lim_new;
+	const uint64_t now = tmr_jiffies();
+	struct bucket *bk;
+	uint32_t *tok;
+
+	if (!b->rate)
+		return true;
+
+	bk = bucket_get(src, now);
+	if (!bk)
+		return true;
+
+	bk->tok_new = bucket_refill(bk->tok_new, &pcpx.lim_new,
+				    now - bk->last);
+	bk->tok_refresh = bucket_refill(bk->tok_refresh, &pcpx.lim_refresh,
+					now - bk->last);
+	bk->last = now;
+
+	tok = refresh ? &bk->tok_refresh : &bk->tok_new;
+
+	if (*tok < 1000)
+		return false;
+
+	*tok -= 1000;
+
+	return true;
+}
+
+
+/**
+ * Forget the cached replies of a subscriber, when one of its mappings is
+ * created or deleted
+ *
+ * @param addr Address of the subscriber
+ */
+void repcpd_dupcache_flush(const struct sa *addr)
+{
+	struct sa sub, dsub;
+	uint32_t i;
+
+	if (!addr || !pcpx.dup_ttl)
+		return;
+
+	repcpd_subscriber(&sub, addr);
+
+	for (i = 0; i < DUP_SLOTS; i++) {
+
+		struct dup *d = &dupc.dupv[i];
+
+		/* a pending request is answered in any case */
+		if (!d->reply_len)
+			continue;
+
+		repcpd_subscriber(&dsub, &d->src);
+
+		if (sa_cmp(&dsub, &sub, SA_ADDR))
+			d->reply_len = 0;
+	}
+}
+
+
+/**
+ * Get the duplicate cache key of a request
+ *
+ * @param key Key to set, with a zero length if the cache is disabled
+ * @param req Request message
+ */
+void repcpd_dupcache_key(struct dup_key *key, const struct mbuf *req)
+{
+	if (!key)
+		return;
+
+	memset(key, 0, sizeof(*key));
+
+	if (!req || !pcpx.dup_ttl || mbuf_get_left(req) < HDR_SZ)
+		return;
+
+	key->len  = (uint16_t)mbuf_get_left(req);
+	key->hash = hash_joaat(mbuf_buf(req), key->len);
+	dup_nonce(key->nonce, req);
+}
+
+
+/**
+ * Drop the retransmissions of a request whose reply is deferred until
+ * the backend commit, see mapping_reply()
+ *
+ * @param src Source of the request
+ * @param req Request message
+ */
+void repcpd_dupcache_defer(const struct sa *src, const struct mbuf *req)
+{
+	struct dup_key key;
+	struct dup *d;
+
+	if (!src || !req)
+		return;
+
+	repcpd_dupcache_key(&key, req);
+	if (!key.len)
+		return;
+
+	d = dup_slot(src, key.hash);
+
+	d->src       = *src;
+	d->opcode    = mbuf_buf(req)[1] & 0x7f;
+	d->len       = key.len;
+	d->hash      = key.hash;
+	d->expires   = tmr_jiffies() + pcpx.dup_ttl;
+	d->pending   = true;
+	d->reply_len = 0;
+	memcpy(d->nonce, key.nonce, PCP_NONCE_SZ);
+}
+
+
+/**
+ * Keep a deferred reply for the retransmissions of its request, and
+ * stop dropping them. The reply was written over the request.
+ *
+ * @param src Source of the request
+ * @param rsp Response message
+ * @param key Key of the request, see repcpd_dupcache_key()
+ */
+void repcpd_dupcache_store(const struct sa *src, const struct mbuf *rsp,
+			   const struct dup_key *key)
+{
+	if (!src || !rsp || !key || !key->len)
+		return;
+
+	dup_store(src, rsp, key);
+}
+
+
 void repcpd_process_msg(struct udp_sock *us, const struct sa *src,
 			const struct sa *dst, struct mbuf *mb)
 {
+	struct dup_key key;
 	struct pcp_option *opt;
-	struct pcp_msg *msg = NULL;
+	struct pcp_msg msgs, *msg = &msgs;
 	enum pcp_result result = PCP_SUCCESS;
 	struct le *le;
-	size_t start;
-	bool handled = false;
+	size_t start, mark = arena.pos;
+	bool handled = false, ok;
 	int err;
 
 	if (!us || !src || !dst || !mb)
@@ -37,14 +813,28 @@ void repcpd_process_msg(struct udp_sock *us, const struct sa *src,
 	debug("pcp: received %zu bytes from %J\n",
 	      mbuf_get_left(mb), src);
 
-	if (mbuf_get_left(mb) < PCP_MIN_PACKET) {
-		warning("pcp: ignore short packet from %J\n", src);
+	result = prefilter(src, mb, &ok);
+	if (!ok) {
+		if (result == PCP_SUCCESS) {
+			++stats.dropped;
+		}
+		else {
+			++stats.rejected;
+			prefilter_ereply(us, src, mb, result);
+		}
+
 		return;
 	}
 
 	start = mb->pos;
 
-	err = pcp_msg_decode(&msg, mb);
+	/* a retransmission of a request that was just answered */
+	repcpd_dupcache_key(&key, mb);
+	if (key.len && dup_reply(us, src, mb, key.hash))
+		return;
+
+	err = msg_decode(msg, mb);
+	cur.optpos = mb->pos;
 	mb->pos = start;
 	if (err) {
 		warning("pcp: could not decode message from %J (%m)\n",
@@ -56,25 +846,11 @@ void repcpd_process_msg(struct udp_sock *us, const struct sa *src,
 
 	debug("pcp: %H\n", pcp_msg_printhdr, msg);
 
-	/* Validate PCP request */
-	if (msg->hdr.resp) {
-		warning("pcp: ignore response from %J\n", src);
-		goto out;
-	}
+	/* version, R-bit and client address are checked by the prefilter */
+	cur.msg = msg;
+	cur.mb  = mb;
 
-	if (msg->hdr.version != PCP_VERSION) {
-		result = PCP_UNSUPP_VERSION;
-		goto out;
-	}
-
-	if (!sa_cmp(&msg->hdr.cli_addr, src, SA_ADDR)) {
-		warning("pcp: client-addr is %j, but source-addr is %j\n",
-			&msg->hdr.cli_addr, src);
-		result = PCP_ADDRESS_MISMATCH;
-		goto out;
-	}
-
-	opt = pcp_msg_option(msg, PCP_OPTION_THIRD_PARTY);
+	opt = repcpd_msg_option(msg, PCP_OPTION_THIRD_PARTY);
 	if (opt) {
 
 		/* todo: add config to decide if
@@ -89,6 +865,12 @@ void repcpd_process_msg(struct udp_sock *us, const struct sa *src,
 		}
 	}
 
+	if (!limit_check(src, msg)) {
+		++stats.limited;
+		prefilter_ereply(us, src, mb, PCP_NO_RESOURCES);
+		goto out;
+	}
+
 	/* Handle PCP Request in the modules */
 	le = pcpx.pcpl.head;
 	while (le) {
@@ -106,7 +888,9 @@ void repcpd_process_msg(struct udp_sock *us, const struct sa *src,
 		result = PCP_UNSUPP_OPCODE;
 
  out:
-	mem_deref(msg);
+	cur.msg = NULL;
+	cur.mb  = NULL;
+	arena.pos = mark;
 
 	if (result != PCP_SUCCESS) {
 
@@ -115,6 +899,55 @@ void repcpd_process_msg(struct udp_sock *us, const struct sa *src,
 			warning("pcp: ereply failed (%m)\n", err);
 		}
 	}
+
+	if (key.len) {
+		mb->pos = start;
+		dup_store(src, mb, &key);
+	}
+}
+
+
+int repcpd_pcp_debug(struct re_printf *pf, void *unused)
+{
+	(void)unused;
+
+	return re_hprintf(pf, "duplicate cache: %llu hits, %llu misses,"
+			  " %llu pending;"
+			  " prefilter: %llu dropped, %llu rejected;"
+			  " rate limit: %llu",
+			  stats.dup_hits, stats.dup_misses, stats.dup_pending,
+			  stats.dropped, stats.rejected, stats.limited);
+}
+
+
+/* note: called by every thread that processed requests, at its exit */
+void repcpd_pcp_thread_close(void)
+{
+	bucketv = mem_deref(bucketv);
+}
+
+
+static int budget_get(const struct conf *conf, const char *name,
+		      struct budget *b)
+{
+	char burst[64];
+
+	(void)conf_get_u32(conf, name, &b->rate);
+
+	if (re_snprintf(burst, sizeof(burst), "%s_burst", name) < 0)
+		return ENOMEM;
+
+	/* the default burst is one second of requests */
+	(void)conf_get_u32(conf, burst, &b->burst);
+	if (!b->burst)
+		b->burst = b->rate;
+
+	if (b->rate) {
+		info("pcp: rate limit `%s' is %u/s, burst %u\n",
+		     name, b->rate, b->burst);
+	}
+
+	return 0;
 }
 
 
@@ -176,6 +1009,34 @@ uint32_t pcp_lifetime_calculate(uint32_t lifetime)
 }
 
 
+/**
+ * Get the subscriber of an internal address. An IPv4 subscriber is one
+ * address, an IPv6 subscriber is a prefix, of "subscriber_prefix6" bits.
+ *
+ * @param sub      Subscriber address, with port 0
+ * @param int_addr Internal address
+ */
+void repcpd_subscriber(struct sa *sub, const struct sa *int_addr)
+{
+	uint8_t *addr;
+	uint32_t i;
+
+	if (!sub || !int_addr)
+		return;
+
+	*sub = *int_addr;
+	sa_set_port(sub, 0);
+
+	if (sa_af(sub) != AF_INET6)
+		return;
+
+	addr = sub->u.in6.sin6_addr.s6_addr;
+
+	for (i = pcpx.prefix6; i < 128; i++)
+		addr[i / 8] &= ~(0x80 >> (i % 8));
+}
+
+
 int repcpd_init(const struct conf *conf)
 {
 	int err;
@@ -198,5 +1059,22 @@ int repcpd_init(const struct conf *conf)
 	info("pcp: mapping lifetime is %u-%u seconds\n",
 	     pcpx.lifetime_min, pcpx.lifetime_max);
 
+	(void)conf_get_u32(conf, "dup_cache_ttl", &pcpx.dup_ttl);
+
+	err = budget_get(conf, "rate_limit_new", &pcpx.lim_new);
+	if (err)
+		return err;
+
+	err = budget_get(conf, "rate_limit_refresh", &pcpx.lim_refresh);
+	if (err)
+		return err;
+
+	(void)conf_get_u32(conf, "subscriber_prefix6", &pcpx.prefix6);
+	if (pcpx.prefix6 > 128) {
+		warning("pcp: illegal subscriber prefix /%u\n",
+			pcpx.prefix6);
+		return EINVAL;
+	}
+
 	return 0;
 }
@@ -5,13 +5,171 @@
  */
 
 
+/* backend */
+int  backend_init(void);
+void backend_close(void);
+int  backend_thread_init(void);
+void backend_thread_close(void);
+
+
+/* journal */
+struct journal_entry {
+	struct le le;
+	struct le tle;             /* in the list of its table or shard */
+	char *table;
+	enum pcp_opcode opcode;
+	int proto;
+	struct sa int_addr;
+	struct sa remote_addr;     /* PEER only */
+	struct sa ext_addr;
+	uint8_t nonce[PCP_NONCE_SZ];
+	uint64_t expires;          /* [seconds since the Epoch] */
+	char *ext_ifname;
+	char *descr;
+	char *tag;
+};
+
+/* returns true if the entry was claimed */
+typedef bool (journal_replay_h)(const struct journal_entry *je, void *arg);
+
+int  journal_init(void);
+void journal_close(void);
+void journal_replay(const char *table, journal_replay_h *h, void *arg);
+void journal_replay_done(void);
+int  journal_encode(struct mbuf *mb, const char *table,
+		    const struct mapping *m, uint64_t expires);
+void journal_create(const char *table, const struct mapping *m,
+		    uint64_t expires);
+void journal_refresh(const char *table, const struct mapping *m,
+		     uint64_t expires);
+void journal_delete(const char *table, const struct mapping *m);
+
+
+/* main */
+uint64_t repcpd_epoch_start(void);
+void     repcpd_epoch_set(uint64_t start);
+
+
+/* mapping */
+int mapping_snapshot(struct mbuf *mb);
+int mapping_tag_print(struct re_printf *pf, const struct mapping *mapping);
+
+
+/* misc */
+uint64_t siphash(const uint8_t key[16], const uint8_t *p, size_t len);
+
+
+/* maptab */
+struct maptab;
+
+struct maptab_stats {
+	uint32_t slots;
+	uint32_t count;
+	uint32_t load;        /* [percent] */
+	uint32_t probe_max;
+	uint32_t probe_mean;  /* [1/100] */
+	uint64_t lookups;
+	uint32_t lookup_max;  /* slots visited by a lookup */
+	uint32_t lookup_mean; /* [1/100] */
+};
+
+typedef bool (maptab_cmp_h)(const void *item, void *arg);
+typedef bool (maptab_apply_h)(void *item, void *arg);
+typedef void (maptab_free_h)(void *item);
+
+int   maptab_alloc(struct maptab **mtp, uint32_t size);
+int   maptab_insert(struct maptab *mt, uint32_t hash, uint32_t key,
+		    void *item);
+void *maptab_lookup(struct maptab *mt, uint32_t hash, uint32_t key,
+		    maptab_cmp_h *cmph, void *arg);
+void  maptab_remove(struct maptab *mt, uint32_t hash, const void *item);
+void *maptab_apply(const struct maptab *mt, maptab_apply_h *h, void *arg);
+void  maptab_flush(struct maptab *mt, maptab_free_h *fh);
+void  maptab_stats(const struct maptab *mt, struct maptab_stats *st);
+
+
+/* portmap */
+struct portmap;
+
+int  portmap_alloc(struct portmap **pmp, uint16_t min, uint16_t max);
+int  portmap_pick(const struct portmap *pm, uint16_t *port,
+		  uint16_t suggested);
+int  portmap_take(struct portmap *pm, uint16_t port);
+void portmap_release(struct portmap *pm, uint16_t port);
+uint32_t portmap_count(const struct portmap *pm);
+
+
+/* slab */
+struct slab;
+
+int   slab_alloc(struct slab **slabp, size_t size, uint32_t max);
+void *slab_get(struct slab *slab);
+void  slab_put(struct slab *slab, void *obj);
+int   slab_debug(struct re_printf *pf, const struct slab *slab);
+
+
+/* strpool */
+int   strpool_intern(const char **strp, const char *str);
+const char *strpool_ref(const char *str);
+void  strpool_release(const char *str);
+int   strpool_debug(struct re_printf *pf, void *unused);
+void  strpool_close(void);
+int   ifname_intern(uint8_t *idx, const char *name);
+const char *ifname_lookup(uint8_t idx);
+
+
+/* wheel */
+struct wheel;
+
+typedef void (wheel_h)(struct list *expired, void *arg);
+
+int  wheel_alloc(struct wheel **wp, wheel_h *h, void *arg);
+void wheel_start(struct wheel *w, struct wheel_ent *ent, uint32_t secs,
+		 void *data);
+void wheel_cancel(struct wheel *w, struct wheel_ent *ent);
+uint32_t wheel_remaining(const struct wheel *w,
+			 const struct wheel_ent *ent);
+
+
 /* udp */
 int  repcpd_udp_init(void);
 void repcpd_udp_close(void);
+int  repcpd_udp_attach(uint32_t idx);
+void repcpd_udp_detach(uint32_t idx);
+
+
+/* worker */
+typedef int (worker_exec_h)(void *arg);
+
+int  worker_init(void);
+int  worker_start(void);
+void worker_close(void);
+int  worker_exec(uint32_t idx, worker_exec_h *h, void *arg);
+int  worker_post(uint32_t idx, worker_exec_h *h, void *arg);
+int  worker_steer(int fd, int af);
+uint32_t worker_shard(const struct sa *addr);
+uint32_t worker_count(void);
+uint32_t worker_self(void);
+bool worker_enabled(void);
 
 
 /* pcp */
+
+/* a request in the duplicate cache */
+struct dup_key {
+	uint32_t hash;
+	uint16_t len;              /* 0 if the cache is disabled */
+	uint8_t nonce[PCP_NONCE_SZ];
+};
+
 int  repcpd_init(const struct conf *conf);
 void repcpd_process_msg(struct udp_sock *us,
 			const struct sa *src, const struct sa *dst,
 			struct mbuf *mb);
+int  repcpd_pcp_debug(struct re_printf *pf, void *unused);
+void repcpd_dupcache_flush(const struct sa *addr);
+void repcpd_dupcache_key(struct dup_key *key, const struct mbuf *req);
+void repcpd_dupcache_defer(const struct sa *src, const struct mbuf *req);
+void repcpd_dupcache_store(const struct sa *src, const struct mbuf *rsp,
+			   const struct dup_key *key);
+void repcpd_pcp_thread_close(void);
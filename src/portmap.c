@@ -0,0 +1,203 @@
+/**
+ * @file portmap.c  Allocator of the ports of an external address
+ *
+ * Copyright (C) 2010 - 2016 Creytiv.com
+ */
+
+#include <string.h>
+#include <re.h>
+#include <repcpd.h>
+#include "pcpd.h"
+
+
+/*
+ * The ports in use are kept in a bitmap. The free ports are kept in an
+ * array, together with the position of every free port in that array,
+ * so that a given port can be taken, a random port can be picked and a
+ * port can be released, all in O(1).
+ */
+
+
+struct portmap {
+	uint64_t *bitv;      /* ports in use */
+	uint16_t *freev;     /* free ports, as offsets from min */
+	uint16_t *posv;      /* position in freev, by offset */
+	uint32_t freec;
+	uint32_t n;
+	uint16_t min;
+};
+
+
+static void portmap_destructor(void *arg)
+{
+	struct portmap *pm = arg;
+
+	mem_deref(pm->bitv);
+	mem_deref(pm->freev);
+	mem_deref(pm->posv);
+}
+
+
+/**
+ * Allocate a port allocator
+ *
+ * @param pmp Pointer to allocated port allocator
+ * @param min Lowest port
+ * @param max Highest port
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+int portmap_alloc(struct portmap **pmp, uint16_t min, uint16_t max)
+{
+	struct portmap *pm;
+	uint32_t i;
+	int err = 0;
+
+	if (!pmp || !min || min > max)
+		return EINVAL;
+
+	pm = mem_zalloc(sizeof(*pm), portmap_destructor);
+	if (!pm)
+		return ENOMEM;
+
+	pm->min = min;
+	pm->n   = max - min + 1;
+
+	pm->bitv  = mem_zalloc((pm->n + 63) / 64 * sizeof(uint64_t), NULL);
+	pm->freev = mem_alloc(pm->n * sizeof(uint16_t), NULL);
+	pm->posv  = mem_alloc(pm->n * sizeof(uint16_t), NULL);
+	if (!pm->bitv || !pm->freev || !pm->posv) {
+		err = ENOMEM;
+		goto out;
+	}
+
+	for (i = 0; i < pm->n; i++) {
+		pm->freev[i] = (uint16_t)i;
+		pm->posv[i]  = (uint16_t)i;
+	}
+
+	pm->freec = pm->n;
+
+ out:
+	if (err)
+		mem_deref(pm);
+	else
+		*pmp = pm;
+
+	return err;
+}
+
+
+static bool inuse(const struct portmap *pm, uint32_t i)
+{
+	return (pm->bitv[i / 64] >> (i % 64)) & 1;
+}
+
+
+/**
+ * Pick a free port, without taking it
+ *
+ * @param pm        Port allocator
+ * @param port      Returned port
+ * @param suggested Suggested port, used if it is free
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+int portmap_pick(const struct portmap *pm, uint16_t *port,
+		 uint16_t suggested)
+{
+	uint32_t i;
+
+	if (!pm || !port)
+		return EINVAL;
+
+	i = (uint32_t)suggested - pm->min;
+
+	if (suggested >= pm->min && i < pm->n && !inuse(pm, i)) {
+		*port = suggested;
+		return 0;
+	}
+
+	if (!pm->freec)
+		return ENOSPC;
+
+	*port = pm->min + pm->freev[rand_u32() % pm->freec];
+
+	return 0;
+}
+
+
+/**
+ * Take a port
+ *
+ * @param pm   Port allocator
+ * @param port Port
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+int portmap_take(struct portmap *pm, uint16_t port)
+{
+	uint32_t i, pos;
+	uint16_t last;
+
+	if (!pm)
+		return EINVAL;
+
+	i = (uint32_t)port - pm->min;
+
+	if (port < pm->min || i >= pm->n)
+		return ERANGE;
+
+	if (inuse(pm, i))
+		return EADDRINUSE;
+
+	/* move the last free port into the hole */
+	pos  = pm->posv[i];
+	last = pm->freev[--pm->freec];
+
+	pm->freev[pos] = last;
+	pm->posv[last] = (uint16_t)pos;
+
+	pm->bitv[i / 64] |= (uint64_t)1 << (i % 64);
+
+	return 0;
+}
+
+
+/**
+ * Release a port
+ *
+ * @param pm   Port allocator
+ * @param port Port, taken with portmap_take()
+ */
+void portmap_release(struct portmap *pm, uint16_t port)
+{
+	uint32_t i;
+
+	if (!pm)
+		return;
+
+	i = (uint32_t)port - pm->min;
+
+	if (port < pm->min || i >= pm->n || !inuse(pm, i))
+		return;
+
+	pm->bitv[i / 64] &= ~((uint64_t)1 << (i % 64));
+
+	pm->freev[pm->freec] = (uint16_t)i;
+	pm->posv[i] = (uint16_t)pm->freec;
+	++pm->freec;
+}
+
+
+/**
+ * Get the number of ports in use
+ *
+ * @param pm Port allocator
+ *
+ * @return Number of ports in use
+ */
+uint32_t portmap_count(const struct portmap *pm)
+{
+	return pm ? pm->n - pm->freec : 0;
+}
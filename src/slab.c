@@ -0,0 +1,194 @@
+/**
+ * @file slab.c  Pool of fixed-size objects
+ *
+ * Copyright (C) 2010 - 2016 Creytiv.com
+ */
+
+#include <string.h>
+#include <re.h>
+#include <repcpd.h>
+#include "pcpd.h"
+
+
+/*
+ * Objects are carved out of pages of SLAB_PAGE objects. A freed object
+ * goes to a free list and is handed out again, pages are only released
+ * when the slab is destroyed. With a maximum, all pages are allocated
+ * up front and no memory is allocated afterwards.
+ */
+
+
+enum {
+	SLAB_PAGE = 1024,
+};
+
+struct page {
+	struct le le;
+	uint8_t *mem;
+};
+
+struct slab {
+	struct list pagel;
+	void *freel;         /* free objects, linked by their first word */
+	size_t size;         /* object size, rounded up */
+	uint32_t count;      /* objects in use */
+	uint32_t total;      /* objects in all pages */
+	uint32_t max;        /* 0 means no limit */
+};
+
+
+static void page_destructor(void *arg)
+{
+	struct page *page = arg;
+
+	list_unlink(&page->le);
+	mem_deref(page->mem);
+}
+
+
+static void slab_destructor(void *arg)
+{
+	struct slab *slab = arg;
+
+	if (slab->count)
+		warning("slab: %u objects still in use\n", slab->count);
+
+	list_flush(&slab->pagel);
+}
+
+
+static int page_add(struct slab *slab, uint32_t n)
+{
+	struct page *page;
+	uint32_t i;
+
+	page = mem_zalloc(sizeof(*page), page_destructor);
+	if (!page)
+		return ENOMEM;
+
+	page->mem = mem_alloc(n * slab->size, NULL);
+	if (!page->mem) {
+		mem_deref(page);
+		return ENOMEM;
+	}
+
+	for (i = n; i > 0; i--) {
+
+		void **obj = (void **)(void *)(page->mem + (i-1) * slab->size);
+
+		*obj = slab->freel;
+		slab->freel = obj;
+	}
+
+	list_append(&slab->pagel, &page->le, page);
+	slab->total += n;
+
+	return 0;
+}
+
+
+/**
+ * Allocate a slab
+ *
+ * @param slabp Pointer to allocated slab
+ * @param size  Object size
+ * @param max   Maximum number of objects, preallocated. 0 for no limit
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+int slab_alloc(struct slab **slabp, size_t size, uint32_t max)
+{
+	struct slab *slab;
+	int err = 0;
+
+	if (!slabp || !size)
+		return EINVAL;
+
+	slab = mem_zalloc(sizeof(*slab), slab_destructor);
+	if (!slab)
+		return ENOMEM;
+
+	/* keep the objects aligned */
+	slab->size = (size + sizeof(uint64_t) - 1) &
+		~(sizeof(uint64_t) - 1);
+	slab->max  = max;
+
+	if (max)
+		err = page_add(slab, max);
+
+	if (err)
+		mem_deref(slab);
+	else
+		*slabp = slab;
+
+	return err;
+}
+
+
+/**
+ * Get a zeroed object from a slab
+ *
+ * @param slab Slab
+ *
+ * @return Object, NULL if the slab is full or out of memory
+ */
+void *slab_get(struct slab *slab)
+{
+	void **obj;
+
+	if (!slab)
+		return NULL;
+
+	if (!slab->freel) {
+
+		if (slab->max)
+			return NULL;
+
+		if (page_add(slab, SLAB_PAGE))
+			return NULL;
+	}
+
+	obj = slab->freel;
+	slab->freel = *obj;
+	++slab->count;
+
+	memset(obj, 0, slab->size);
+
+	return obj;
+}
+
+
+/**
+ * Return an object to a slab
+ *
+ * @param slab Slab
+ * @param obj  Object from slab_get()
+ */
+void slab_put(struct slab *slab, void *obj)
+{
+	if (!slab || !obj)
+		return;
+
+	*(void **)obj = slab->freel;
+	slab->freel = obj;
+	--slab->count;
+}
+
+
+/**
+ * Print the usage of a slab
+ *
+ * @param pf   Print handler
+ * @param slab Slab
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+int slab_debug(struct re_printf *pf, const struct slab *slab)
+{
+	if (!slab)
+		return 0;
+
+	return re_hprintf(pf, "%u of %u objects (%zu bytes)%s",
+			  slab->count, slab->total, slab->size,
+			  slab->max ? ", limited" : "");
+}
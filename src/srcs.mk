@@ -6,9 +6,16 @@
 
 SRCS	+= backend.c
 SRCS	+= extaddr.c
+SRCS	+= journal.c
 SRCS	+= log.c
 SRCS	+= main.c
 SRCS	+= mapping.c
+SRCS	+= maptab.c
 SRCS	+= misc.c
 SRCS	+= pcp.c
+SRCS	+= portmap.c
+SRCS	+= slab.c
+SRCS	+= strpool.c
 SRCS	+= udp.c
+SRCS	+= wheel.c
+SRCS	+= worker.c
@@ -0,0 +1,326 @@
+/**
+ * @file strpool.c  Interned strings
+ *
+ * Copyright (C) 2010 - 2016 Creytiv.com
+ */
+
+#define _DEFAULT_SOURCE 1
+#include <pthread.h>
+#include <stddef.h>
+#include <string.h>
+#include <re.h>
+#include <repcpd.h>
+#include "pcpd.h"
+
+
+/*
+ * Descriptions are interned, so that all mappings with the same
+ * description share one copy. The strings are reference counted and
+ * bump-allocated from chunks, a chunk is released when none of its
+ * strings is referenced any more.
+ *
+ * Interface names are interned to a small index, which is never
+ * released. Index 0 means no interface.
+ *
+ * The pool is shared by the workers, and is only used when a mapping is
+ * created or deleted. An interface name is looked up without the lock,
+ * since the names are never changed once they have an index. The count
+ * of the names is published with a release store after the name is set,
+ * and read with an acquire load, so that a reader that sees an index
+ * also sees its name.
+ */
+
+
+enum {
+	CHUNK_SIZE   = 65536,
+	STRPOOL_HASH = 256,
+	IFNAME_MAX   = 255,
+};
+
+struct chunk {
+	struct le le;
+	size_t used;
+	uint32_t live;        /* referenced strings */
+	uint64_t mem[CHUNK_SIZE / 8];  /* aligned */
+};
+
+struct pstr {
+	struct le he;
+	struct chunk *chunk;
+	uint32_t refs;
+	char str[];
+};
+
+
+static struct {
+	struct list chunkl;   /* the last chunk is the current one */
+	struct hash *strh;
+	uint32_t count;
+	char *ifnamev[IFNAME_MAX + 1];
+	uint32_t ifnamec;
+	pthread_mutex_t lock;
+} pool = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+
+static void chunk_destructor(void *arg)
+{
+	struct chunk *chunk = arg;
+
+	list_unlink(&chunk->le);
+}
+
+
+static struct pstr *pstr_get(const char *str)
+{
+	return (struct pstr *)(void *)(str - offsetof(struct pstr, str));
+}
+
+
+static bool cmp_handler(struct le *le, void *arg)
+{
+	const struct pstr *ps = le->data;
+
+	return 0 == strcmp(ps->str, arg);
+}
+
+
+static struct pstr *pstr_alloc(const char *str, size_t len)
+{
+	const size_t sz = (sizeof(struct pstr) + len + 1 + 7) & ~(size_t)7;
+	struct chunk *chunk = list_ledata(list_tail(&pool.chunkl));
+	struct pstr *ps;
+
+	if (sz > CHUNK_SIZE)
+		return NULL;
+
+	if (!chunk || chunk->used + sz > CHUNK_SIZE) {
+
+		chunk = mem_zalloc(sizeof(*chunk), chunk_destructor);
+		if (!chunk)
+			return NULL;
+
+		list_append(&pool.chunkl, &chunk->le, chunk);
+	}
+
+	ps = (struct pstr *)(void *)((uint8_t *)chunk->mem + chunk->used);
+	chunk->used += sz;
+	++chunk->live;
+
+	memset(ps, 0, sizeof(*ps));
+	ps->chunk = chunk;
+	memcpy(ps->str, str, len + 1);
+
+	return ps;
+}
+
+
+/**
+ * Intern a string
+ *
+ * @param strp Pointer to the interned string
+ * @param str  String
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+int strpool_intern(const char **strp, const char *str)
+{
+	struct pstr *ps;
+	uint32_t h;
+	int err = 0;
+
+	if (!strp || !str)
+		return EINVAL;
+
+	h = hash_joaat_str(str);
+
+	pthread_mutex_lock(&pool.lock);
+
+	if (!pool.strh) {
+		err = hash_alloc(&pool.strh, STRPOOL_HASH);
+		if (err)
+			goto out;
+	}
+
+	ps = list_ledata(hash_lookup(pool.strh, h, cmp_handler,
+				     (void *)str));
+	if (!ps) {
+		ps = pstr_alloc(str, strlen(str));
+		if (!ps) {
+			err = ENOMEM;
+			goto out;
+		}
+
+		hash_append(pool.strh, h, &ps->he, ps);
+		++pool.count;
+	}
+
+	++ps->refs;
+	*strp = ps->str;
+
+ out:
+	pthread_mutex_unlock(&pool.lock);
+
+	return err;
+}
+
+
+/**
+ * Reference an interned string
+ *
+ * @param str Interned string, may be NULL
+ *
+ * @return The interned string
+ */
+const char *strpool_ref(const char *str)
+{
+	if (str) {
+		pthread_mutex_lock(&pool.lock);
+		++pstr_get(str)->refs;
+		pthread_mutex_unlock(&pool.lock);
+	}
+
+	return str;
+}
+
+
+/**
+ * Release an interned string
+ *
+ * @param str Interned string, may be NULL
+ */
+void strpool_release(const char *str)
+{
+	struct pstr *ps;
+	struct chunk *chunk;
+
+	if (!str)
+		return;
+
+	pthread_mutex_lock(&pool.lock);
+
+	ps = pstr_get(str);
+	if (--ps->refs)
+		goto out;
+
+	hash_unlink(&ps->he);
+	--pool.count;
+
+	chunk = ps->chunk;
+	if (--chunk->live)
+		goto out;
+
+	/* the current chunk is reused from the start */
+	if (chunk->le.next)
+		mem_deref(chunk);
+	else
+		chunk->used = 0;
+
+ out:
+	pthread_mutex_unlock(&pool.lock);
+}
+
+
+/**
+ * Get the index of an interface name, interning it if needed
+ *
+ * @param idx  Interface index, 0 if name is NULL
+ * @param name Interface name, may be NULL
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+int ifname_intern(uint8_t *idx, const char *name)
+{
+	uint32_t i;
+	int err = 0;
+
+	if (!idx)
+		return EINVAL;
+
+	if (!name) {
+		*idx = 0;
+		return 0;
+	}
+
+	pthread_mutex_lock(&pool.lock);
+
+	for (i = 1; i <= pool.ifnamec; i++) {
+
+		if (0 == strcmp(pool.ifnamev[i], name)) {
+			*idx = (uint8_t)i;
+			goto out;
+		}
+	}
+
+	if (pool.ifnamec == IFNAME_MAX) {
+		err = ENOSPC;
+		goto out;
+	}
+
+	err = str_dup(&pool.ifnamev[i], name);
+	if (err)
+		goto out;
+
+	__atomic_store_n(&pool.ifnamec, i, __ATOMIC_RELEASE);
+	*idx = (uint8_t)i;
+
+ out:
+	pthread_mutex_unlock(&pool.lock);
+
+	return err;
+}
+
+
+/**
+ * Get an interface name from its index
+ *
+ * @param idx Interface index
+ *
+ * @return Interface name, NULL for index 0
+ */
+const char *ifname_lookup(uint8_t idx)
+{
+	if (!idx || idx > __atomic_load_n(&pool.ifnamec, __ATOMIC_ACQUIRE))
+		return NULL;
+
+	return pool.ifnamev[idx];
+}
+
+
+/**
+ * Print the usage of the string pool
+ *
+ * @param pf     Print handler
+ * @param unused Unused parameter
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+int strpool_debug(struct re_printf *pf, void *unused)
+{
+	(void)unused;
+
+	return re_hprintf(pf, "%u strings in %u chunks, %u interfaces",
+			  pool.count, list_count(&pool.chunkl),
+			  __atomic_load_n(&pool.ifnamec, __ATOMIC_ACQUIRE));
+}
+
+
+void strpool_close(void)
+{
+	uint32_t i;
+
+	if (pool.count)
+		warning("strpool: %u strings still in use\n", pool.count);
+
+	hash_clear(pool.strh);
+	pool.strh = mem_deref(pool.strh);
+	pool.count = 0;
+
+	list_flush(&pool.chunkl);
+
+	for (i = 1; i <= pool.ifnamec; i++)
+		pool.ifnamev[i] = mem_deref(pool.ifnamev[i]);
+
+	pool.ifnamec = 0;
+}
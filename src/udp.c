@@ -4,19 +4,80 @@
  * Copyright (C) 2010 - 2016 Creytiv.com
  */
 
+#define _GNU_SOURCE 1
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <string.h>
+#include <unistd.h>
 #include <re.h>
 #include <repcpd.h>
 #include "pcpd.h"
 
 
+/*
+ * With workers, every listen address has a SO_REUSEPORT socket per
+ * worker, see worker.c. The sockets are opened and bound in the order
+ * of the workers, and are polled by the event loop of their worker.
+ * The replies are sent on the socket with a socket-less udp_sock.
+ *
+ * With "udp_batch N", the sockets are drained with recvmmsg(), up to N
+ * requests per wakeup, also without workers. The replies of a batch are
+ * copied to the send slots, and sent with one sendmmsg() at the end of
+ * the batch. Replies outside of a batch, e.g. after a backend commit,
+ * are sent right away.
+ */
+
+enum {
+	UDP_BATCH_MAX = 1024,
+};
+
+struct udp_lstnr;
+
+struct slot {
+	struct mbuf *mb;           /* request, reused if not referenced */
+	struct sa src;
+	struct iovec iov;
+	struct sa dst;
+	struct iovec siov;
+	uint8_t sbuf[PCP_MAX_PACKET];
+};
+
+struct batch {
+	struct mmsghdr *rmsgv;
+	struct mmsghdr *smsgv;
+	struct slot *slotv;
+	uint32_t n;
+	uint32_t sendc;
+	bool active;
+};
+
+struct wsock {
+	struct udp_lstnr *ul;
+	struct udp_sock *us;
+	struct batch *bt;
+	uint32_t idx;
+	int fd;
+	bool listening;
+};
+
 struct udp_lstnr {
 	struct le le;
 	struct sa bnd_addr;
 	struct udp_sock *us;
+	struct wsock *wsv;         /* by worker, with workers */
+	uint32_t wsc;
+};
+
+/* a request that is passed on to the worker of its subscriber */
+struct fwd {
+	struct udp_lstnr *ul;
+	struct mbuf *mb;
+	struct sa src;
 };
 
 
 static struct list lstnrl;
+static uint32_t udp_batch = 1;
 
 
 static void udp_recv(const struct sa *src, struct mbuf *mb, void *arg)
@@ -30,9 +91,365 @@ static void udp_recv(const struct sa *src, struct mbuf *mb, void *arg)
 static void destructor(void *arg)
 {
 	struct udp_lstnr *ul = arg;
+	uint32_t i;
 
 	list_unlink(&ul->le);
 	mem_deref(ul->us);
+
+	for (i = 0; i < ul->wsc; i++) {
+
+		struct wsock *ws = &ul->wsv[i];
+
+		if (ws->listening)
+			fd_close(ws->fd);
+
+		mem_deref(ws->us);
+		mem_deref(ws->bt);
+		if (ws->fd >= 0)
+			(void)close(ws->fd);
+	}
+
+	mem_deref(ul->wsv);
+}
+
+
+static void fwd_destructor(void *arg)
+{
+	struct fwd *fwd = arg;
+
+	mem_deref(fwd->mb);
+}
+
+
+/* note: called from the worker of the subscriber */
+static int fwd_handler(void *arg)
+{
+	struct fwd *fwd = arg;
+	struct wsock *ws = &fwd->ul->wsv[worker_self()];
+
+	repcpd_process_msg(ws->us, &fwd->src, &fwd->ul->bnd_addr, fwd->mb);
+
+	return 0;
+}
+
+
+/* note: the buffer is handed over to the other worker */
+static void wsock_forward(struct wsock *ws, uint32_t shard,
+			  const struct sa *src, struct mbuf *mb)
+{
+	struct fwd *fwd;
+	int err;
+
+	fwd = mem_zalloc(sizeof(*fwd), fwd_destructor);
+	if (!fwd) {
+		mem_deref(mb);
+		return;
+	}
+
+	fwd->ul  = ws->ul;
+	fwd->mb  = mb;
+	fwd->src = *src;
+
+	err = worker_post(shard, fwd_handler, fwd);
+	if (err)
+		warning("udp: could not pass on request from %J (%m)\n",
+			src, err);
+}
+
+
+static void batch_destructor(void *arg)
+{
+	struct batch *bt = arg;
+	uint32_t i;
+
+	for (i = 0; i < bt->n; i++)
+		mem_deref(bt->slotv[i].mb);
+
+	mem_deref(bt->slotv);
+	mem_deref(bt->smsgv);
+	mem_deref(bt->rmsgv);
+}
+
+
+static int batch_alloc(struct batch **btp, uint32_t n)
+{
+	struct batch *bt;
+	int err = 0;
+
+	bt = mem_zalloc(sizeof(*bt), batch_destructor);
+	if (!bt)
+		return ENOMEM;
+
+	bt->rmsgv = mem_zalloc(n * sizeof(*bt->rmsgv), NULL);
+	bt->smsgv = mem_zalloc(n * sizeof(*bt->smsgv), NULL);
+	bt->slotv = mem_zalloc(n * sizeof(*bt->slotv), NULL);
+	if (!bt->rmsgv || !bt->smsgv || !bt->slotv) {
+		err = ENOMEM;
+		goto out;
+	}
+
+	bt->n = n;
+
+ out:
+	if (err)
+		mem_deref(bt);
+	else
+		*btp = bt;
+
+	return err;
+}
+
+
+/* the request buffers that are still referenced are replaced */
+static int batch_prepare(struct batch *bt)
+{
+	uint32_t i;
+
+	for (i = 0; i < bt->n; i++) {
+
+		struct slot *sl = &bt->slotv[i];
+		struct msghdr *hdr = &bt->rmsgv[i].msg_hdr;
+
+		if (sl->mb && mem_nrefs(sl->mb) > 1)
+			sl->mb = mem_deref(sl->mb);
+
+		if (!sl->mb) {
+			sl->mb = mbuf_alloc(PCP_MAX_PACKET);
+			if (!sl->mb)
+				return ENOMEM;
+		}
+
+		sl->iov.iov_base = sl->mb->buf;
+		sl->iov.iov_len  = sl->mb->size;
+
+		memset(hdr, 0, sizeof(*hdr));
+		hdr->msg_name    = &sl->src.u;
+		hdr->msg_namelen = sizeof(sl->src.u);
+		hdr->msg_iov     = &sl->iov;
+		hdr->msg_iovlen  = 1;
+	}
+
+	return 0;
+}
+
+
+static void batch_flush(struct wsock *ws)
+{
+	struct batch *bt = ws->bt;
+	uint32_t i = 0;
+
+	while (i < bt->sendc) {
+
+		int n = sendmmsg(ws->fd, &bt->smsgv[i], bt->sendc - i, 0);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+
+			/* the failed reply is dropped, like a lost packet */
+			debug("udp: send to %J failed (%m)\n",
+			      &bt->slotv[i].dst, errno);
+			++i;
+			continue;
+		}
+
+		i += n;
+	}
+
+	bt->sendc = 0;
+}
+
+
+static void wsock_recv_batch(struct wsock *ws)
+{
+	struct batch *bt = ws->bt;
+	uint32_t i;
+	int n;
+
+	if (batch_prepare(bt))
+		return;
+
+	n = recvmmsg(ws->fd, bt->rmsgv, bt->n, MSG_DONTWAIT, NULL);
+	if (n <= 0)
+		return;
+
+	bt->active = true;
+
+	for (i = 0; i < (uint32_t)n; i++) {
+
+		struct slot *sl = &bt->slotv[i];
+		uint32_t shard;
+
+		sl->mb->pos = 0;
+		sl->mb->end = bt->rmsgv[i].msg_len;
+		sl->src.len = bt->rmsgv[i].msg_hdr.msg_namelen;
+
+		shard = worker_shard(&sl->src);
+		if (shard != ws->idx) {
+			wsock_forward(ws, shard, &sl->src, sl->mb);
+			sl->mb = NULL;
+			continue;
+		}
+
+		repcpd_process_msg(ws->us, &sl->src, &ws->ul->bnd_addr,
+				   sl->mb);
+	}
+
+	bt->active = false;
+
+	batch_flush(ws);
+}
+
+
+static void wsock_recv(int flags, void *arg)
+{
+	struct wsock *ws = arg;
+	struct mbuf *mb;
+	struct sa src;
+	uint32_t shard;
+	ssize_t n;
+	(void)flags;
+
+	if (ws->bt) {
+		wsock_recv_batch(ws);
+		return;
+	}
+
+	mb = mbuf_alloc(PCP_MAX_PACKET);
+	if (!mb)
+		return;
+
+	sa_init(&src, AF_UNSPEC);
+	src.len = sizeof(src.u);
+
+	n = recvfrom(ws->fd, mb->buf, mb->size, 0, &src.u.sa, &src.len);
+	if (n < 0)
+		goto out;
+
+	mb->end = n;
+
+	/* steered to another worker, e.g. without the BPF program */
+	shard = worker_shard(&src);
+	if (shard != ws->idx) {
+		wsock_forward(ws, shard, &src, mb);
+		return;
+	}
+
+	repcpd_process_msg(ws->us, &src, &ws->ul->bnd_addr, mb);
+
+ out:
+	mem_deref(mb);
+}
+
+
+/* queues the reply to the send slots, inside of a batch */
+static bool batch_queue(struct wsock *ws, const struct sa *dst,
+			struct mbuf *mb)
+{
+	struct batch *bt = ws->bt;
+	struct msghdr *hdr;
+	struct slot *sl;
+	size_t len = mbuf_get_left(mb);
+
+	if (!bt || !bt->active || len > sizeof(sl->sbuf))
+		return false;
+
+	if (bt->sendc >= bt->n)
+		batch_flush(ws);
+
+	sl  = &bt->slotv[bt->sendc];
+	hdr = &bt->smsgv[bt->sendc].msg_hdr;
+	++bt->sendc;
+
+	memcpy(sl->sbuf, mbuf_buf(mb), len);
+	sl->dst = *dst;
+	sl->siov.iov_base = sl->sbuf;
+	sl->siov.iov_len  = len;
+
+	memset(hdr, 0, sizeof(*hdr));
+	hdr->msg_name    = &sl->dst.u;
+	hdr->msg_namelen = dst->len;
+	hdr->msg_iov     = &sl->siov;
+	hdr->msg_iovlen  = 1;
+
+	return true;
+}
+
+
+static int wsock_send(const struct sa *dst, struct mbuf *mb, void *arg)
+{
+	struct wsock *ws = arg;
+
+	if (batch_queue(ws, dst, mb))
+		return 0;
+
+	if (sendto(ws->fd, mbuf_buf(mb), mbuf_get_left(mb), 0,
+		   &dst->u.sa, dst->len) < 0)
+		return errno;
+
+	return 0;
+}
+
+
+static int wsock_open(struct wsock *ws, const struct sa *addr)
+{
+	int on = 1;
+
+	ws->fd = socket(sa_af(addr), SOCK_DGRAM | SOCK_NONBLOCK,
+			IPPROTO_UDP);
+	if (ws->fd < 0)
+		return errno;
+
+	if (setsockopt(ws->fd, SOL_SOCKET, SO_REUSEPORT,
+		       &on, sizeof(on)) < 0)
+		return errno;
+
+	if (bind(ws->fd, &addr->u.sa, addr->len) < 0)
+		return errno;
+
+	if (udp_batch > 1) {
+		int err = batch_alloc(&ws->bt, udp_batch);
+		if (err)
+			return err;
+	}
+
+	return udp_alloc_sockless(&ws->us, wsock_send, NULL, ws);
+}
+
+
+static int lstnr_open(struct udp_lstnr *ul)
+{
+	uint32_t i;
+	int err;
+
+	ul->wsv = mem_zalloc(worker_count() * sizeof(*ul->wsv), NULL);
+	if (!ul->wsv)
+		return ENOMEM;
+
+	for (i = 0; i < worker_count(); i++) {
+
+		struct wsock *ws = &ul->wsv[i];
+
+		ws->ul  = ul;
+		ws->idx = i;
+		ws->fd  = -1;
+		++ul->wsc;
+
+		err = wsock_open(ws, &ul->bnd_addr);
+		if (err)
+			return err;
+
+		if (i)
+			continue;
+
+		/* requests that are not steered are passed on */
+		err = worker_steer(ws->fd, sa_af(&ul->bnd_addr));
+		if (err) {
+			warning("udp listen %J: no steering program (%m)\n",
+				&ul->bnd_addr, err);
+		}
+	}
+
+	return 0;
 }
 
 
@@ -57,7 +474,10 @@ static int listen_handler(const struct pl *addrport, void *arg)
 		goto out;
 	}
 
-	err = udp_listen(&ul->us, &ul->bnd_addr, udp_recv, ul);
+	if (worker_enabled() || udp_batch > 1)
+		err = lstnr_open(ul);
+	else
+		err = udp_listen(&ul->us, &ul->bnd_addr, udp_recv, ul);
 	if (err) {
 		warning("udp listen %J: %m\n", &ul->bnd_addr, err);
 		goto out;
@@ -79,10 +499,24 @@ int repcpd_udp_init(void)
 
 	list_init(&lstnrl);
 
+	(void)conf_get_u32(_conf(), "udp_batch", &udp_batch);
+	if (udp_batch > UDP_BATCH_MAX) {
+		warning("udp: udp_batch %u too large, using %u\n",
+			udp_batch, UDP_BATCH_MAX);
+		udp_batch = UDP_BATCH_MAX;
+	}
+
 	err = conf_apply(_conf(), "udp_listen", listen_handler, 0);
 	if (err)
 		goto out;
 
+	/* without workers, the sockets are polled by the main loop */
+	if (!worker_enabled() && udp_batch > 1) {
+		err = repcpd_udp_attach(0);
+		if (err)
+			goto out;
+	}
+
  out:
 	if (err)
 		repcpd_udp_close();
@@ -97,6 +531,56 @@ void repcpd_udp_close(void)
 }
 
 
+/* note: called from the worker */
+int repcpd_udp_attach(uint32_t idx)
+{
+	struct le *le;
+	int err;
+
+	for (le = lstnrl.head; le; le = le->next) {
+
+		struct udp_lstnr *ul = le->data;
+		struct wsock *ws;
+
+		if (idx >= ul->wsc)
+			continue;
+
+		ws = &ul->wsv[idx];
+
+		err = fd_listen(ws->fd, FD_READ, wsock_recv, ws);
+		if (err)
+			return err;
+
+		ws->listening = true;
+	}
+
+	return 0;
+}
+
+
+/* note: called from the worker */
+void repcpd_udp_detach(uint32_t idx)
+{
+	struct le *le;
+
+	for (le = lstnrl.head; le; le = le->next) {
+
+		struct udp_lstnr *ul = le->data;
+		struct wsock *ws;
+
+		if (idx >= ul->wsc)
+			continue;
+
+		ws = &ul->wsv[idx];
+
+		if (ws->listening) {
+			fd_close(ws->fd);
+			ws->listening = false;
+		}
+	}
+}
+
+
 void repcpd_udp_apply(repcpd_udp_apply_h *h, void *arg)
 {
 	struct le *le;
@@ -107,6 +591,6 @@ void repcpd_udp_apply(repcpd_udp_apply_h *h, void *arg)
 	for (le = lstnrl.head; le; le = le->next) {
 		struct udp_lstnr *ul = le->data;
 
-		h(&ul->bnd_addr, ul->us, arg);
+		h(&ul->bnd_addr, ul->wsc ? ul->wsv[0].us : ul->us, arg);
 	}
 }
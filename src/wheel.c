@@ -0,0 +1,266 @@
+/**
+ * @file wheel.c  Hierarchical timing wheel with one second resolution
+ *
+ * Copyright (C) 2010 - 2016 Creytiv.com
+ */
+
+#include <re.h>
+#include <repcpd.h>
+#include "pcpd.h"
+
+
+/*
+ * The wheel has WHEEL_LEVELS levels of WHEEL_SLOTS slots each. A slot of
+ * level 0 covers one second, a slot of level n covers WHEEL_SLOTS^n
+ * seconds. An entry is put in the lowest level that reaches its expiry
+ * time, and moved down a level when the wheel enters its slot. Starting
+ * and cancelling an entry is O(1).
+ *
+ * The wheel is driven by a single tmr, which runs only while the wheel
+ * holds entries. All entries that expire in a tick are handed to the
+ * expiry handler as one list.
+ */
+
+
+enum {
+	WHEEL_BITS   = 6,
+	WHEEL_SLOTS  = 1 << WHEEL_BITS,
+	WHEEL_MASK   = WHEEL_SLOTS - 1,
+	WHEEL_LEVELS = 4,
+};
+
+#define WHEEL_RANGE ((uint64_t)1 << (WHEEL_BITS * WHEEL_LEVELS))
+
+
+struct wheel {
+	struct list slotv[WHEEL_LEVELS][WHEEL_SLOTS];
+	struct tmr tmr;
+	uint64_t base;      /* jiffies of tick 0 */
+	uint64_t now;       /* last tick that was processed */
+	uint32_t count;     /* entries in the wheel */
+	wheel_h *h;
+	void *arg;
+};
+
+
+static void wheel_destructor(void *arg)
+{
+	struct wheel *w = arg;
+	int lvl, i;
+
+	tmr_cancel(&w->tmr);
+
+	for (lvl = 0; lvl < WHEEL_LEVELS; lvl++) {
+		for (i = 0; i < WHEEL_SLOTS; i++)
+			list_clear(&w->slotv[lvl][i]);
+	}
+}
+
+
+static uint64_t tick_get(const struct wheel *w)
+{
+	return (tmr_jiffies() - w->base) / 1000;
+}
+
+
+/* note: the expiry time is always after the current tick */
+static void place(struct wheel *w, struct wheel_ent *ent)
+{
+	uint64_t delta;
+	int lvl;
+
+	if (ent->expires - w->now >= WHEEL_RANGE)
+		ent->expires = w->now + WHEEL_RANGE - 1;
+
+	delta = ent->expires - w->now;
+
+	for (lvl = 0; lvl < WHEEL_LEVELS - 1; lvl++) {
+
+		if (delta < (uint64_t)1 << (WHEEL_BITS * (lvl + 1)))
+			break;
+	}
+
+	list_append(&w->slotv[lvl][(ent->expires >> (WHEEL_BITS * lvl)) &
+				   WHEEL_MASK], &ent->le, ent->le.data);
+}
+
+
+/* move the entries of the current slot of a level down */
+static void cascade(struct wheel *w, int lvl)
+{
+	const uint32_t i = (w->now >> (WHEEL_BITS * lvl)) & WHEEL_MASK;
+	struct list l = LIST_INIT;
+	struct le *le;
+
+	while ((le = list_head(&w->slotv[lvl][i]))) {
+		list_unlink(le);
+		list_append(&l, le, le->data);
+	}
+
+	while ((le = list_head(&l))) {
+		list_unlink(le);
+		place(w, (struct wheel_ent *)(void *)le);
+	}
+}
+
+
+static void tmr_handler(void *arg);
+
+
+static void tmr_schedule(struct wheel *w)
+{
+	const uint64_t next = w->base + (w->now + 1) * 1000;
+	const uint64_t now  = tmr_jiffies();
+
+	tmr_start(&w->tmr, next > now ? next - now : 0, tmr_handler, w);
+}
+
+
+static void tmr_handler(void *arg)
+{
+	struct wheel *w = arg;
+	const uint64_t target = tick_get(w);
+	struct list expired = LIST_INIT;
+	struct le *le;
+
+	while (w->now < target) {
+
+		struct list *slot;
+		int lvl;
+
+		++w->now;
+
+		for (lvl = 1; lvl < WHEEL_LEVELS; lvl++) {
+
+			if (w->now & (((uint64_t)1 << (WHEEL_BITS * lvl)) - 1))
+				break;
+
+			cascade(w, lvl);
+		}
+
+		slot = &w->slotv[0][w->now & WHEEL_MASK];
+
+		while ((le = list_head(slot))) {
+			list_unlink(le);
+			list_append(&expired, le, le->data);
+		}
+	}
+
+	if (expired.head)
+		w->h(&expired, w->arg);
+
+	/* entries that the handler did not remove or start again */
+	while ((le = list_head(&expired))) {
+		list_unlink(le);
+		--w->count;
+	}
+
+	if (w->count)
+		tmr_schedule(w);
+}
+
+
+/**
+ * Allocate a timing wheel
+ *
+ * @param wp  Pointer to allocated timing wheel
+ * @param h   Expiry handler, called with a list of expired entries
+ * @param arg Handler argument
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+int wheel_alloc(struct wheel **wp, wheel_h *h, void *arg)
+{
+	struct wheel *w;
+
+	if (!wp || !h)
+		return EINVAL;
+
+	w = mem_zalloc(sizeof(*w), wheel_destructor);
+	if (!w)
+		return ENOMEM;
+
+	tmr_init(&w->tmr);
+
+	w->base = tmr_jiffies();
+	w->h    = h;
+	w->arg  = arg;
+
+	*wp = w;
+
+	return 0;
+}
+
+
+/**
+ * Start or restart an entry of a timing wheel
+ *
+ * @param w    Timing wheel
+ * @param ent  Wheel entry
+ * @param secs Time until expiry in [seconds], rounded up to a tick
+ * @param data Entry data, passed to the expiry handler
+ */
+void wheel_start(struct wheel *w, struct wheel_ent *ent, uint32_t secs,
+		 void *data)
+{
+	if (!w || !ent)
+		return;
+
+	wheel_cancel(w, ent);
+
+	/* an empty wheel can skip the ticks that it missed */
+	if (!w->count)
+		w->now = tick_get(w);
+
+	ent->expires = (tmr_jiffies() - w->base + secs * 1000ULL + 999) /
+		1000;
+	if (ent->expires <= w->now)
+		ent->expires = w->now + 1;
+
+	ent->le.data = data;
+	place(w, ent);
+	++w->count;
+
+	if (!tmr_isrunning(&w->tmr))
+		tmr_schedule(w);
+}
+
+
+/**
+ * Cancel an entry of a timing wheel
+ *
+ * @param w   Timing wheel
+ * @param ent Wheel entry
+ */
+void wheel_cancel(struct wheel *w, struct wheel_ent *ent)
+{
+	if (!w || !ent || !ent->le.list)
+		return;
+
+	list_unlink(&ent->le);
+	--w->count;
+
+	if (!w->count)
+		tmr_cancel(&w->tmr);
+}
+
+
+/**
+ * Get the time until an entry of a timing wheel expires
+ *
+ * @param w   Timing wheel
+ * @param ent Wheel entry
+ *
+ * @return Time until expiry in [seconds], 0 if not running
+ */
+uint32_t wheel_remaining(const struct wheel *w, const struct wheel_ent *ent)
+{
+	uint64_t now;
+
+	if (!w || !ent || !ent->le.list)
+		return 0;
+
+	now = tick_get(w);
+
+	return ent->expires > now ? (uint32_t)(ent->expires - now) : 0;
+}
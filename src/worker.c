@@ -0,0 +1,541 @@
+/**
+ * @file worker.c  Request processing workers
+ *
+ * Copyright (C) 2010 - 2016 Creytiv.com
+ */
+
+#define _DEFAULT_SOURCE 1
+#include <sys/socket.h>
+#include <linux/filter.h>
+#include <pthread.h>
+#include <string.h>
+#include <re.h>
+#include <repcpd.h>
+#include "pcpd.h"
+
+
+/*
+ * With "workers N" the PCP requests are processed by N threads. Every
+ * worker has its own event loop, its own SO_REUSEPORT socket per listen
+ * address, and owns one shard of the mapping tables: the mappings of
+ * the subscribers for which worker_shard() returns its index. The
+ * request path of a worker takes no locks.
+ *
+ * The kernel steers the requests of a subscriber to its worker, with a
+ * classic BPF program on the SO_REUSEPORT group ("worker_steering"). A
+ * request that arrives at another worker anyway, is passed on to the
+ * owner of the subscriber.
+ *
+ * The main thread keeps the signals and the backend completions of its
+ * own, the journal is written by a thread of its own. The setup and the
+ * teardown of a shard are run in the thread of its worker, with
+ * worker_exec().
+ */
+
+
+enum {
+	WORKERS_MAX = 64,
+	STEER_MAX   = 24,        /* instructions of the steering program */
+};
+
+enum msg_id {
+	MSG_EXEC,
+	MSG_POST,
+	MSG_STOP,
+};
+
+struct worker {
+	pthread_t thread;
+	struct mqueue *mq;
+	uint32_t idx;
+	bool started;
+	bool ready;
+	int err;
+};
+
+/* a handler that is run by a worker, while the caller waits */
+struct exec {
+	worker_exec_h *h;
+	void *arg;
+	bool done;
+	int err;
+};
+
+/* a handler that is run by a worker, without waiting */
+struct post {
+	worker_exec_h *h;
+	void *arg;
+};
+
+
+static struct {
+	struct worker workerv[WORKERS_MAX];
+	uint32_t n;
+	bool steer;
+	pthread_mutex_t mutex;   /* protects ready and done */
+	pthread_cond_t cond;
+} wrk = {
+	.steer = true,
+	.mutex = PTHREAD_MUTEX_INITIALIZER,
+	.cond  = PTHREAD_COND_INITIALIZER,
+};
+
+static __thread struct worker *self;
+
+
+static void post_destructor(void *arg)
+{
+	struct post *post = arg;
+
+	mem_deref(post->arg);
+}
+
+
+static void exec_run(struct exec *ex)
+{
+	ex->err = ex->h(ex->arg);
+
+	pthread_mutex_lock(&wrk.mutex);
+	ex->done = true;
+	pthread_cond_broadcast(&wrk.cond);
+	pthread_mutex_unlock(&wrk.mutex);
+}
+
+
+static void post_run(struct post *post)
+{
+	(void)post->h(post->arg);
+
+	mem_deref(post);
+}
+
+
+static void mqueue_handler(int id, void *data, void *arg)
+{
+	(void)arg;
+
+	switch (id) {
+
+	case MSG_EXEC:
+		exec_run(data);
+		break;
+
+	case MSG_POST:
+		post_run(data);
+		break;
+
+	case MSG_STOP:
+		re_cancel();
+		break;
+	}
+}
+
+
+static void ready(struct worker *w, int err)
+{
+	pthread_mutex_lock(&wrk.mutex);
+	w->err   = err;
+	w->ready = true;
+	pthread_cond_broadcast(&wrk.cond);
+	pthread_mutex_unlock(&wrk.mutex);
+}
+
+
+static void *worker_thread(void *arg)
+{
+	struct worker *w = arg;
+	int err;
+
+	self = w;
+
+	err = re_thread_init();
+	if (err) {
+		ready(w, err);
+		return NULL;
+	}
+
+	err = mqueue_alloc(&w->mq, mqueue_handler, w);
+	if (!err)
+		err = backend_thread_init();
+	if (!err)
+		err = repcpd_udp_attach(w->idx);
+	if (err)
+		goto out;
+
+	ready(w, 0);
+
+	(void)re_main(NULL);
+
+ out:
+	debug("worker %u: %H\n", w->idx, repcpd_pcp_debug, NULL);
+	repcpd_udp_detach(w->idx);
+	repcpd_pcp_thread_close();
+	backend_thread_close();
+	w->mq = mem_deref(w->mq);
+
+	re_thread_close();
+
+	/* a worker that failed to start is gone, when it is ready */
+	if (err)
+		ready(w, err);
+
+	return NULL;
+}
+
+
+static uint32_t steer_hash(const struct sa *sub)
+{
+	uint32_t h = 0, w[4];
+	size_t i;
+
+	switch (sa_af(sub)) {
+
+	case AF_INET:
+		h = sa_in(sub);
+		break;
+
+	case AF_INET6:
+		memcpy(w, &sub->u.in6.sin6_addr, sizeof(w));
+		for (i = 0; i < ARRAY_SIZE(w); i++)
+			h ^= ntohl(w[i]);
+		break;
+	}
+
+	return h ^ h >> 16;
+}
+
+
+/**
+ * Get the shard of a subscriber, i.e. the index of the worker that owns
+ * its mappings. The steering program computes the same function.
+ *
+ * @param addr Address of the subscriber
+ *
+ * @return Shard index
+ */
+uint32_t worker_shard(const struct sa *addr)
+{
+	struct sa sub;
+
+	if (wrk.n < 2 || !addr)
+		return 0;
+
+	repcpd_subscriber(&sub, addr);
+
+	return steer_hash(&sub) % wrk.n;
+}
+
+
+#ifdef SO_ATTACH_REUSEPORT_CBPF
+static void emit(struct sock_filter *prog, uint16_t *n, uint16_t code,
+		 uint32_t k)
+{
+	struct sock_filter *ins = &prog[(*n)++];
+
+	ins->code = code;
+	ins->jt   = 0;
+	ins->jf   = 0;
+	ins->k    = k;
+}
+#endif
+
+
+/**
+ * Attach the steering program to the first socket of a SO_REUSEPORT
+ * group. The sockets of the group must be bound in the order of the
+ * workers.
+ *
+ * @param fd Socket, bound to the listen address
+ * @param af Address family of the socket
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+int worker_steer(int fd, int af)
+{
+#ifdef SO_ATTACH_REUSEPORT_CBPF
+	struct sock_filter prog[STEER_MAX];
+	struct sock_fprog fprog;
+	uint8_t ones[16];
+	uint32_t mask[4];
+	struct sa sa, sub;
+	uint16_t n = 0;
+	uint32_t i;
+
+	if (wrk.n < 2 || !wrk.steer)
+		return 0;
+
+	/* the subscriber address is the source address in the IP header */
+	switch (af) {
+
+	case AF_INET:
+		emit(prog, &n, BPF_LD | BPF_W | BPF_ABS,
+		     (uint32_t)SKF_NET_OFF + 12);
+		break;
+
+	case AF_INET6:
+		memset(ones, 0xff, sizeof(ones));
+		sa_set_in6(&sa, ones, 0);
+		repcpd_subscriber(&sub, &sa);
+		memcpy(mask, &sub.u.in6.sin6_addr, sizeof(mask));
+
+		/* xor of the words of the subscriber prefix */
+		for (i = 0; i < ARRAY_SIZE(mask); i++) {
+
+			emit(prog, &n, BPF_LD | BPF_W | BPF_ABS,
+			     (uint32_t)SKF_NET_OFF + 8 + 4 * i);
+			emit(prog, &n, BPF_ALU | BPF_AND | BPF_K,
+			     ntohl(mask[i]));
+			if (i)
+				emit(prog, &n, BPF_ALU | BPF_XOR | BPF_X, 0);
+			emit(prog, &n, BPF_MISC | BPF_TAX, 0);
+		}
+		break;
+
+	default:
+		return EAFNOSUPPORT;
+	}
+
+	/* see steer_hash() */
+	emit(prog, &n, BPF_MISC | BPF_TAX, 0);
+	emit(prog, &n, BPF_ALU | BPF_RSH | BPF_K, 16);
+	emit(prog, &n, BPF_ALU | BPF_XOR | BPF_X, 0);
+	emit(prog, &n, BPF_ALU | BPF_MOD | BPF_K, wrk.n);
+	emit(prog, &n, BPF_RET | BPF_A, 0);
+
+	fprog.len    = n;
+	fprog.filter = prog;
+
+	if (setsockopt(fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF,
+		       &fprog, sizeof(fprog)) < 0)
+		return errno;
+
+	return 0;
+#else
+	(void)fd;
+	(void)af;
+
+	return wrk.n < 2 || !wrk.steer ? 0 : ENOSYS;
+#endif
+}
+
+
+/**
+ * Run a handler in the thread of a worker, and wait for it
+ *
+ * note: must not be called by a worker, for another worker
+ *
+ * @param idx Worker index
+ * @param h   Handler
+ * @param arg Handler argument
+ *
+ * @return The result of the handler, or an errorcode
+ */
+int worker_exec(uint32_t idx, worker_exec_h *h, void *arg)
+{
+	struct exec ex;
+	int err;
+
+	if (!h)
+		return EINVAL;
+
+	/* without workers, or by the worker itself */
+	if (!wrk.n || (self && self->idx == idx))
+		return h(arg);
+
+	if (idx >= wrk.n || !wrk.workerv[idx].mq)
+		return EINVAL;
+
+	ex.h    = h;
+	ex.arg  = arg;
+	ex.done = false;
+	ex.err  = 0;
+
+	err = mqueue_push(wrk.workerv[idx].mq, MSG_EXEC, &ex);
+	if (err)
+		return err;
+
+	pthread_mutex_lock(&wrk.mutex);
+	while (!ex.done)
+		pthread_cond_wait(&wrk.cond, &wrk.mutex);
+	pthread_mutex_unlock(&wrk.mutex);
+
+	return ex.err;
+}
+
+
+/**
+ * Run a handler in the thread of a worker, without waiting. The
+ * reference counts of libre are not atomic, so the argument is handed
+ * over to the worker, and dereferenced there after the handler.
+ *
+ * @param idx Worker index
+ * @param h   Handler
+ * @param arg Handler argument, handed over (also on error)
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+int worker_post(uint32_t idx, worker_exec_h *h, void *arg)
+{
+	struct post *post;
+	int err;
+
+	if (!h || idx >= worker_count()) {
+		mem_deref(arg);
+		return EINVAL;
+	}
+
+	if (!wrk.n || (self && self->idx == idx)) {
+		(void)h(arg);
+		mem_deref(arg);
+		return 0;
+	}
+
+	post = mem_zalloc(sizeof(*post), post_destructor);
+	if (!post) {
+		mem_deref(arg);
+		return ENOMEM;
+	}
+
+	post->h   = h;
+	post->arg = arg;
+
+	err = mqueue_push(wrk.workerv[idx].mq, MSG_POST, post);
+	if (err)
+		mem_deref(post);
+
+	return err;
+}
+
+
+/**
+ * Get the number of shards of the mapping tables
+ *
+ * @return Number of workers, or 1 without workers
+ */
+uint32_t worker_count(void)
+{
+	return wrk.n ? wrk.n : 1;
+}
+
+
+/**
+ * Get the shard of the calling thread
+ *
+ * @return Worker index, 0 for the main thread
+ */
+uint32_t worker_self(void)
+{
+	return self ? self->idx : 0;
+}
+
+
+/**
+ * Check if the requests are processed by worker threads
+ *
+ * @return True if workers are enabled
+ */
+bool worker_enabled(void)
+{
+	return wrk.n > 0;
+}
+
+
+/* read the config, before the listen sockets are opened */
+int worker_init(void)
+{
+	uint32_t n = 0;
+
+	(void)conf_get_u32(_conf(), "workers", &n);
+	(void)conf_get_bool(_conf(), "worker_steering", &wrk.steer);
+
+	if (n > WORKERS_MAX) {
+		warning("worker: too many workers (%u > %u)\n",
+			n, WORKERS_MAX);
+		return EINVAL;
+	}
+
+	wrk.n = n;
+
+	return 0;
+}
+
+
+/* start the workers, before the mapping tables are allocated */
+int worker_start(void)
+{
+	uint32_t i;
+	int err = 0;
+
+	for (i = 0; i < wrk.n; i++) {
+
+		struct worker *w = &wrk.workerv[i];
+
+		w->idx = i;
+
+		err = pthread_create(&w->thread, NULL, worker_thread, w);
+		if (err)
+			break;
+
+		w->started = true;
+
+		pthread_mutex_lock(&wrk.mutex);
+		while (!w->ready)
+			pthread_cond_wait(&wrk.cond, &wrk.mutex);
+		err = w->err;
+		pthread_mutex_unlock(&wrk.mutex);
+
+		if (err)
+			break;
+	}
+
+	if (err) {
+		warning("worker: could not start worker %u (%m)\n", i, err);
+		return err;
+	}
+
+	if (wrk.n) {
+		info("worker: %u workers started (steering %s)\n", wrk.n,
+		     wrk.steer ? "on" : "off");
+	}
+
+	return 0;
+}
+
+
+static int detach_handler(void *arg)
+{
+	(void)arg;
+
+	repcpd_udp_detach(worker_self());
+
+	return 0;
+}
+
+
+/* stop the workers, after the mapping tables are freed */
+void worker_close(void)
+{
+	uint32_t i;
+
+	/* no more requests are passed on between the workers */
+	for (i = 0; i < wrk.n; i++) {
+		if (wrk.workerv[i].mq)
+			(void)worker_exec(i, detach_handler, NULL);
+	}
+
+	for (i = 0; i < wrk.n; i++) {
+
+		struct worker *w = &wrk.workerv[i];
+
+		if (!w->started)
+			continue;
+
+		if (w->mq)
+			(void)mqueue_push(w->mq, MSG_STOP, NULL);
+
+		pthread_join(w->thread, NULL);
+		w->started = false;
+	}
+
+	memset(wrk.workerv, 0, sizeof(wrk.workerv));
+}